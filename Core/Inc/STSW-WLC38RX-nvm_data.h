@@ -6,6 +6,8 @@
 #define NVM_CFG_VERSION_ID 0x1F47
 #define NVM_PATCH_SIZE 12604
 #define NVM_PATCH_VERSION_ID 0x1437
+#define NVM_IMAGE_CRC32 0xBAECCCB2
+#define NVM_IMAGE_SHA256 0x72,0xAB,0xE8,0xDF,0x0D,0x74,0x35,0x73,0x65,0x3A,0x04,0x97,0x5A,0xE8,0x95,0xE4,0x4F,0x49,0xBC,0x30,0xF9,0x7C,0x33,0x60,0x57,0xD7,0x7D,0x09,0xAA,0xEE,0x96,0x53
 
 const uint8_t nvm_cfg_data[] = {
 
@@ -0,0 +1,43 @@
+/****************************************************************************
+ **                            STMicroelectronics                          **
+ ****************************************************************************
+ *                                                                          *
+ * STWLC38 Wireless Charger Driver (WLC)                                    *
+ *                                                                          *
+ * This is reference driver for STWLC38 wireless charger                    *
+ *                                                                          *
+ ****************************************************************************/
+
+/***************************************************************************
+ * File Name:		console.h
+ * Description:	UART command console: register access, chip info,
+ *					NVM update and benchmarks
+ ****************************************************************************/
+
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+/****************************************************************************
+ * Included files
+ ****************************************************************************/
+#include "stwlc38.h"
+
+/****************************************************************************
+ * Macro definitions
+ ****************************************************************************/
+#define CONSOLE_RX_SIZE					256		/* circular DMA ring */
+#define CONSOLE_MAX_ARGS				(2 + WLC_XFER_MAX_WRITE_LEN + 1)
+#define CONSOLE_MAX_READ_LEN			64
+#define CONSOLE_BENCH_DEFAULT			100
+#define CONSOLE_BENCH_SEG_LEN			WLC_SNAP_FW_LEN	/* bytes per pass */
+#define CONSOLE_BENCH_SEG_MAX			20		/* passes, ~1 s each at 100 kHz */
+#define CONSOLE_OVERLAY_PATCHES			8
+#define CONSOLE_OVERLAY_BYTES			64
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+void console_init(UART_HandleTypeDef *huart);
+void console_poll(void);
+
+#endif
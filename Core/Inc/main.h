@@ -36,7 +36,12 @@ extern "C" {
 
 /* Exported types ------------------------------------------------------------*/
 /* USER CODE BEGIN ET */
-
+/* Run-time clock profiles, see SystemClock_Profile() */
+typedef enum {
+  CLOCK_PROFILE_DEFAULT,    /* 64 MHz HSI/PLL, SystemClock_Config() */
+  CLOCK_PROFILE_PERF,       /* 80 MHz HSI/PLL, voltage range 1 */
+  CLOCK_PROFILE_LOWPOWER,   /* 4 MHz MSI, voltage range 2 */
+} clock_profile_t;
 /* USER CODE END ET */
 
 /* Exported constants --------------------------------------------------------*/
@@ -53,7 +58,7 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
-
+void SystemClock_Profile(clock_profile_t profile);
 /* USER CODE END EFP */
 
 /* Private defines -----------------------------------------------------------*/
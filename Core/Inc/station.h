@@ -0,0 +1,93 @@
+/****************************************************************************
+ **                            STMicroelectronics                          **
+ ****************************************************************************
+ *                                                                          *
+ * STWLC38 Wireless Charger Driver (WLC)                                    *
+ *                                                                          *
+ * This is reference driver for STWLC38 wireless charger                    *
+ *                                                                          *
+ ****************************************************************************/
+
+/***************************************************************************
+ * File Name:		station.h
+ * Description:	Production station mode: wait for a unit on the fixture,
+ *					update and verify it, report, wait for its removal
+ ****************************************************************************/
+
+#ifndef STATION_H
+#define STATION_H
+
+/****************************************************************************
+ * Included files
+ ****************************************************************************/
+#include "stwlc38.h"
+
+/****************************************************************************
+ * Macro definitions
+ ****************************************************************************/
+#define STATION_PROBE_MIN_MS			10		/* first probe after a miss */
+#define STATION_PROBE_MAX_MS			320		/* backoff ceiling, fixture empty */
+#define STATION_SETTLE_MS				50		/* contact bounce after the first ACK */
+#define STATION_REMOVE_POLL_MS			100
+#define STATION_REMOVE_MISSES			3		/* NACKs in a row for a removal */
+
+/****************************************************************************
+ * Enumerations
+ ****************************************************************************/
+typedef enum {
+	STATION_PHASE_CHECK		= 0,	/* identity check and update decision */
+	STATION_PHASE_PROGRAM	= 1,
+	STATION_PHASE_VERIFY	= 2,	/* NVM read-back, SAMPLE or FULL level */
+	STATION_PHASE_UNIT		= 3,	/* whole unit, settled to result */
+	STATION_PHASE_HANDLING	= 4,	/* removal to the next unit, operator */
+	STATION_PHASE_COUNT
+} station_phase_t;
+
+typedef enum {
+	STATION_PASS	= 0,	/* programmed and verified */
+	STATION_SKIP	= 1,	/* already up to date */
+	STATION_FAIL	= 2
+} station_result_t;
+
+/****************************************************************************
+ * Structures
+ ****************************************************************************/
+/* Result record of one unit, see station_unit_done() */
+struct station_unit {
+	u32 serial;				/* unit number in the shift, from 1 */
+	station_result_t result;
+	int err;
+	u16 nvm_patch_id;		/* as found, before the update */
+	u16 config_id;
+	u32 phase_ms[STATION_PHASE_COUNT];	/* 0 for a phase that did not run */
+};
+
+struct station_time {
+	u32 count;
+	u32 total_ms;
+	u32 min_ms;
+	u32 max_ms;
+};
+
+/* Shift statistics, kept until station_reset_stats() */
+struct station_stats {
+	u32 units;
+	u32 passed;
+	u32 skipped;
+	u32 failed;
+	u32 shift_ms;
+	u32 units_per_hour;
+	struct station_time phase[STATION_PHASE_COUNT];
+};
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+void station_init(void);
+void station_poll(void);
+void station_get_stats(struct station_stats *stats);
+void station_reset_stats(void);
+void station_report(void);
+void station_unit_done(const struct station_unit *unit);
+
+#endif
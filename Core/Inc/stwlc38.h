@@ -25,7 +25,11 @@
 /****************************************************************************
  * Included files
  ****************************************************************************/
+#ifdef WLC_HOST_LINUX
+#include "wlc_host.h"	/* HAL subset on Linux i2c-dev, see host/linux */
+#else
 #include "main.h"
+#endif
 
 
 /****************************************************************************
@@ -35,6 +39,7 @@
 #define NVM_SECTOR_SIZE_BYTES			256
 #define NVM_PATCH_START_SECTOR_INDEX	0
 #define NVM_CFG_START_SECTOR_INDEX		126
+#define NVM_CFG_ID_OFFSET				0		/* little endian, in the cfg image */
 
 /* FW registers */
 #define FWREG_CHIP_ID_ADDR				0x0000
@@ -49,6 +54,12 @@
 #define HWREG_HW_VER_ADDR				0x2001C002
 #define HWREG_TM_CONFIG_ADDR			0x2001C166
 #define HWREG_RST_ADDR					0x2001F200
+/*
+ * RRAM read window: not given by any ST document in this tree and not yet
+ * confirmed on a chip. wlc_nvm_window_check() tests it against the cfg id
+ * the FW reports before any read-back through it is used.
+ */
+#define HWREG_NVM_BASE_ADDR				0x00060000
 
 #define WRITE_READ_OPERATION			0x01
 #define WRITE_OPERATION					0x02
@@ -58,8 +69,38 @@
 #define CMD_STR_LEN						1024
 
 #define I2C_CHUNK_SIZE					256
+#define WLC_CHIP_INFO_LEN				14
+#define WLC_REG_CACHE_MAX_LEN			16
+#define WLC_XFER_MAX_WRITE_LEN			8
+#define WLC_SEG_WRITE_BATCH				4
+#define WLC_VERIFY_LEVEL_DEFAULT		WLC_VERIFY_ID
+#define WLC_VERIFY_SAMPLE_STRIDE		8	/* 1 in n sectors at SAMPLE level */
+#define WLC_PROGRESS_SMOOTHING			4	/* 1/weight of a new rate sample */
+#define WLC_PROBE_TIMEOUT_MS			2	/* address-only probe */
+#define WLC_I2C_BYTE_US					90	/* one byte and its ACK at 100 kHz */
+
+/* Register snapshot, see wlc_snapshot_dump() */
+#define WLC_SNAP_MAGIC					0x504E5357	/* "WSNP" */
+#define WLC_SNAP_VERSION				1
+#define WLC_SNAP_FW_START				0x0000
+#define WLC_SNAP_FW_LEN					0x0200
+#define WLC_SNAP_SPACE_FW				0
+#define WLC_SNAP_SPACE_HW				1
+#define WLC_SNAP_SPACE_END				0xFF	/* last record, no data */
+
+/* First RTC backup register of the 6 used for the programming checkpoint */
+#define WLC_CKPT_BKP_BASE				0
+
+/* Default retry policy */
+#define WLC_RETRY_ATTEMPTS				4
+#define WLC_RETRY_SECTOR_ATTEMPTS		3
+#define WLC_RETRY_BACKOFF_MS			1
+#define WLC_RETRY_BACKOFF_FACTOR		2
+/* Fixed waits of old, now upper bounds of the readiness polls */
 #define AFTER_SYS_RESET_SLEEP_MS		50
 #define GENERAL_SLEEP_MS				10
+#define I2C_RESET_SLEEP_MS				20		/* twice, around re-init */
+#define WLC_READY_POLL_MS				1
 
 /* Error codes */
 #define OK								0x00000000
@@ -74,16 +115,24 @@
 #define E_TIMEOUT						0x80000009
 #define E_NVM_DATA_MISMATCH				0x8000000A
 #define E_UNEXPECTED_CHIP_ID			0x8000000B
+#define E_NVM_DELTA_SOURCE				0x8000000C
+#define E_NVM_WINDOW					0x8000000D
 #define E_NO_FILE						0x8000000E
 #define E_FILE_PARSE					0x8000000F
 
 //#define UBIN
-#ifdef UBIN
 #define BIN_HEADER_SIZE					(32 + 4) /* /< fw ubin main header size including crc */
 #define SECTION_HEADER_SIZE				20 /* /< fw ubin section header size */
 #define BIN_HEADER						0xBABEFACE /* /< fw ubin main header identifier constant */
 #define SECTION_HEADER					0xB16B00B5 /* /< fw ubin section header identifier constant */
-#endif
+
+/* UBIN layout: offsets in the main header and in each section header */
+#define BIN_HDR_SIGNATURE				4
+#define BIN_HDR_CHIP_ID					9	/* little endian */
+#define BIN_HDR_CUT_ID					27
+#define SECTION_HDR_TYPE				4
+#define SECTION_HDR_VERSION_ID			6
+#define SECTION_HDR_SIZE				8
 
 #define CHIP_ID 						0X0026
 
@@ -97,6 +146,40 @@
 
 #define PAGE_SIZE						1024
 //#define DEBUG_I2C
+#ifndef USE_STATIC_ALLOC_RW
+#define USE_STATIC_ALLOC_RW				0	/* 1: no heap use at all */
+#endif
+#define WLC_RW_BUF_SIZE					(5 + NVM_SECTOR_SIZE_BYTES)	/* largest write frame */
+#define WLC_STACK_PAINT					0xA5A5A5A5
+#ifndef WLC_ZERO_COPY
+#define WLC_ZERO_COPY					1	/* 0: stage sector data through RAM */
+#endif
+#define WLC_NVM_ERASED_BYTE				0x00	/* content of an erased NVM byte */
+#define WLC_NVM_MAX_SECTORS				256		/* sector index is 8 bit */
+#ifndef WLC_SRAM2_CODE
+#define WLC_SRAM2_CODE					1	/* 0: run everything from FLASH */
+#endif
+#ifndef WLC_DIGEST_SHA256
+#define WLC_DIGEST_SHA256				0	/* 1: SHA-256 image digest next to CRC32 */
+#endif
+
+/* Functions executed from SRAM2, see .ram2_text in the linker script */
+#if WLC_SRAM2_CODE && defined(__GNUC__) && !defined(WLC_HOST_LINUX)
+#define WLC_SRAM2_FUNC	__attribute__((section(".RamFunc2"), noinline))
+#else
+#define WLC_SRAM2_FUNC
+#endif
+//#define WLC_TRACE	/* RAM ring of I2C transactions, see wlc_trace_dump() */
+
+#ifdef WLC_TRACE
+#define WLC_TRACE_DEPTH					256		/* records, power of 2 */
+#define WLC_TRACE_MAGIC					0x43525457	/* "WTRC" */
+#define WLC_TRACE_VERSION				1
+#define WLC_TRACE_F_READ				0x01
+#define WLC_TRACE_F_SYSREG				0x02
+#define WLC_TRACE_F_LIST				0x04	/* step of wlc_xfer_run() */
+#define WLC_TRACE_RETRY_SHIFT			4
+#endif
 /****************************************************************************
  * Enums
  ****************************************************************************/
@@ -106,13 +189,54 @@ typedef enum {
 	FW_OP_MODE_TX	= 3
 } fw_op_mode_t;
 
-#ifdef UBIN
+/*
+ * Checks after programming, by bus cost. Read-back goes through the RRAM
+ * window at the I2C rate once the window passed its check (E_NVM_WINDOW
+ * if not): FULL reads the whole image, about 1.2 s for a 13 KB image at
+ * 100 kHz. SAMPLE reads 1 in WLC_VERIFY_SAMPLE_STRIDE sectors of each
+ * area plus its last one, about a sixth of that. ID is a single 14 byte
+ * read.
+ */
+typedef enum {
+	WLC_VERIFY_NONE		= 0,	/* no check after programming */
+	WLC_VERIFY_ID		= 1,	/* patch and cfg id read-back */
+	WLC_VERIFY_SAMPLE	= 2,	/* id + byte compare of sampled sectors */
+	WLC_VERIFY_FULL		= 3		/* id + byte compare of every image byte */
+} wlc_verify_level_t;
+
+typedef enum {
+	WLC_XFER_FW_WRITE	= 0,
+	WLC_XFER_HW_WRITE	= 1,
+	WLC_XFER_FW_READ	= 2,
+	WLC_XFER_HW_READ	= 3,
+	WLC_XFER_DELAY		= 4,
+	WLC_XFER_WAIT_READY	= 5		/* wlc_wait_ready(), addr is the bound */
+} wlc_xfer_type_t;
+
+typedef enum {
+	WLC_READY_ACK		= 0,	/* chip ACKs its address */
+	WLC_READY_FW		= 1		/* and reads a valid chip id and op mode */
+} wlc_ready_t;
+
+typedef enum {
+	WLC_PROGRESS_PREPARE	= 0,	/* reset to DC mode, checkpoint check */
+	WLC_PROGRESS_PATCH		= 1,
+	WLC_PROGRESS_CFG		= 2,
+	WLC_PROGRESS_VERIFY		= 3,	/* NVM read-back */
+	WLC_PROGRESS_DONE		= 4		/* err is the result of the update */
+} wlc_progress_phase_t;
+
+/* Segment handler of wlc_seg_read(), offset is relative to the start */
+typedef int (*wlc_seg_cb_t)(void *ctx, u32 offset, const u8 *data, u16 len);
+
 typedef enum {
 	WLC_FW_PATCH	= 0x0010,
 	WLC_FW_CONFIG	= 0x0011,
-
+	WLC_FW_SECTION_END				/* first unknown section type */
 } fw_section_t;
-#endif
+
+#define WLC_FW_SECTION_FIRST			WLC_FW_PATCH
+#define WLC_FW_SECTION_COUNT			(WLC_FW_SECTION_END - WLC_FW_SECTION_FIRST)
 
 /****************************************************************************
  * Structures
@@ -129,6 +253,189 @@ struct wlc_chip_info {
 	u8 cut_id;
 };
 
+/*
+ * One step of a register transaction list run by wlc_xfer_run().
+ * addr holds the delay in ms for WLC_XFER_DELAY steps and the bound for
+ * WLC_XFER_WAIT_READY steps; write payloads up to WLC_XFER_MAX_WRITE_LEN
+ * bytes are copied, longer ones sent in place.
+ */
+struct wlc_xfer {
+	wlc_xfer_type_t type;
+	u32 addr;
+	u8 *data;
+	u16 len;
+};
+
+/*
+ * Digest of the image bytes sent to the NVM sectors, patch then cfg,
+ * computed while programming. crc32 is final (inverted) as calculate_crc().
+ */
+struct wlc_nvm_digest {
+	u32 bytes;
+	u32 crc32;
+#if WLC_DIGEST_SHA256
+	u8 sha256[32];
+#endif
+	int manifest;		/* 1: matches the image manifest, 0: differs, -1: none */
+};
+
+struct wlc_verify_report {
+	wlc_verify_level_t level;
+	int err;
+	u32 sectors;
+	u32 bytes_read;
+	u32 elapsed_ms;
+	int bad_sector;		/* -1 if no mismatch */
+	int bad_offset;		/* first mismatching byte in bad_sector */
+	struct wlc_nvm_digest digest;	/* of the update just programmed */
+};
+
+/* One patch of a cfg overlay: len bytes at offset of the cfg image */
+struct wlc_cfg_patch {
+	u16 offset;
+	u16 len;
+	const u8 *data;
+};
+
+/*
+ * Update progress, passed to the callback set by wlc_set_progress_cb()
+ * once at the start of each phase and after every sector. Sector and byte
+ * counts cover programming (patch and cfg), or read-back in the VERIFY
+ * phase; bytes_sent leaves out sectors skipped or resumed.
+ */
+struct wlc_progress {
+	wlc_progress_phase_t phase;
+	int err;
+	u16 sectors_done;
+	u16 sectors_total;
+	u32 bytes_sent;
+	u32 elapsed_ms;		/* since the update started */
+	u32 rate;			/* bytes/s, smoothed over the last sectors */
+	u32 eta_ms;			/* 0 until a rate is known */
+};
+
+/* The per-sector log lines are left out while a callback is set */
+typedef void (*wlc_progress_cb_t)(void *ctx, const struct wlc_progress *progress);
+
+/*
+ * Transaction n (n >= 1) is preceded by a backoff of
+ * backoff_ms * backoff_factor^(n-1) ms, then escalates: 1st retry as is,
+ * 2nd after a 9-clock bus unstick, later ones after a peripheral reinit.
+ */
+struct wlc_retry_policy {
+	u8 attempts;			/* per I2C transaction */
+	u8 sector_attempts;		/* per NVM sector in wlc_nvm_write_bulk */
+	u16 backoff_ms;
+	u8 backoff_factor;
+};
+
+struct wlc_retry_stats {
+	u32 retries;
+	u32 bus_unsticks;
+	u32 reinits;
+	u32 sector_retries;
+	u32 failures;
+};
+
+struct wlc_reg_cache_stats {
+	u32 hits;
+	u32 misses;
+	u32 invalidations;
+};
+
+#ifdef WLC_TRACE
+/* Trace dump: one header followed by count records, little endian */
+struct wlc_trace_header {
+	u32 magic;
+	u16 version;
+	u16 rec_size;
+	u32 count;
+	u32 dropped;		/* records overwritten before the dump */
+	u32 cpu_hz;			/* DWT cycle counter clock */
+};
+
+struct wlc_trace_rec {
+	u32 timestamp;		/* DWT cycles at transaction start */
+	u32 duration;		/* DWT cycles until completion */
+	u32 addr;			/* FW or SYSREG register address */
+	u16 length;			/* payload bytes */
+	u8 flags;			/* WLC_TRACE_F_*, retries in the upper nibble */
+	u8 status;			/* HAL_StatusTypeDef */
+};
+#endif
+
+/* Sector write cost, reset at the start of each NVM programming */
+struct wlc_nvm_write_stats {
+	u32 sectors;
+	u32 cycles;				/* DWT cycles spent in sector writes */
+	u32 copied_bytes;		/* sector payload bytes copied before the bus */
+	u32 skipped;			/* blank sectors left to the erased target */
+};
+
+/* Readiness polls and the time they saved on the fixed waits */
+struct wlc_ready_stats {
+	u32 waits;
+	u32 timeouts;			/* bound reached, chip still not ready */
+	u32 waited_ms;
+	u32 bound_ms;			/* what the fixed waits would have taken */
+};
+
+/* I2C interrupt cost, entry to exit of the I2C1 handlers */
+struct wlc_isr_stats {
+	u32 count;
+	u32 total;				/* DWT cycles */
+	u32 min;
+	u32 max;
+};
+
+/* RAM usage of the driver, see wlc_mem_report() */
+struct wlc_mem_stats {
+	u32 stack_reserved;		/* _Min_Stack_Size of the linker script */
+	u32 stack_peak;			/* deepest stack use since wlc_mem_paint_stack() */
+	u32 heap_reserved;		/* _Min_Heap_Size of the linker script */
+	u32 heap_peak;			/* heap footprint (sbrk high-water) */
+	u32 heap_in_use;
+	u32 static_pool;		/* .bss buffer used instead of the heap */
+	u32 heap_demand;		/* peak driver allocations, served from the heap
+							   or from static_pool and the image in place */
+};
+
+/*
+ * Snapshot stream: one header, then one record per chunk read followed by
+ * 'length' data bytes (none if status is not HAL_OK), then an END record.
+ */
+struct wlc_snap_header {
+	u32 magic;
+	u16 version;
+	u16 rec_size;		/* sizeof(struct wlc_snap_rec) */
+	u32 timestamp_ms;	/* HAL_GetTick() */
+	u16 chip_id;
+	u16 chunk_size;		/* I2C_CHUNK_SIZE */
+};
+
+struct wlc_snap_rec {
+	u32 addr;
+	u16 length;
+	u8 space;			/* WLC_SNAP_SPACE_* */
+	u8 status;			/* HAL_StatusTypeDef of the read */
+};
+
+/* Section of a UBIN file, found by ubin_index_build() */
+struct ubin_section {
+	u16 version_id;
+	u32 size;
+	u32 offset;			/* of the payload in the file, 0: no such section */
+};
+
+/* Sections of a UBIN file by fw_section_t, see ubin_section_get() */
+struct ubin_index {
+	u16 chip_id;
+	u8 chip_revision;
+	u16 unknown;		/* sections of other types, skipped */
+	u32 error_offset;	/* where a malformed file stopped the walk */
+	struct ubin_section section[WLC_FW_SECTION_COUNT];
+};
+
 #ifdef UBIN
 struct firmware_file {
 	u16 chip_id;
@@ -149,6 +456,59 @@ void pr_info(char *msg, ...);
 
 int chip_info_show(char *buf);
 int nvm_program_show(char *buf);
+int nvm_check_show(char *buf);
+
+u32 wlc_cycles(void);
+void wlc_isr_account(u32 start);
+void wlc_isr_stats_reset(void);
+void wlc_isr_report(void);
+#ifdef WLC_TRACE
+void wlc_trace_clear(void);
+void wlc_trace_dump(void);
+#endif
+void wlc_set_retry_policy(const struct wlc_retry_policy *policy);
+void wlc_get_retry_stats(struct wlc_retry_stats *stats);
+HAL_StatusTypeDef wlc_i2c_write(uint8_t *cmd, int cmd_length);
+int wlc_i2c_probe(void);
+HAL_StatusTypeDef wlc_i2c_read(uint8_t *cmd, int cmd_length,
+							   uint8_t *read_data, int read_count);
+int wlc_xfer_run(const struct wlc_xfer *seq, int count);
+int wlc_xfer_start(const struct wlc_xfer *seq, int count);
+int wlc_xfer_wait(void);
+int wlc_seg_read(int hw, u32 addr, u32 len, u16 seg_len, wlc_seg_cb_t cb,
+				 void *ctx);
+int wlc_seg_write(int hw, u32 addr, const u8 *data, u32 len);
+u32 wlc_crc32_update(u32 crc, const u8 *data, int size);
+int u8_to_u32_be(const u8 *src, u32 *dst);
+int u8_to_u16_be(const u8 *src, u16 *dst);
+int ubin_index_build(const u8 *data, u32 size, struct ubin_index *index);
+#ifdef UBIN
+int parse_ubin_file(u8 *ubin_data, int ubin_size, struct firmware_file *fw_data);
+#endif
+const struct ubin_section *ubin_section_get(const struct ubin_index *index,
+										   fw_section_t type);
+int wlc_nvm_resume_pending(void);
+void wlc_set_verify_level(wlc_verify_level_t level);
+void wlc_get_verify_report(struct wlc_verify_report *report);
+void wlc_set_progress_cb(wlc_progress_cb_t cb, void *ctx);
+void wlc_nvm_resume_cancel(void);
+int wlc_set_cfg_overlay(const struct wlc_cfg_patch *patches, int count,
+						u16 config_id);
+int wlc_read_chip_info(struct wlc_chip_info *info, int refresh);
+int wlc_snapshot_dump(void);
+void wlc_reg_cache_invalidate(void);
+void wlc_reg_cache_get_stats(struct wlc_reg_cache_stats *stats);
+void wlc_get_nvm_write_stats(struct wlc_nvm_write_stats *stats);
+int wlc_wait_ready(u32 max_ms, wlc_ready_t level, const char *what);
+void wlc_get_ready_stats(struct wlc_ready_stats *stats);
+void wlc_set_nvm_target_erased(int erased);
+void wlc_platform_enter_update(void);
+void wlc_platform_exit_update(void);
+void wlc_platform_poll(void);
+int wlc_update_active(void);
+void wlc_mem_paint_stack(void);
+void wlc_mem_get_stats(struct wlc_mem_stats *stats);
+void wlc_mem_report(void);
 
 
 #endif
@@ -35,13 +35,22 @@ extern "C" {
 extern UART_HandleTypeDef huart2;
 
 /* USER CODE BEGIN Private defines */
+#define UART_BAUD_DEFAULT     115200U
+#define UART_BAUD_OFFER_MS    300U    /* wait for a host answer at start-up */
+#define UART_BAUD_TEST_MS     200U
+#define UART_BAUD_TEST_LEN    256U
+#define UART_BAUD_SWITCH_MS   20U     /* host turnaround after @RATE */
 
+extern DMA_HandleTypeDef hdma_usart2_rx;
 /* USER CODE END Private defines */
 
 void MX_USART2_UART_Init(void);
 
 /* USER CODE BEGIN Prototypes */
-
+uint32_t UART_Baud_Negotiate(UART_HandleTypeDef *huart);
+int UART_Baud_Apply(UART_HandleTypeDef *huart, uint32_t baud);
+uint32_t UART_Baud_Select(uint32_t pclk);
+void UART_Baud_Announce(UART_HandleTypeDef *huart, uint32_t baud);
 /* USER CODE END Prototypes */
 
 #ifdef __cplusplus
@@ -0,0 +1,508 @@
+/***************************************************************************
+ * File Name:		console.c
+ * Description:		Line based command console on the log UART. Input is
+ *					received by circular DMA and parsed from
+ *					console_poll(), which never blocks on the UART.
+ ***************************************************************************/
+
+/***************************************************************************
+ * Included files
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include "console.h"
+#ifndef WLC_HOST_LINUX
+#include "i2c.h"
+#endif
+#ifdef WLC_STATION
+#include "station.h"
+#endif
+
+/***************************************************************************
+ * Private types
+ ***************************************************************************/
+struct console_cmd {
+	const char *name;
+	const char *usage;
+	int (*handler)(int argc, char **argv);
+	u8 safe;		/* allowed while an NVM update owns the bus */
+};
+
+/***************************************************************************
+ * Private variables
+ ***************************************************************************/
+static UART_HandleTypeDef *con_uart = NULL;
+static u8 rx_ring[CONSOLE_RX_SIZE];
+static u32 rx_tail;
+static char line[CMD_STR_LEN];
+static u32 line_len;
+static u8 line_overflow;
+static char out[PAGE_SIZE];
+static const struct console_cmd *cmd_table;	/* commands[], for help */
+static struct wlc_cfg_patch overlay[CONSOLE_OVERLAY_PATCHES];
+static u8 overlay_bytes[CONSOLE_OVERLAY_BYTES];
+
+#ifdef WLC_HOST_LINUX
+extern I2C_HandleTypeDef *hi2c;
+#endif
+
+/***************************************************************************
+ * Output
+ ***************************************************************************/
+static void con_printf(const char *fmt, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(out, sizeof(out), fmt, args);
+	va_end(args);
+	if (len > (int)sizeof(out) - 1)
+		len = sizeof(out) - 1;
+	if (len > 0)
+		HAL_UART_Transmit(con_uart, (u8 *)out, len, 1000);
+}
+
+/***************************************************************************
+ * Commands
+ ***************************************************************************/
+static int parse_space(const char *arg, int *hw)
+{
+	if (strcmp(arg, "fw") == 0)
+		*hw = 0;
+	else if (strcmp(arg, "hw") == 0)
+		*hw = 1;
+	else
+		return E_INVALID_INPUT;
+	return OK;
+}
+
+static int cmd_help(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; cmd_table[i].name; i++)
+		con_printf("  %-8s %s\r\n", cmd_table[i].name, cmd_table[i].usage);
+	return OK;
+}
+
+static int cmd_info(int argc, char **argv)
+{
+	static char buf[PAGE_SIZE];
+
+	chip_info_show(buf);
+	con_printf("%s", buf);
+	return OK;
+}
+
+static int cmd_check(int argc, char **argv)
+{
+	static char buf[PAGE_SIZE];
+
+	nvm_check_show(buf);
+	con_printf("%s", buf);
+	return OK;
+}
+
+static int cmd_update(int argc, char **argv)
+{
+	static char buf[PAGE_SIZE];
+
+	nvm_program_show(buf);
+	con_printf("%s", buf);
+	return OK;
+}
+
+/* rd fw|hw <addr> <len> */
+static int cmd_read(int argc, char **argv)
+{
+	u8 data[CONSOLE_MAX_READ_LEN];
+	struct wlc_xfer step;
+	int hw;
+	int len;
+	int err;
+	int i;
+
+	if (argc != 4 || parse_space(argv[1], &hw) != OK)
+		return E_INVALID_INPUT;
+	len = (int)strtoul(argv[3], NULL, 0);
+	if (len <= 0 || len > CONSOLE_MAX_READ_LEN)
+		return E_INVALID_INPUT;
+
+	step.type = hw ? WLC_XFER_HW_READ : WLC_XFER_FW_READ;
+	step.addr = strtoul(argv[2], NULL, 0);
+	step.data = data;
+	step.len = len;
+	err = wlc_xfer_run(&step, 1);
+	if (err != OK)
+		return err;
+
+	for (i = 0; i < len; i++)
+		con_printf("%02X%s", data[i],
+				   (i % 16 == 15 || i == len - 1) ? "\r\n" : " ");
+	return OK;
+}
+
+/* wr fw|hw <addr> <byte>... */
+static int cmd_write(int argc, char **argv)
+{
+	u8 data[WLC_XFER_MAX_WRITE_LEN];
+	struct wlc_xfer step;
+	int hw;
+	int i;
+
+	if (argc < 4 || argc - 3 > WLC_XFER_MAX_WRITE_LEN ||
+		parse_space(argv[1], &hw) != OK)
+		return E_INVALID_INPUT;
+
+	for (i = 3; i < argc; i++)
+		data[i - 3] = (u8)strtoul(argv[i], NULL, 0);
+
+	step.type = hw ? WLC_XFER_HW_WRITE : WLC_XFER_FW_WRITE;
+	step.addr = strtoul(argv[2], NULL, 0);
+	step.data = data;
+	step.len = argc - 3;
+	return wlc_xfer_run(&step, 1);
+}
+
+/*
+ * overlay <cfg_id> [<offset>=<hex bytes>]... | overlay clear: cfg overlay
+ * of the next updates, e.g. overlay 0x1F48 0x40=0012AB34
+ */
+static int cmd_overlay(int argc, char **argv)
+{
+	char byte[3] = { 0 };
+	char *hex;
+	u32 used = 0;
+	int count;
+
+	if (argc < 2)
+		return E_INVALID_INPUT;
+	if (strcmp(argv[1], "clear") == 0)
+		return wlc_set_cfg_overlay(NULL, 0, 0);
+
+	for (count = 0; count < argc - 2; count++) {
+		hex = strchr(argv[count + 2], '=');
+		if (hex == NULL || count == CONSOLE_OVERLAY_PATCHES)
+			return E_INVALID_INPUT;
+		overlay[count].offset = (u16)strtoul(argv[count + 2], NULL, 0);
+		overlay[count].data = &overlay_bytes[used];
+		overlay[count].len = 0;
+		for (hex++; hex[0] && hex[1]; hex += 2) {
+			if (used == CONSOLE_OVERLAY_BYTES)
+				return E_INVALID_INPUT;
+			byte[0] = hex[0];
+			byte[1] = hex[1];
+			overlay_bytes[used++] = (u8)strtoul(byte, NULL, 16);
+			overlay[count].len++;
+		}
+		if (overlay[count].len == 0 || *hex)
+			return E_INVALID_INPUT;
+	}
+	return wlc_set_cfg_overlay(overlay, count,
+							   (u16)strtoul(argv[1], NULL, 0));
+}
+
+/* Nominal SCL rate from TIMINGR, without the clock synchronisation delays */
+static u32 i2c_scl_hz(void)
+{
+#ifdef WLC_HOST_LINUX
+	return hi2c->SclHz;
+#else
+	u32 timingr = hi2c1.Instance->TIMINGR;
+	u32 presc = ((timingr & I2C_TIMINGR_PRESC) >> I2C_TIMINGR_PRESC_Pos) + 1;
+	u32 scll = (timingr & I2C_TIMINGR_SCLL) + 1;
+	u32 sclh = ((timingr & I2C_TIMINGR_SCLH) >> I2C_TIMINGR_SCLH_Pos) + 1;
+
+	return HAL_RCC_GetPCLK1Freq() / (presc * (scll + sclh));
+#endif
+}
+
+/* Segment handler of the bench: the same CRC work the verification does */
+static int bench_seg(void *ctx, u32 offset, const u8 *data, u16 len)
+{
+	*(u32 *)ctx = wlc_crc32_update(*(u32 *)ctx, data, len);
+	return OK;
+}
+
+/* FW register window read one blocking chunk at a time, then segmented */
+static int bench_seg_read(u32 n)
+{
+	struct wlc_xfer step;
+	u32 mhz = SystemCoreClock / 1000000;
+	u32 bytes = n * CONSOLE_BENCH_SEG_LEN;
+	u32 line_bps = i2c_scl_hz() / 9;
+	u32 crc = 0xFFFFFFFF;
+	u32 start;
+	u32 us;
+	u32 offset;
+	u32 i;
+	int err;
+
+	start = wlc_cycles();
+	for (i = 0; i < n; i++) {
+		for (offset = 0; offset < CONSOLE_BENCH_SEG_LEN;
+			 offset += I2C_CHUNK_SIZE) {
+			step.type = WLC_XFER_FW_READ;
+			step.addr = WLC_SNAP_FW_START + offset;
+			step.data = (u8 *)out;
+			step.len = I2C_CHUNK_SIZE;
+			err = wlc_xfer_run(&step, 1);
+			if (err != OK)
+				return err;
+			crc = wlc_crc32_update(crc, (u8 *)out, I2C_CHUNK_SIZE);
+		}
+	}
+	us = (wlc_cycles() - start) / mhz;
+	con_printf("chunked read: %lu B/s\r\n",
+			   (unsigned long)(1000000ULL * bytes / us));
+
+	start = wlc_cycles();
+	for (i = 0; i < n; i++) {
+		err = wlc_seg_read(0, WLC_SNAP_FW_START, CONSOLE_BENCH_SEG_LEN, 0,
+						   bench_seg, &crc);
+		if (err != OK)
+			return err;
+	}
+	us = (wlc_cycles() - start) / mhz;
+	con_printf("segmented read: %lu B/s, line rate %lu B/s\r\n",
+			   (unsigned long)(1000000ULL * bytes / us),
+			   (unsigned long)line_bps);
+	return OK;
+}
+
+/* bench [n]: chip id read latency, read throughput and CRC32 throughput */
+static int cmd_bench(int argc, char **argv)
+{
+	struct wlc_chip_info info;
+	u32 n = argc > 1 ? strtoul(argv[1], NULL, 0) : CONSOLE_BENCH_DEFAULT;
+	u32 mhz = SystemCoreClock / 1000000;
+	u32 start;
+	u32 cycles;
+	u32 i;
+	int err;
+
+	if (n == 0)
+		return E_INVALID_INPUT;
+
+	start = wlc_cycles();
+	for (i = 0; i < n; i++) {
+		err = wlc_read_chip_info(&info, 1);
+		if (err != OK)
+			return err;
+	}
+	cycles = wlc_cycles() - start;
+	con_printf("chip info read (%d bytes): %lu us avg over %lu\r\n",
+			   WLC_CHIP_INFO_LEN, (unsigned long)(cycles / n / mhz),
+			   (unsigned long)n);
+
+	err = bench_seg_read(n > CONSOLE_BENCH_SEG_MAX
+						 ? CONSOLE_BENCH_SEG_MAX : n);
+	if (err != OK)
+		return err;
+
+	/* 16 KB of our own flash image as CRC input */
+	start = wlc_cycles();
+	wlc_crc32_update(0, (const u8 *)FLASH_BASE, 16384);
+	cycles = wlc_cycles() - start;
+	con_printf("crc32: %lu cycles/KB, %lu KB/s\r\n",
+			   (unsigned long)(cycles / 16),
+			   (unsigned long)(16ULL * SystemCoreClock / cycles));
+	return OK;
+}
+
+static int cmd_stats(int argc, char **argv)
+{
+	struct wlc_retry_stats retry;
+	struct wlc_reg_cache_stats cache;
+	struct wlc_nvm_write_stats nvm;
+	struct wlc_ready_stats ready;
+
+	wlc_get_retry_stats(&retry);
+	wlc_get_ready_stats(&ready);
+	wlc_reg_cache_get_stats(&cache);
+	wlc_get_nvm_write_stats(&nvm);
+	con_printf("update %s, clock %lu MHz\r\n",
+			   wlc_update_active() ? "running" : "idle",
+			   (unsigned long)(SystemCoreClock / 1000000));
+	con_printf("sectors written %lu skipped %lu\r\n",
+			   (unsigned long)nvm.sectors, (unsigned long)nvm.skipped);
+	con_printf("i2c retries %lu unsticks %lu reinits %lu failures %lu\r\n",
+			   (unsigned long)retry.retries,
+			   (unsigned long)retry.bus_unsticks,
+			   (unsigned long)retry.reinits,
+			   (unsigned long)retry.failures);
+	con_printf("reg cache hits %lu misses %lu\r\n",
+			   (unsigned long)cache.hits, (unsigned long)cache.misses);
+	con_printf("ready waits %lu timeouts %lu, %lu of %lu ms\r\n",
+			   (unsigned long)ready.waits, (unsigned long)ready.timeouts,
+			   (unsigned long)ready.waited_ms, (unsigned long)ready.bound_ms);
+	if (!wlc_update_active()) {
+		wlc_mem_report();
+		wlc_isr_report();
+	}
+	return OK;
+}
+
+/* snap: binary register snapshot for tools/wlc_snapshot_diff.py */
+static int cmd_snap(int argc, char **argv)
+{
+	int failed = wlc_snapshot_dump();
+
+	if (failed)
+		con_printf("\r\n%d chunks unreadable\r\n", failed);
+	return OK;
+}
+
+#ifdef WLC_STATION
+/* station [reset]: shift statistics, or start a new shift */
+static int cmd_station(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "reset") == 0)
+		station_reset_stats();
+	else
+		station_report();
+	return OK;
+}
+#endif
+
+#ifdef WLC_TRACE
+/* trace [clear]: binary dump for tools/wlc_trace.py */
+static int cmd_trace(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "clear") == 0)
+		wlc_trace_clear();
+	else
+		wlc_trace_dump();
+	return OK;
+}
+#endif
+
+static const struct console_cmd commands[] = {
+	{ "help",	"list commands",					cmd_help,	1 },
+	{ "info",	"read chip info",					cmd_info,	0 },
+	{ "check",	"compare chip and image ids",		cmd_check,	0 },
+	{ "update",	"program the NVM if required",		cmd_update,	0 },
+	{ "rd",		"fw|hw <addr> <len>",				cmd_read,	0 },
+	{ "wr",		"fw|hw <addr> <byte>...",			cmd_write,	0 },
+	{ "bench",	"[n] I2C and CRC benchmarks",		cmd_bench,	0 },
+	{ "stats",	"driver counters",					cmd_stats,	1 },
+	{ "snap",	"binary register snapshot",			cmd_snap,	0 },
+	{ "overlay", "<cfg_id> [<off>=<hex>]... | clear",	cmd_overlay, 0 },
+#ifdef WLC_STATION
+	{ "station", "[reset] shift statistics",		cmd_station, 1 },
+#endif
+#ifdef WLC_TRACE
+	{ "trace",	"[clear] dump the I2C trace",		cmd_trace,	0 },
+#endif
+	{ NULL, NULL, NULL, 0 },
+};
+
+/***************************************************************************
+ * Line handling
+ ***************************************************************************/
+static void console_execute(char *cmd_line)
+{
+	char *argv[CONSOLE_MAX_ARGS];
+	int argc = 0;
+	char *tok;
+	int err;
+	int i;
+
+	for (tok = strtok(cmd_line, " \t"); tok && argc < CONSOLE_MAX_ARGS;
+		 tok = strtok(NULL, " \t"))
+		argv[argc++] = tok;
+	if (argc == 0)
+		return;
+
+	for (i = 0; commands[i].name; i++)
+		if (strcmp(argv[0], commands[i].name) == 0)
+			break;
+	if (commands[i].name == NULL) {
+		con_printf("unknown command '%s', try help\r\n", argv[0]);
+		return;
+	}
+
+	/* Bus commands wait for the update instead of stalling it */
+	if (wlc_update_active() && !commands[i].safe) {
+		con_printf("busy: NVM update in progress\r\n");
+		return;
+	}
+
+	err = commands[i].handler(argc, argv);
+	if (err == E_INVALID_INPUT)
+		con_printf("usage: %s %s\r\n", commands[i].name, commands[i].usage);
+	else if (err != OK)
+		con_printf("error %08X\r\n", err);
+	con_printf("> ");
+}
+
+/***************************************************************************
+ * Public API
+ ***************************************************************************/
+void console_init(UART_HandleTypeDef *huart)
+{
+	con_uart = huart;
+	cmd_table = commands;
+	rx_tail = 0;
+	line_len = 0;
+	line_overflow = 0;
+	HAL_UART_Receive_DMA(con_uart, rx_ring, CONSOLE_RX_SIZE);
+	con_printf("\r\nWLC console, try help\r\n> ");
+}
+
+/*
+ * Consume whatever the DMA has written since the last call and run
+ * complete lines. Also called from wlc_platform_poll() while an update runs,
+ * possibly one that a console command started: then only commands flagged
+ * safe run, the others are refused.
+ */
+void console_poll(void)
+{
+	static u8 depth;
+	char c;
+
+	if (con_uart == NULL || depth > 1)
+		return;
+
+	/* A UART re-init (clock profile switch) stops the reception */
+	if (con_uart->RxState != HAL_UART_STATE_BUSY_RX) {
+		HAL_DMA_Abort(con_uart->hdmarx);
+		rx_tail = 0;
+		HAL_UART_Receive_DMA(con_uart, rx_ring, CONSOLE_RX_SIZE);
+		return;
+	}
+
+	depth++;
+	while (rx_tail != CONSOLE_RX_SIZE -
+					  __HAL_DMA_GET_COUNTER(con_uart->hdmarx)) {
+		c = (char)rx_ring[rx_tail];
+		rx_tail = (rx_tail + 1) % CONSOLE_RX_SIZE;
+
+		if (c == '\r' || c == '\n') {
+			if (line_overflow) {
+				con_printf("line too long\r\n> ");
+			} else if (line_len) {
+				line[line_len] = '\0';
+				line_len = 0;
+				console_execute(line);
+			}
+			line_len = 0;
+			line_overflow = 0;
+		} else if (line_len < sizeof(line) - 1) {
+			line[line_len++] = c;
+		} else {
+			line_overflow = 1;
+		}
+	}
+	depth--;
+}
+
+/* The driver polls between NVM sectors: serve the console from there too */
+void wlc_platform_poll(void)
+{
+	console_poll();
+}
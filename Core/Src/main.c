@@ -26,6 +26,10 @@
 /* USER CODE BEGIN Includes */
 #include <string.h>
 #include "stwlc38.h"
+#include "console.h"
+#ifdef WLC_STATION
+#include "station.h"
+#endif
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -59,6 +63,23 @@ void SystemClock_Config(void);
 extern I2C_HandleTypeDef *hi2c;
 extern UART_HandleTypeDef *huart;
 
+/* .ram2_text bounds from the linker script */
+extern u32 _siram2[];
+extern u32 _sram2[];
+extern u32 _eram2[];
+
+/* Copy the SRAM2 code (I2C interrupt path and transport) from FLASH */
+static void SRAM2_Code_Load(void)
+{
+  u32 *src = _siram2;
+  u32 *dst = _sram2;
+
+  while (dst < _eram2)
+    *dst++ = *src++;
+  __DSB();
+  __ISB();
+}
+
 /* USER CODE END 0 */
 
 /**
@@ -68,7 +89,7 @@ extern UART_HandleTypeDef *huart;
 int main(void)
 {
   /* USER CODE BEGIN 1 */
-
+  SRAM2_Code_Load();
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -84,6 +105,8 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
+  // WLC - Paint the free stack for the high-water report
+  wlc_mem_paint_stack();
 
   /* USER CODE END SysInit */
 
@@ -96,8 +119,16 @@ int main(void)
   hi2c = &hi2c1;
   huart = &huart2;
 
+  // WLC - Move the log UART to the fastest rate the host validates
+  UART_Baud_Negotiate(&huart2);
+
+#ifdef WLC_STATION
+  // WLC- Production station: program every unit put on the fixture
+  station_init();
+#else
   // WLC- Display chip information
-  char buff[PAGE_SIZE] = {0};
+  // Static: a 1 KB page does not fit the 0x400 stack reserve
+  static char buff[PAGE_SIZE];
   chip_info_show(buff);
   pr_info(buff);
 
@@ -107,12 +138,27 @@ int main(void)
   nvm_program_show(buff);
   pr_info(buff);
 
+  // WLC- Report stack and heap high-water marks, I2C interrupt cost
+  wlc_mem_report();
+  wlc_isr_report();
+
+  // WLC- Nothing left to do: idle in the low-power clock profile
+  SystemClock_Profile(CLOCK_PROFILE_LOWPOWER);
+#endif
+
+  // WLC- Command console on the log UART
+  console_init(&huart2);
+
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
   while (1)
   {
+    console_poll();
+#ifdef WLC_STATION
+    station_poll();
+#endif
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -170,7 +216,193 @@ void SystemClock_Config(void)
 }
 
 /* USER CODE BEGIN 4 */
+/*
+ * I2C1 TIMINGR for ~100 kHz at any PCLK1, scaled from the 0x10707DBC
+ * CubeMX value for a 32 MHz timing tick (PCLK1 64 MHz / PRESC 2).
+ */
+static uint32_t I2C_Timing_Compute(uint32_t pclk)
+{
+  uint32_t presc = (pclk + 31999999U) / 32000000U;  /* tick <= 32 MHz */
+  uint32_t tick_khz = pclk / presc / 1000U;
+  uint32_t scll = (189U * tick_khz + 16000U) / 32000U;
+  uint32_t sclh = (126U * tick_khz + 16000U) / 32000U;
+  uint32_t scldel = (8U * tick_khz + 16000U) / 32000U;
+
+  if (scldel == 0U)
+    scldel = 1U;
+
+  return ((presc - 1U) << 28) | ((scldel - 1U) << 20) |
+         ((sclh - 1U) << 8) | (scll - 1U);
+}
+
+/* Profile running now; SystemClock_Config() sets up the default one */
+static clock_profile_t clock_profile = CLOCK_PROFILE_DEFAULT;
+/* Profile to go back to when the NVM update ends */
+static clock_profile_t clock_profile_saved = CLOCK_PROFILE_DEFAULT;
+
+/* PCLK1 each profile sets up, APB1 undivided */
+static uint32_t Clock_Profile_Pclk1(clock_profile_t profile)
+{
+  switch (profile)
+  {
+  case CLOCK_PROFILE_PERF:
+    return 80000000U;
+  case CLOCK_PROFILE_LOWPOWER:
+    return 4000000U;
+  default:
+    return 64000000U;
+  }
+}
+
+/* Reprogram the PCLK1 clocked peripherals after a clock change */
+static void Clock_Peripherals_Update(uint32_t baud)
+{
+  hi2c1.Init.Timing = I2C_Timing_Compute(HAL_RCC_GetPCLK1Freq());
+  if (HAL_I2C_Init(&hi2c1) != HAL_OK)
+  {
+    Error_Handler();
+  }
+  if (UART_Baud_Apply(&huart2, baud) != 0)
+  {
+    Error_Handler();
+  }
+}
+
+/* SYSCLK = HSI 16 MHz * plln / 2 through the PLL, voltage range 1 */
+static void SystemClock_Pll(uint32_t plln, uint32_t latency)
+{
+  RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+  RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+
+  if (HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE1) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  /* Run from HSI while the PLL is reprogrammed */
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSI;
+  RCC_OscInitStruct.HSIState = RCC_HSI_ON;
+  RCC_OscInitStruct.HSICalibrationValue = RCC_HSICALIBRATION_DEFAULT;
+  RCC_OscInitStruct.PLL.PLLState = RCC_PLL_NONE;
+  if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK|RCC_CLOCKTYPE_SYSCLK
+                              |RCC_CLOCKTYPE_PCLK1|RCC_CLOCKTYPE_PCLK2;
+  RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_HSI;
+  RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+  RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV1;
+  RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, latency) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+  RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+  RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSI;
+  RCC_OscInitStruct.PLL.PLLM = 1;
+  RCC_OscInitStruct.PLL.PLLN = plln;
+  RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV7;
+  RCC_OscInitStruct.PLL.PLLQ = RCC_PLLQ_DIV2;
+  RCC_OscInitStruct.PLL.PLLR = RCC_PLLR_DIV2;
+  if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, latency) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
+
+/* SYSCLK = MSI 4 MHz, PLL and HSI off, voltage range 2 */
+static void SystemClock_LowPower(void)
+{
+  RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+  RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_MSI;
+  RCC_OscInitStruct.MSIState = RCC_MSI_ON;
+  RCC_OscInitStruct.MSICalibrationValue = RCC_MSICALIBRATION_DEFAULT;
+  RCC_OscInitStruct.MSIClockRange = RCC_MSIRANGE_6;
+  RCC_OscInitStruct.PLL.PLLState = RCC_PLL_NONE;
+  if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK|RCC_CLOCKTYPE_SYSCLK
+                              |RCC_CLOCKTYPE_PCLK1|RCC_CLOCKTYPE_PCLK2;
+  RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_MSI;
+  RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+  RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV1;
+  RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_0) != HAL_OK)
+  {
+    Error_Handler();
+  }
 
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_HSI;
+  RCC_OscInitStruct.HSIState = RCC_HSI_OFF;
+  RCC_OscInitStruct.PLL.PLLState = RCC_PLL_OFF;
+  if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  if (HAL_PWREx_ControlVoltageScaling(PWR_REGULATOR_VOLTAGE_SCALE2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+}
+
+/**
+  * @brief Switch the system clock profile at run time
+  * @note  Must not be called while an I2C or UART transfer is in flight;
+  *        both peripherals are reprogrammed for the new PCLK1.
+  * @retval None
+  */
+void SystemClock_Profile(clock_profile_t profile)
+{
+  /* A negotiated rate the new PCLK1 cannot generate drops to the default,
+     and comes back with a faster profile; the host is told first */
+  uint32_t baud = UART_Baud_Select(Clock_Profile_Pclk1(profile));
+
+  UART_Baud_Announce(&huart2, baud);
+  switch (profile)
+  {
+  case CLOCK_PROFILE_PERF:
+    SystemClock_Pll(10, FLASH_LATENCY_4);
+    break;
+  case CLOCK_PROFILE_LOWPOWER:
+    SystemClock_LowPower();
+    break;
+  default:
+    SystemClock_Pll(8, FLASH_LATENCY_3);
+    break;
+  }
+
+  clock_profile = profile;
+  Clock_Peripherals_Update(baud);
+}
+
+/* WLC - Full speed for the duration of an NVM update */
+void wlc_platform_enter_update(void)
+{
+  clock_profile_saved = clock_profile;
+  SystemClock_Profile(CLOCK_PROFILE_PERF);
+}
+
+/* Back to the profile the update started from, e.g. the idle low-power one */
+void wlc_platform_exit_update(void)
+{
+  SystemClock_Profile(clock_profile_saved);
+}
 /* USER CODE END 4 */
 
 /**
@@ -0,0 +1,294 @@
+/***************************************************************************
+ * File Name:		station.c
+ * Description:		Production station mode. station_poll() runs from the
+ *					main loop: it probes the fixture for a unit, updates
+ *					and verifies it, prints a result record, then waits
+ *					for the unit to be taken off. Shift statistics are
+ *					kept across units.
+ ***************************************************************************/
+
+/***************************************************************************
+ * Included files
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+
+#include "station.h"
+
+/***************************************************************************
+ * Private types
+ ***************************************************************************/
+enum station_state {
+	STATION_EMPTY,			/* probing for a unit, with backoff */
+	STATION_SETTLING,		/* first ACK seen, contacts settling */
+	STATION_PRESENT			/* unit done, probing for its removal */
+};
+
+/***************************************************************************
+ * Private variables
+ ***************************************************************************/
+static const char *const phase_name[STATION_PHASE_COUNT] = {
+	"check", "program", "verify", "unit", "handling"
+};
+
+static const char *const result_name[] = { "PASS", "SKIP", "FAIL" };
+
+static struct {
+	enum station_state state;
+	u32 next_ms;			/* tick of the next probe */
+	u32 backoff_ms;
+	u32 misses;
+	u32 first_miss_ms;
+	u32 inserted_ms;
+	u32 removed_ms;
+	int removals;			/* a removal was seen: handling time is valid */
+	int running;			/* a unit is being updated */
+	int programmed;
+	station_phase_t phase;	/* of the running unit */
+	u32 phase_start_ms;
+	u32 phases_ran;			/* one bit per station_phase_t */
+	u32 shift_start_ms;
+	struct station_unit unit;
+	struct station_stats stats;
+} station;
+
+static char buf[PAGE_SIZE];
+
+/***************************************************************************
+ * Function definitions
+ ***************************************************************************/
+/* Platform hook for each unit record, e.g. to drive pass/fail lamps */
+__weak void station_unit_done(const struct station_unit *unit)
+{
+}
+
+static int station_due(u32 now, u32 when)
+{
+	return (int)(now - when) >= 0;
+}
+
+static void station_enter(station_phase_t phase, u32 now)
+{
+	if (station.phase < STATION_PHASE_COUNT)
+		station.unit.phase_ms[station.phase] += now - station.phase_start_ms;
+	station.phase = phase;
+	station.phase_start_ms = now;
+	if (phase < STATION_PHASE_COUNT)
+		station.phases_ran |= 1U << phase;
+}
+
+/* Update phases to station phases; DONE closes the last one */
+static void station_progress(void *ctx, const struct wlc_progress *progress)
+{
+	station_phase_t phase;
+
+	if (!station.running)
+		return;
+
+	switch (progress->phase) {
+	case WLC_PROGRESS_PREPARE:
+	case WLC_PROGRESS_PATCH:
+	case WLC_PROGRESS_CFG:
+		station.programmed = 1;
+		phase = STATION_PHASE_PROGRAM;
+		break;
+	case WLC_PROGRESS_VERIFY:
+		phase = STATION_PHASE_VERIFY;
+		break;
+	default:
+		station.unit.err = progress->err;
+		phase = STATION_PHASE_COUNT;
+		break;
+	}
+	if (phase != station.phase)
+		station_enter(phase, HAL_GetTick());
+}
+
+static void station_time_add(struct station_time *time, u32 ms)
+{
+	if (time->count == 0 || ms < time->min_ms)
+		time->min_ms = ms;
+	if (ms > time->max_ms)
+		time->max_ms = ms;
+	time->count++;
+	time->total_ms += ms;
+}
+
+static void station_record(struct station_unit *unit)
+{
+	int i;
+
+	station.stats.units++;
+	if (unit->result == STATION_PASS)
+		station.stats.passed++;
+	else if (unit->result == STATION_SKIP)
+		station.stats.skipped++;
+	else
+		station.stats.failed++;
+
+	for (i = 0; i < STATION_PHASE_COUNT; i++)
+		if (station.phases_ran & (1U << i))
+			station_time_add(&station.stats.phase[i], unit->phase_ms[i]);
+
+	pr_info("[WLC] unit %lu %s err %08X patch %04X cfg %04X check %lu "
+			"program %lu verify %lu unit %lu ms\n",
+			(unsigned long)unit->serial, result_name[unit->result],
+			unit->err, unit->nvm_patch_id, unit->config_id,
+			(unsigned long)unit->phase_ms[STATION_PHASE_CHECK],
+			(unsigned long)unit->phase_ms[STATION_PHASE_PROGRAM],
+			(unsigned long)unit->phase_ms[STATION_PHASE_VERIFY],
+			(unsigned long)unit->phase_ms[STATION_PHASE_UNIT]);
+	station_unit_done(unit);
+}
+
+/*
+ * Update and verify the unit just settled on the fixture. Anything the
+ * driver kept about the previous unit, cached ids or a programming
+ * checkpoint, is dropped first.
+ */
+static void station_run_unit(void)
+{
+	struct station_unit *unit = &station.unit;
+	struct wlc_chip_info info;
+
+	memset(unit, 0, sizeof(*unit));
+	unit->serial = station.stats.units + 1;
+	station.phases_ran = 1U << STATION_PHASE_UNIT;
+	if (station.removals) {
+		unit->phase_ms[STATION_PHASE_HANDLING] =
+			station.inserted_ms - station.removed_ms;
+		station.phases_ran |= 1U << STATION_PHASE_HANDLING;
+	}
+
+	wlc_nvm_resume_cancel();
+	wlc_reg_cache_invalidate();
+	station.programmed = 0;
+	station.phase = STATION_PHASE_COUNT;
+	station_enter(STATION_PHASE_CHECK, HAL_GetTick());
+	if (wlc_read_chip_info(&info, 1) == OK) {
+		unit->nvm_patch_id = info.nvm_patch_id;
+		unit->config_id = info.config_id;
+	}
+
+	station.running = 1;
+	nvm_program_show(buf);
+	station.running = 0;
+	station_enter(STATION_PHASE_COUNT, HAL_GetTick());
+
+	unit->phase_ms[STATION_PHASE_UNIT] = HAL_GetTick() - station.inserted_ms;
+	if (unit->err != OK)
+		unit->result = STATION_FAIL;
+	else
+		unit->result = station.programmed ? STATION_PASS : STATION_SKIP;
+	station_record(unit);
+}
+
+void station_reset_stats(void)
+{
+	memset(&station.stats, 0, sizeof(station.stats));
+	station.shift_start_ms = HAL_GetTick();
+}
+
+void station_init(void)
+{
+	memset(&station, 0, sizeof(station));
+	station.state = STATION_EMPTY;
+	station.backoff_ms = STATION_PROBE_MIN_MS;
+	station.next_ms = HAL_GetTick();
+	station.phase = STATION_PHASE_COUNT;
+	station_reset_stats();
+	wlc_set_progress_cb(station_progress, NULL);
+	pr_info("[WLC] station mode, waiting for a unit\n");
+}
+
+/*
+ * One step of the station, from the main loop. Returns at once unless a
+ * probe is due; a unit update blocks until it is done.
+ */
+void station_poll(void)
+{
+	u32 now = HAL_GetTick();
+
+	if (!station_due(now, station.next_ms))
+		return;
+
+	switch (station.state) {
+	case STATION_EMPTY:
+		if (wlc_i2c_probe() != OK) {
+			station.next_ms = now + station.backoff_ms;
+			station.backoff_ms *= 2;
+			if (station.backoff_ms > STATION_PROBE_MAX_MS)
+				station.backoff_ms = STATION_PROBE_MAX_MS;
+			break;
+		}
+		station.inserted_ms = now;
+		station.state = STATION_SETTLING;
+		station.next_ms = now + STATION_SETTLE_MS;
+		break;
+
+	case STATION_SETTLING:
+		if (wlc_i2c_probe() != OK) {
+			/* Contact bounce, not a unit yet */
+			station.state = STATION_EMPTY;
+			station.backoff_ms = STATION_PROBE_MIN_MS;
+			station.next_ms = now + STATION_PROBE_MIN_MS;
+			break;
+		}
+		station_run_unit();
+		station.state = STATION_PRESENT;
+		station.misses = 0;
+		station.next_ms = HAL_GetTick() + STATION_REMOVE_POLL_MS;
+		break;
+
+	case STATION_PRESENT:
+		if (wlc_i2c_probe() == OK) {
+			station.misses = 0;
+		} else {
+			if (station.misses++ == 0)
+				station.first_miss_ms = now;
+			if (station.misses >= STATION_REMOVE_MISSES) {
+				pr_info("[WLC] unit %lu removed\n",
+						(unsigned long)station.unit.serial);
+				station.removed_ms = station.first_miss_ms;
+				station.removals = 1;
+				station.state = STATION_EMPTY;
+				station.backoff_ms = STATION_PROBE_MIN_MS;
+				station.next_ms = now + STATION_PROBE_MIN_MS;
+				break;
+			}
+		}
+		station.next_ms = now + STATION_REMOVE_POLL_MS;
+		break;
+	}
+}
+
+void station_get_stats(struct station_stats *stats)
+{
+	*stats = station.stats;
+	stats->shift_ms = HAL_GetTick() - station.shift_start_ms;
+	stats->units_per_hour = stats->shift_ms ?
+		(u32)((uint64_t)stats->units * 3600000 / stats->shift_ms) : 0;
+}
+
+void station_report(void)
+{
+	struct station_stats stats;
+	struct station_time *time;
+	int i;
+
+	station_get_stats(&stats);
+	pr_info("[WLC] station: %lu units in %lu s, %lu pass %lu skip %lu fail, "
+			"%lu units/hour\n", (unsigned long)stats.units,
+			(unsigned long)(stats.shift_ms / 1000),
+			(unsigned long)stats.passed, (unsigned long)stats.skipped,
+			(unsigned long)stats.failed, (unsigned long)stats.units_per_hour);
+	for (i = 0; i < STATION_PHASE_COUNT; i++) {
+		time = &stats.phase[i];
+		if (time->count == 0)
+			continue;
+		pr_info("[WLC]   %-8s %lu runs, avg %lu min %lu max %lu ms\n",
+				phase_name[i], (unsigned long)time->count,
+				(unsigned long)(time->total_ms / time->count),
+				(unsigned long)time->min_ms, (unsigned long)time->max_ms);
+	}
+}
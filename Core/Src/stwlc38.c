@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <malloc.h>
 
 #include "stwlc38.h"
 
@@ -20,9 +21,13 @@
 #endif
 
 #ifndef UBIN
+#ifdef WLC_DELTA
+#include "nvm_delta.h"
+#else
 //#include "nvm_data.h"
 #include "STSW-WLC38RX-nvm_data.h"
 #endif
+#endif
 /***************************************************************************
  * Macro definitions
  ***************************************************************************/
@@ -31,6 +36,37 @@
 #define IO_DELAY_MS		1000
 #define SLAVE_ADDRESS	0x61
 
+/* I2C1 pins, driven as GPIO for the bus unstick sequence */
+#define I2C_GPIO_PORT	GPIOB
+#define I2C_SCL_PIN		GPIO_PIN_8
+#define I2C_SDA_PIN		GPIO_PIN_9
+
+/* Image being programmed, from the UBIN file or the generated header */
+#ifdef UBIN
+#define NVM_IMG_PATCH_DATA		fw_data.fw_patch_data
+#define NVM_IMG_PATCH_SIZE		fw_data.fw_patch_size
+#define NVM_IMG_PATCH_ID		fw_data.fw_patch_version_id
+#define NVM_IMG_CFG_DATA		fw_data.fw_config_data
+#define NVM_IMG_CFG_SIZE		fw_data.fw_config_size
+#define NVM_IMG_CFG_ID			fw_data.fw_config_version_id
+#else
+#define NVM_IMG_PATCH_DATA		nvm_patch_data
+#define NVM_IMG_PATCH_SIZE		NVM_PATCH_SIZE
+#define NVM_IMG_PATCH_ID		NVM_PATCH_VERSION_ID
+#define NVM_IMG_CFG_DATA		nvm_cfg_data
+#define NVM_IMG_CFG_SIZE		NVM_CFG_SIZE
+#define NVM_IMG_CFG_ID			NVM_CFG_VERSION_ID
+#endif
+
+/* Programming checkpoint layout in the RTC backup registers */
+#define CKPT_MAGIC				0x574C4331	/* "WLC1" */
+#define CKPT_REG_MAGIC			0
+#define CKPT_REG_IMAGE_ID		1
+#define CKPT_REG_IMAGE_SIZE		2
+#define CKPT_REG_NEXT_SECTOR	3
+#define CKPT_REG_CHECK			4
+#define CKPT_REG_DIGEST			5	/* running CRC32, kept after completion */
+
 /***************************************************************************
  * Global variables
  ***************************************************************************/
@@ -44,12 +80,150 @@ static u8 i2cSequentialRxDone = 0;
 static u8 i2cSequentialTxDone = 0;
 static char buff[BUFF_SIZE];
 
+/* Memory usage tracking; USE_STATIC_ALLOC_RW frames go through rw_buf */
+#if USE_STATIC_ALLOC_RW
+static u8 rw_buf[WLC_RW_BUF_SIZE];
+#endif
+static struct wlc_nvm_write_stats nvm_write_stats;
+static struct wlc_isr_stats isr_stats;
+static volatile int nvm_update_active;
+
+/* Sectors of the image holding only WLC_NVM_ERASED_BYTE, one bit each */
+#ifndef WLC_DELTA
+static u8 nvm_blank_map[WLC_NVM_MAX_SECTORS / 8];
+#endif
+static int nvm_target_erased;
+static u32 mem_rw_peak;
+static u32 mem_image_bytes;
+
+#ifndef WLC_HOST_LINUX
+/* Linker script symbols */
+extern u8 end[];
+extern u8 _estack[];
+extern u8 _Min_Stack_Size[];
+extern u8 _Min_Heap_Size[];
+#endif
+
+/* Register shadow cache, one entry per cached register block */
+struct wlc_reg_cache_entry {
+	u32 addr;
+	u8 hw;		/* 1: SYSREG address space, 0: FW register space */
+	u8 len;
+	u8 valid;
+	u8 data[WLC_REG_CACHE_MAX_LEN];
+};
+
+static struct wlc_reg_cache_entry reg_cache[] = {
+	{ FWREG_CHIP_ID_ADDR,	0, WLC_CHIP_INFO_LEN,	0, { 0 } },
+	{ HWREG_HW_VER_ADDR,	1, 1,					0, { 0 } },
+};
+static struct wlc_reg_cache_stats reg_cache_stats;
+
+/* Transaction list sequencer, advanced from the I2C completion callbacks */
+#define XFER_SEQ_IDLE		0
+#define XFER_SEQ_RUNNING	1
+#define XFER_SEQ_DELAY		2
+#define XFER_SEQ_DONE		3
+#define XFER_SEQ_ERROR		4
+
+/* Second frame of the current step, started from the TX completion */
+#define XFER_PHASE_NONE		0
+#define XFER_PHASE_RX		1	/* read data after the address header */
+#define XFER_PHASE_TX_DATA	2	/* long write payload, sent in place */
+
+static struct {
+	const struct wlc_xfer *seq;
+	int count;
+	volatile int index;
+	volatile int state;
+	u32 step_ts;
+	u8 phase;
+	u8 cmd[5 + WLC_XFER_MAX_WRITE_LEN];
+} xfer_seq;
+
+/*
+ * Segmented reads: one buffer is filled while the other is processed.
+ * seg_buf[0] is also the snapshot chunk buffer.
+ */
+static u8 seg_buf[2][I2C_CHUNK_SIZE];
+
+/* Post-programming verification */
+static wlc_verify_level_t verify_level = WLC_VERIFY_LEVEL_DEFAULT;
+static struct wlc_verify_report verify_report;
+
+/* SYSREG ranges added to the FW register window in a snapshot */
+static const struct {
+	u32 addr;
+	u16 len;
+} snap_hw_ranges[] = {
+	{ 0x2001C000, 0x10 },	/* HW_VER */
+	{ 0x2001C160, 0x10 },	/* TM_CONFIG */
+	{ HWREG_RST_ADDR, 4 },
+};
+
+/* Retry and bus recovery */
+static struct wlc_retry_policy retry_policy = {
+	WLC_RETRY_ATTEMPTS, WLC_RETRY_SECTOR_ATTEMPTS,
+	WLC_RETRY_BACKOFF_MS, WLC_RETRY_BACKOFF_FACTOR
+};
+static struct wlc_retry_stats retry_stats;
+static struct wlc_ready_stats ready_stats;
+
+/* Sectors below this index are already confirmed and are not rewritten */
+static int nvm_resume_sector;
+
+#if WLC_DIGEST_SHA256
+struct wlc_sha256_ctx {
+	u32 state[8];
+	u32 count;			/* bytes hashed */
+	u8 block[64];
+};
+#endif
+
+/* Progress reporting of the running update */
+static struct {
+	wlc_progress_cb_t cb;
+	void *ctx;
+	struct wlc_progress cur;
+	u32 start_ms;
+	u32 bytes_total;
+	u32 bytes_done;		/* sent, skipped or resumed */
+	u32 step_cycles;	/* DWT at the previous sector */
+} progress;
+
+/* Per-unit cfg overlay, see wlc_set_cfg_overlay() */
+static struct {
+	const struct wlc_cfg_patch *patches;
+	int count;
+	u16 config_id;		/* 0: no overlay */
+	u8 id_bytes[2];		/* config_id as stored in the cfg image */
+	u32 crc;			/* of the patches, part of the checkpoint image id */
+	u8 sector[NVM_SECTOR_SIZE_BYTES];
+} cfg_overlay;
+
+/* Running digest of the image bytes programmed so far */
+static struct {
+	u32 crc;
+	u32 bytes;
+#if WLC_DIGEST_SHA256
+	struct wlc_sha256_ctx sha;
+#endif
+#ifdef WLC_DELTA
+	int target;			/* whole target read back, not the payload sent */
+#endif
+} nvm_digest;
+
+#ifdef WLC_TRACE
+static struct wlc_trace_rec trace_ring[WLC_TRACE_DEPTH];
+static u32 trace_head;
+static u32 trace_tail;
+#endif
+
 /***************************************************************************
  * Function declarations
  ***************************************************************************/
 #ifdef UBIN
 int get_fw_ubin_file (char *name, u8 **data, int *size);
-int parse_ubin_file(u8 *ubin_data, int ubin_size, struct firmware_file *fw_data);
 #endif
 
 /***************************************************************************
@@ -95,28 +269,287 @@ void pr_info(char *msg, ...)
 	HAL_UART_Transmit(huart, (u8 *)buff, strlen(buff), IO_DELAY_MS);
 }
 
-void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c)
+static void wlc_xfer_step_done(void);
+static void wlc_xfer_phase_start(void);
+
+WLC_SRAM2_FUNC void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c)
 {
+	if (xfer_seq.state == XFER_SEQ_RUNNING) {
+		if (xfer_seq.phase != XFER_PHASE_NONE)
+			wlc_xfer_phase_start();
+		else
+			wlc_xfer_step_done();
+		return;
+	}
 	i2cSequentialTxDone = 1;
 }
 
-void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
+WLC_SRAM2_FUNC void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
 {
+	if (xfer_seq.state == XFER_SEQ_RUNNING) {
+		wlc_xfer_step_done();
+		return;
+	}
 	i2cSequentialRxDone = 1;
 }
 
+WLC_SRAM2_FUNC void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+	if (xfer_seq.state == XFER_SEQ_RUNNING)
+		xfer_seq.state = XFER_SEQ_ERROR;
+}
+
+/*
+ * DWT cycle counter, enabled on first use. Used for transaction traces and
+ * cycle measurements.
+ */
+WLC_SRAM2_FUNC u32 wlc_cycles(void)
+{
+	if ((DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk) == 0) {
+		CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+		DWT->CYCCNT = 0;
+		DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	}
+	return DWT->CYCCNT;
+}
+
+/*
+ * Account one I2C interrupt, called at the end of the I2C1 handlers with
+ * the wlc_cycles() value taken at their entry.
+ */
+WLC_SRAM2_FUNC void wlc_isr_account(u32 start)
+{
+	u32 cycles = wlc_cycles() - start;
+
+	if (isr_stats.count == 0 || cycles < isr_stats.min)
+		isr_stats.min = cycles;
+	if (cycles > isr_stats.max)
+		isr_stats.max = cycles;
+	isr_stats.total += cycles;
+	isr_stats.count++;
+}
+
+void wlc_isr_stats_reset(void)
+{
+	memset(&isr_stats, 0, sizeof(isr_stats));
+}
+
+void wlc_isr_report(void)
+{
+	if (isr_stats.count == 0)
+		return;
+	pr_info("[WLC] I2C ISR (%s): %lu calls, cycles min %lu avg %lu max %lu\n",
+			WLC_SRAM2_CODE ? "SRAM2" : "FLASH",
+			(unsigned long)isr_stats.count,
+			(unsigned long)isr_stats.min,
+			(unsigned long)(isr_stats.total / isr_stats.count),
+			(unsigned long)isr_stats.max);
+}
+
+#ifdef WLC_TRACE
+/*** Transaction trace **/
+
+WLC_SRAM2_FUNC static void wlc_trace_add(u32 ts, u32 addr, u16 length, u8 flags,
+						  u8 status)
+{
+	struct wlc_trace_rec *rec = &trace_ring[trace_head & (WLC_TRACE_DEPTH - 1)];
+
+	rec->timestamp = ts;
+	rec->duration = DWT->CYCCNT - ts;
+	rec->addr = addr;
+	rec->length = length;
+	rec->flags = flags;
+	rec->status = status;
+	trace_head++;
+}
+
+/* Record one wlc_i2c_write/wlc_i2c_read call, address taken from cmd */
+WLC_SRAM2_FUNC static void wlc_trace_cmd(u32 ts, const u8 *cmd, int cmd_length,
+						  int read_count, int attempts, u8 status)
+{
+	u8 flags = read_count ? WLC_TRACE_F_READ : 0;
+	u32 addr;
+	int hdr_len;
+
+	if (cmd_length >= 5 && cmd[0] == OPCODE_WRITE) {
+		addr = ((u32)cmd[1] << 24) | ((u32)cmd[2] << 16) |
+			   ((u32)cmd[3] << 8) | cmd[4];
+		flags |= WLC_TRACE_F_SYSREG;
+		hdr_len = 5;
+	} else {
+		addr = ((u32)cmd[0] << 8) | cmd[1];
+		hdr_len = 2;
+	}
+
+	if (attempts > 16)
+		attempts = 16;
+	flags |= (u8)((attempts - 1) << WLC_TRACE_RETRY_SHIFT);
+
+	wlc_trace_add(ts, addr, (u16)(read_count ? read_count
+											 : cmd_length - hdr_len),
+				  flags, status);
+}
+
+WLC_SRAM2_FUNC static void wlc_trace_xfer(const struct wlc_xfer *step, u8 status)
+{
+	u8 flags = WLC_TRACE_F_LIST;
+
+	if (step->type == WLC_XFER_FW_READ || step->type == WLC_XFER_HW_READ)
+		flags |= WLC_TRACE_F_READ;
+	if (step->type == WLC_XFER_HW_WRITE || step->type == WLC_XFER_HW_READ)
+		flags |= WLC_TRACE_F_SYSREG;
+
+	wlc_trace_add(xfer_seq.step_ts, step->addr, step->len, flags, status);
+}
+
+void wlc_trace_clear(void)
+{
+	trace_tail = trace_head;
+}
+
+/*
+ * Send the trace ring, oldest record first, as raw binary on the log UART.
+ * tools/wlc_trace.py converts a capture to CSV and VCD.
+ */
+void wlc_trace_dump(void)
+{
+	struct wlc_trace_header header;
+	u32 head = trace_head;
+	u32 first = trace_tail;
+	u32 index;
+
+	if (head - first > WLC_TRACE_DEPTH)
+		first = head - WLC_TRACE_DEPTH;
+
+	header.magic = WLC_TRACE_MAGIC;
+	header.version = WLC_TRACE_VERSION;
+	header.rec_size = sizeof(struct wlc_trace_rec);
+	header.count = head - first;
+	header.dropped = first - trace_tail;
+	header.cpu_hz = SystemCoreClock;
+	HAL_UART_Transmit(huart, (u8 *)&header, sizeof(header), IO_DELAY_MS);
+
+	for (index = first; index != head; index++)
+		HAL_UART_Transmit(huart,
+						  (u8 *)&trace_ring[index & (WLC_TRACE_DEPTH - 1)],
+						  sizeof(struct wlc_trace_rec), IO_DELAY_MS);
+
+	trace_tail = head;
+}
+#endif
+
+/*
+ * Address-only probe, no retry and no bus recovery: OK when the chip ACKs
+ * its address. Cheap enough to poll for a chip being put on or taken off
+ * the bus.
+ */
+int wlc_i2c_probe(void)
+{
+	return HAL_I2C_IsDeviceReady(hi2c, SLAVE_ADDRESS << 1, 1,
+								 WLC_PROBE_TIMEOUT_MS) == HAL_OK ? OK : E_BUS_R;
+}
+
+/*
+ * Short register read of a readiness poll. The HAL timeout is one budget
+ * for the whole transfer, so it is sized to the bytes on the bus: address,
+ * 2 register bytes, address again and the data. A failed read leaves the
+ * peripheral mid-transfer with BUSY set; it is reset so that the next
+ * probe can get the bus.
+ */
+static int wlc_poll_read(u16 reg, u8 *data, u16 len)
+{
+	u32 timeout = WLC_PROBE_TIMEOUT_MS +
+				  ((4 + len) * WLC_I2C_BYTE_US + 999) / 1000;
+
+	if (HAL_I2C_Mem_Read(hi2c, SLAVE_ADDRESS << 1, reg, I2C_MEMADD_SIZE_16BIT,
+						 data, len, timeout) == HAL_OK)
+		return OK;
+
+	HAL_I2C_DeInit(hi2c);
+	HAL_I2C_Init(hi2c);
+	return E_BUS_R;
+}
+
+/*
+ * One readiness poll: blocking, short reads, no retry. A FW that runs
+ * reports its chip id and an op mode; SYS_CMD still holding a command,
+ * e.g. the FW reset, means it has not rebooted yet.
+ */
+static int wlc_chip_ready(wlc_ready_t level)
+{
+	u8 chip_id[2];
+	u8 op_mode;
+	u8 sys_cmd;
+	u16 id;
+
+	if (wlc_i2c_probe() != OK)
+		return 0;
+	if (level == WLC_READY_ACK)
+		return 1;
+
+	if (wlc_poll_read(FWREG_CHIP_ID_ADDR, chip_id, 2) != OK)
+		return 0;
+	id = (u16)(chip_id[0] + (chip_id[1] << 8));
+	if (id == 0x0000 || id == 0xFFFF)
+		return 0;
+
+	if (wlc_poll_read(FWREG_OP_MODE_ADDR, &op_mode, 1) != OK ||
+		op_mode < FW_OP_MODE_SA || op_mode > FW_OP_MODE_TX)
+		return 0;
+
+	return wlc_poll_read(FWREG_SYS_CMD_ADDR, &sys_cmd, 1) == OK &&
+		   sys_cmd == 0;
+}
+
+/*
+ * Poll the chip until it is ready instead of sleeping a fixed time. max_ms,
+ * the sleep this replaces, bounds the poll; past it the caller goes on as
+ * it did after the sleep. Returns E_TIMEOUT in that case.
+ */
+int wlc_wait_ready(u32 max_ms, wlc_ready_t level, const char *what)
+{
+	u32 start = HAL_GetTick();
+	u32 waited;
+	int ready;
+
+	for (;;) {
+		ready = wlc_chip_ready(level);
+		waited = HAL_GetTick() - start;
+		if (ready || waited >= max_ms)
+			break;
+		msleep(WLC_READY_POLL_MS);
+	}
+
+	ready_stats.waits++;
+	ready_stats.waited_ms += waited;
+	ready_stats.bound_ms += max_ms;
+	if (!ready) {
+		ready_stats.timeouts++;
+		pr_err("[WLC] %s: chip not ready after %lu ms\n", what,
+			   (unsigned long)waited);
+		return E_TIMEOUT;
+	}
+	pr_info("[WLC] %s: ready after %lu of %lu ms\n", what,
+			(unsigned long)waited, (unsigned long)max_ms);
+	return OK;
+}
+
+void wlc_get_ready_stats(struct wlc_ready_stats *stats)
+{
+	*stats = ready_stats;
+}
+
 void I2C_reset()
 {
 	HAL_I2C_DeInit(hi2c);
-	HAL_Delay(20);
 	HAL_I2C_Init(hi2c);
-	HAL_Delay(20);
+	wlc_wait_ready(2 * I2C_RESET_SLEEP_MS, WLC_READY_ACK, "I2C re-init");
 }
 
-HAL_StatusTypeDef wlc_i2c_write(uint8_t* cmd, int cmd_length)
+WLC_SRAM2_FUNC static HAL_StatusTypeDef wlc_i2c_write_once(uint8_t* cmd, int cmd_length)
 {
 #ifdef DEBUG_I2C
-	char str[BUFF_SIZE];
+	static char str[BUFF_SIZE];
 	sprintf(str, "[WR-W]: ");
 	for(int i = 0; i < cmd_length; i++)
 		sprintf(str + strlen(str), "%02X ", cmd[i]);
@@ -124,21 +557,13 @@ HAL_StatusTypeDef wlc_i2c_write(uint8_t* cmd, int cmd_length)
 	pr_info(str);
 #endif
 	
-	HAL_StatusTypeDef status = HAL_OK;	
-	status = HAL_I2C_Master_Transmit(hi2c, SLAVE_ADDRESS << 1, cmd, cmd_length, IO_DELAY_MS);
-	if(status == HAL_BUSY)
-	{
-		I2C_reset();
-		status = HAL_I2C_Master_Transmit(hi2c, SLAVE_ADDRESS << 1, cmd, cmd_length, IO_DELAY_MS);
-	}
-			
-	return status;
+	return HAL_I2C_Master_Transmit(hi2c, SLAVE_ADDRESS << 1, cmd, cmd_length, IO_DELAY_MS);
 }
 
-HAL_StatusTypeDef wlc_i2c_read(uint8_t* cmd, int cmd_length, uint8_t* read_data, int read_count)
+WLC_SRAM2_FUNC static HAL_StatusTypeDef wlc_i2c_read_once(uint8_t* cmd, int cmd_length, uint8_t* read_data, int read_count)
 {
 #ifdef DEBUG_I2C
-	char str[BUFF_SIZE];
+	static char str[BUFF_SIZE];
 	sprintf(str, "[WR-W]: ");
 	for(int i = 0; i < cmd_length; i++)
 		sprintf(str + strlen(str), "%02X ", cmd[i]);
@@ -151,16 +576,8 @@ HAL_StatusTypeDef wlc_i2c_read(uint8_t* cmd, int cmd_length, uint8_t* read_data,
 		uint32_t startTick = HAL_GetTick();
 
 		status = HAL_I2C_Master_Sequential_Transmit_IT(hi2c, SLAVE_ADDRESS << 1, cmd, cmd_length, I2C_FIRST_FRAME);
-		if(status != HAL_OK){
-			if(status == HAL_BUSY) {
-					I2C_reset();
-					status = HAL_I2C_Master_Sequential_Transmit_IT(hi2c, SLAVE_ADDRESS << 1, cmd, cmd_length, I2C_FIRST_FRAME);
-					if(status != HAL_OK)
-						return HAL_ERROR;
-				}
-			else
-					return HAL_ERROR;
-		}
+		if(status != HAL_OK)
+			return status;
 		
 		while(i2cSequentialTxDone == 0)
 		{
@@ -189,266 +606,1956 @@ HAL_StatusTypeDef wlc_i2c_read(uint8_t* cmd, int cmd_length, uint8_t* read_data,
 #endif		
 	return status;
 }
-/*** Low Level API for I2C/UART communication**/
+/*
+ * Header and payload sent from separate buffers in one I2C write: the
+ * FIRST_FRAME leaves the bus claimed, the LAST_FRAME continues it without a
+ * new START, so a const payload goes to the bus without being copied.
+ */
+WLC_SRAM2_FUNC static HAL_StatusTypeDef wlc_i2c_write_frames_once(uint8_t* hdr, int hdr_length,
+												   const uint8_t* data, int data_length)
+{
+	HAL_StatusTypeDef status;
+	uint32_t startTick = HAL_GetTick();
+
+	i2cSequentialTxDone = 0;
+	status = HAL_I2C_Master_Seq_Transmit_IT(hi2c, SLAVE_ADDRESS << 1, hdr,
+											hdr_length, I2C_FIRST_FRAME);
+	if (status != HAL_OK)
+		return status;
+
+	while (i2cSequentialTxDone == 0) {
+		if ((HAL_GetTick() - startTick) > IO_DELAY_MS)
+			return HAL_TIMEOUT;
+	}
 
-static int hw_i2c_write(u32 addr, u8 *data, u32 data_length)
+	i2cSequentialTxDone = 0;
+	status = HAL_I2C_Master_Seq_Transmit_IT(hi2c, SLAVE_ADDRESS << 1,
+											(uint8_t *)data, data_length,
+											I2C_LAST_FRAME);
+	if (status != HAL_OK)
+		return status;
+
+	while (i2cSequentialTxDone == 0) {
+		if ((HAL_GetTick() - startTick) > IO_DELAY_MS)
+			return HAL_TIMEOUT;
+	}
+
+	return HAL_OK;
+}
+
+/*** Retry and bus recovery **/
+
+void wlc_set_retry_policy(const struct wlc_retry_policy *policy)
 {
-	u8 *cmd = (u8 *)malloc(sizeof(u8) * (5 + data_length));
+	retry_policy = *policy;
+	if (retry_policy.attempts == 0)
+		retry_policy.attempts = 1;
+	if (retry_policy.sector_attempts == 0)
+		retry_policy.sector_attempts = 1;
+}
 
-	cmd[0] = OPCODE_WRITE;
-	cmd[1] = (u8)((addr >> 24) & 0xFF);
-	cmd[2] = (u8)((addr >> 16) & 0xFF);
-	cmd[3] = (u8)((addr >> 8) & 0xFF);
-	cmd[4] = (u8)((addr >> 0) & 0xFF);
-	memcpy(&cmd[5], data, data_length);
+void wlc_get_retry_stats(struct wlc_retry_stats *stats)
+{
+	*stats = retry_stats;
+}
 
-	if ((wlc_i2c_write(cmd, (5 + data_length))) != OK) {
-		pr_err("[WLC] Error in writing Hardware I2c!\n");
-		free(cmd);
-		return E_BUS_W;
+static void udelay(u32 usec)
+{
+	volatile u32 loops = (SystemCoreClock / 4000000U) * usec;
+
+	while (loops--)
+		;
+}
+
+/*
+ * Free a slave holding SDA low: clock SCL 9 times by hand so it can finish
+ * the byte it is sending, then issue a STOP and give the pins back to the
+ * I2C peripheral.
+ */
+static void I2C_bus_unstick(void)
+{
+	int i;
+	GPIO_InitTypeDef gpio = { 0 };
+
+	HAL_I2C_DeInit(hi2c);
+
+	HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN | I2C_SDA_PIN, GPIO_PIN_SET);
+	gpio.Pin = I2C_SCL_PIN | I2C_SDA_PIN;
+	gpio.Mode = GPIO_MODE_OUTPUT_OD;
+	gpio.Pull = GPIO_PULLUP;
+	gpio.Speed = GPIO_SPEED_FREQ_LOW;
+	HAL_GPIO_Init(I2C_GPIO_PORT, &gpio);
+	udelay(5);
+
+	for (i = 0; i < 9; i++) {
+		HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_RESET);
+		udelay(5);
+		HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_SET);
+		udelay(5);
 	}
 
-	free(cmd);
-	return OK;
+	/* STOP condition: SDA rises while SCL is high */
+	HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_RESET);
+	HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SDA_PIN, GPIO_PIN_RESET);
+	udelay(5);
+	HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SCL_PIN, GPIO_PIN_SET);
+	udelay(5);
+	HAL_GPIO_WritePin(I2C_GPIO_PORT, I2C_SDA_PIN, GPIO_PIN_SET);
+	udelay(5);
+
+	if (HAL_GPIO_ReadPin(I2C_GPIO_PORT, I2C_SDA_PIN) == GPIO_PIN_RESET)
+		pr_err("[WLC] SDA still held low after bus unstick\n");
+
+	HAL_GPIO_DeInit(I2C_GPIO_PORT, I2C_SCL_PIN | I2C_SDA_PIN);
+	HAL_I2C_Init(hi2c);
 }
 
-static int fw_i2c_write(u16 addr, u8 *data, u32 data_length)
+/*
+ * Escalating recovery before retry number 'retry' (1 = first retry):
+ * back off, then plain retry, 9-clock bus unstick, full peripheral
+ * re-initialisation. A handle left busy by a timed out interrupt
+ * transfer cannot be retried as is and goes straight to the unstick.
+ */
+static void wlc_i2c_recover(int retry)
+{
+	int i;
+	u32 backoff = retry_policy.backoff_ms;
+
+	for (i = 1; i < retry; i++)
+		backoff *= retry_policy.backoff_factor;
+	if (backoff)
+		msleep(backoff);
+
+	retry_stats.retries++;
+	if (retry == 1 && hi2c->State != HAL_I2C_STATE_READY)
+		retry = 2;
+
+	if (retry == 2) {
+		retry_stats.bus_unsticks++;
+		I2C_bus_unstick();
+	} else if (retry > 2) {
+		retry_stats.reinits++;
+		I2C_reset();
+	}
+}
+
+HAL_StatusTypeDef wlc_i2c_write(uint8_t* cmd, int cmd_length)
 {
-	u8 *cmd = (u8 *)malloc(sizeof(u8) * (2 + data_length));
+	int attempt;
+	HAL_StatusTypeDef status = HAL_ERROR;
 
-	cmd[0] = (u8)((addr >>  8) & 0xFF);
-	cmd[1] = (u8)((addr >>  0) & 0xFF);
-	memcpy(&cmd[2], data, data_length);
+#ifdef WLC_TRACE
+	u32 ts = wlc_cycles();
+#endif
 
-	if ((wlc_i2c_write(cmd, (2 + data_length))) != OK) {
-		pr_err("[WLC] ERROR: in writing Hardware I2c!\n");
-		free(cmd);
-		return E_BUS_W;
+	for (attempt = 0; attempt < retry_policy.attempts; attempt++) {
+		if (attempt)
+			wlc_i2c_recover(attempt);
+		status = wlc_i2c_write_once(cmd, cmd_length);
+		if (status == HAL_OK)
+			break;
 	}
 
-	free(cmd);
-	return OK;
+#ifdef WLC_TRACE
+	wlc_trace_cmd(ts, cmd, cmd_length, 0,
+				  attempt < retry_policy.attempts ? attempt + 1 : attempt,
+				  status);
+#endif
+	if (status != HAL_OK)
+		retry_stats.failures++;
+	return status;
 }
 
-static int hw_i2c_read(u32 addr, u8 *read_buff, int read_count)
+HAL_StatusTypeDef wlc_i2c_read(uint8_t* cmd, int cmd_length, uint8_t* read_data, int read_count)
 {
-	u8 *cmd = (u8 *)malloc(sizeof(u8) * 5);
+	int attempt;
+	HAL_StatusTypeDef status = HAL_ERROR;
 
-	cmd[0] = OPCODE_WRITE;
-	cmd[1] = (u8)((addr >> 24) & 0xFF);
-	cmd[2] = (u8)((addr >> 16) & 0xFF);
-	cmd[3] = (u8)((addr >>  8) & 0xFF);
-	cmd[4] = (u8)((addr >>  0) & 0xFF);
+#ifdef WLC_TRACE
+	u32 ts = wlc_cycles();
+#endif
 
-	if ((wlc_i2c_read(cmd, 5, read_buff, read_count)) != OK) {
-		pr_err("[WLC] Error in writing Hardware I2c!\n");
-		free(cmd);
-		return E_BUS_WR;
+	for (attempt = 0; attempt < retry_policy.attempts; attempt++) {
+		if (attempt)
+			wlc_i2c_recover(attempt);
+		status = wlc_i2c_read_once(cmd, cmd_length, read_data, read_count);
+		if (status == HAL_OK)
+			break;
 	}
 
-	free(cmd);
-	return OK;
+#ifdef WLC_TRACE
+	wlc_trace_cmd(ts, cmd, cmd_length, read_count,
+				  attempt < retry_policy.attempts ? attempt + 1 : attempt,
+				  status);
+#endif
+	if (status != HAL_OK)
+		retry_stats.failures++;
+	return status;
 }
 
-static int fw_i2c_read(u16 addr, u8 *read_buff,
-		int read_count)
+static HAL_StatusTypeDef wlc_i2c_write_frames(uint8_t* hdr, int hdr_length,
+											  const uint8_t* data, int data_length)
 {
-	u8 *cmd = (u8 *)malloc(sizeof(u8) * 2);
+	int attempt;
+	HAL_StatusTypeDef status = HAL_ERROR;
 
-	cmd[0] = (u8)((addr >>  8) & 0xFF);
-	cmd[1] = (u8)((addr >>  0) & 0xFF);
+#ifdef WLC_TRACE
+	u32 ts = wlc_cycles();
+#endif
 
-	if ((wlc_i2c_read(cmd, 2, read_buff, read_count)) != OK) {
-		pr_err("[WLC] Error in writing Hardware I2c!\n");
-		free(cmd);
-		return E_BUS_WR;
+	for (attempt = 0; attempt < retry_policy.attempts; attempt++) {
+		if (attempt)
+			wlc_i2c_recover(attempt);
+		status = wlc_i2c_write_frames_once(hdr, hdr_length, data, data_length);
+		if (status == HAL_OK)
+			break;
 	}
 
-	free(cmd);
-	return OK;
+#ifdef WLC_TRACE
+	wlc_trace_cmd(ts, hdr, hdr_length + data_length, 0,
+				  attempt < retry_policy.attempts ? attempt + 1 : attempt,
+				  status);
+#endif
+	if (status != HAL_OK)
+		retry_stats.failures++;
+	return status;
 }
 
-char *print_hex(char *label, u8 *buff, int count, char *result)
+/*** Register shadow cache **/
+
+void wlc_reg_cache_invalidate(void)
 {
-	int i, offset;
+	int i;
 
-	offset = strlen(label);
-	strlcpy(result, label, offset + 1); /* +1 for terminator char */
+	for (i = 0; i < (int)(sizeof(reg_cache) / sizeof(reg_cache[0])); i++)
+		reg_cache[i].valid = 0;
+	reg_cache_stats.invalidations++;
+}
 
-	for (i = 0; i < count; i++) {
-		snprintf(&result[offset], 4, "%02X ", buff[i]);
-		/* this append automatically a null terminator char */
-		offset += 3;
+void wlc_reg_cache_get_stats(struct wlc_reg_cache_stats *stats)
+{
+	*stats = reg_cache_stats;
+}
+
+static struct wlc_reg_cache_entry *wlc_reg_cache_find(u8 hw, u32 addr,
+														int length)
+{
+	int i;
+	struct wlc_reg_cache_entry *entry;
+
+	for (i = 0; i < (int)(sizeof(reg_cache) / sizeof(reg_cache[0])); i++) {
+		entry = &reg_cache[i];
+		if (entry->hw == hw && addr >= entry->addr &&
+			addr + length <= entry->addr + entry->len)
+			return entry;
 	}
-	return result;
+
+	return NULL;
 }
 
-static void system_reset()
+/*
+ * Drop the cached copies a write may have changed. Commands written to
+ * SYS_CMD and any SYSREG write can change the whole chip state (reset,
+ * test mode), everything else only touches the registers it overlaps.
+ */
+static void wlc_reg_cache_write_notify(u8 hw, u32 addr, int length)
 {
-	u8 cmd[6] = { 0x00 };
-	u32 addr = HWREG_RST_ADDR;
+	int i;
+	struct wlc_reg_cache_entry *entry;
 
-	/* System reset */
-	cmd[0] = OPCODE_WRITE;
-	cmd[1] = (u8)((addr >> 24) & 0xFF);
-	cmd[2] = (u8)((addr >> 16) & 0xFF);
-	cmd[3] = (u8)((addr >> 8) & 0xFF);
-	cmd[4] = (u8)((addr >> 0) & 0xFF);
-	cmd[5] = 0x01;
-	wlc_i2c_write(cmd, 6);
-	msleep(AFTER_SYS_RESET_SLEEP_MS);
+	if (hw || addr == FWREG_SYS_CMD_ADDR) {
+		wlc_reg_cache_invalidate();
+		return;
+	}
 
-	/* I2C NACK handling after system reset*/
-	I2C_reset();
+	for (i = 0; i < (int)(sizeof(reg_cache) / sizeof(reg_cache[0])); i++) {
+		entry = &reg_cache[i];
+		if (entry->hw == 0 && addr < entry->addr + entry->len &&
+			entry->addr < addr + length)
+			entry->valid = 0;
+	}
 }
 
-static int get_wlc_chip_info(struct wlc_chip_info *info)
+/*** Register transaction list **/
+
+/*
+ * Start step xfer_seq.index. Runs in thread context for the first step and
+ * after delays, and from the I2C completion interrupt for all others, so
+ * consecutive transactions go out without returning to the caller.
+ */
+WLC_SRAM2_FUNC static void wlc_xfer_step_start(void)
 {
-	u8 read_buff[14] = { 0x00 };
+	const struct wlc_xfer *step = &xfer_seq.seq[xfer_seq.index];
+	int hdr_len;
+	u32 options = I2C_FIRST_AND_LAST_FRAME;
 
-	if (fw_i2c_read(FWREG_CHIP_ID_ADDR, read_buff, 14) != OK) {
-		pr_err("[WLC] Error while getting wlc_chip_info\n");
-		return E_BUS_R;
+	if (step->type == WLC_XFER_DELAY || step->type == WLC_XFER_WAIT_READY) {
+		xfer_seq.state = XFER_SEQ_DELAY;
+		return;
 	}
 
-	info->chip_id = (u16)(read_buff[0] + (read_buff[1] << 8));
-	info->chip_revision = read_buff[2];
-	info->customer_id = read_buff[3];
-	info->project_id = (u16)(read_buff[4] + (read_buff[5] << 8));
-	info->nvm_patch_id = (u16)(read_buff[6] + (read_buff[7] << 8));
-	info->ram_patch_id = (u16)(read_buff[8] + (read_buff[9] << 8));
-	info->config_id = (u16)(read_buff[10] + (read_buff[11] << 8));
-	info->pe_id = (u16)(read_buff[12] + (read_buff[13] << 8));
+	if (step->type == WLC_XFER_HW_WRITE || step->type == WLC_XFER_HW_READ) {
+		xfer_seq.cmd[0] = OPCODE_WRITE;
+		xfer_seq.cmd[1] = (u8)((step->addr >> 24) & 0xFF);
+		xfer_seq.cmd[2] = (u8)((step->addr >> 16) & 0xFF);
+		xfer_seq.cmd[3] = (u8)((step->addr >>  8) & 0xFF);
+		xfer_seq.cmd[4] = (u8)((step->addr >>  0) & 0xFF);
+		hdr_len = 5;
+	} else {
+		xfer_seq.cmd[0] = (u8)((step->addr >>  8) & 0xFF);
+		xfer_seq.cmd[1] = (u8)((step->addr >>  0) & 0xFF);
+		hdr_len = 2;
+	}
 
-	if (hw_i2c_read(HWREG_HW_VER_ADDR, read_buff, 1) != OK) {
-		pr_err("[WLC] Error while getting wlc_chip_info\n");
-		return E_BUS_R;
+	if (step->type == WLC_XFER_FW_READ || step->type == WLC_XFER_HW_READ) {
+		xfer_seq.phase = XFER_PHASE_RX;
+		options = I2C_FIRST_FRAME;
+	} else if (step->len > WLC_XFER_MAX_WRITE_LEN) {
+		/* Same direction LAST_FRAME continues without a new START */
+		xfer_seq.phase = XFER_PHASE_TX_DATA;
+		options = I2C_FIRST_FRAME;
+	} else {
+		xfer_seq.phase = XFER_PHASE_NONE;
+		memcpy(&xfer_seq.cmd[hdr_len], step->data, step->len);
+		hdr_len += step->len;
 	}
 
-	info->cut_id = read_buff[0];
+	xfer_seq.state = XFER_SEQ_RUNNING;
+#ifdef WLC_TRACE
+	xfer_seq.step_ts = wlc_cycles();
+#endif
+	if (HAL_I2C_Master_Seq_Transmit_IT(hi2c, SLAVE_ADDRESS << 1, xfer_seq.cmd,
+									   hdr_len, options) != HAL_OK)
+		xfer_seq.state = XFER_SEQ_ERROR;
+}
 
-	pr_info("[WLC] ChipID: %04X Chip Revision: %02X CustomerID: %02X "
-		"RomID: %04X NVMPatchID: %04X RAMPatchID: %04X CFG: %04X "
-		"PE: %04X\n", info->chip_id, info->chip_revision,
-		info->customer_id, info->project_id, info->nvm_patch_id,
-		info->ram_patch_id, info->config_id, info->pe_id);
+WLC_SRAM2_FUNC static void wlc_xfer_phase_start(void)
+{
+	const struct wlc_xfer *step = &xfer_seq.seq[xfer_seq.index];
+	HAL_StatusTypeDef status;
 
-	return OK;
+	if (xfer_seq.phase == XFER_PHASE_RX)
+		status = HAL_I2C_Master_Seq_Receive_IT(hi2c, SLAVE_ADDRESS << 1,
+											   step->data, step->len,
+											   I2C_LAST_FRAME);
+	else
+		status = HAL_I2C_Master_Seq_Transmit_IT(hi2c, SLAVE_ADDRESS << 1,
+												step->data, step->len,
+												I2C_LAST_FRAME);
+	xfer_seq.phase = XFER_PHASE_NONE;
+	if (status != HAL_OK)
+		xfer_seq.state = XFER_SEQ_ERROR;
 }
 
-static int wlc_nvm_write_sector(const u8 *data, int data_length,
-									int sector_index)
+WLC_SRAM2_FUNC static void wlc_xfer_step_done(void)
 {
-	int err = 0;
-	int i = 0;
-	int timeout = 1;
-	u8 reg_value = (u8)sector_index;
-	u8 write_buff[NVM_SECTOR_SIZE_BYTES];
+#ifdef WLC_TRACE
+	if (xfer_seq.seq[xfer_seq.index].type < WLC_XFER_DELAY)
+		wlc_trace_xfer(&xfer_seq.seq[xfer_seq.index], HAL_OK);
+#endif
+	if (xfer_seq.index + 1 >= xfer_seq.count) {
+		xfer_seq.state = XFER_SEQ_DONE;
+		return;
+	}
+	xfer_seq.index++;
+	wlc_xfer_step_start();
+}
 
-	pr_info("[WLC] writing sector %02X\n", sector_index);
-	if (data_length > NVM_SECTOR_SIZE_BYTES) {
-		pr_err("[WLC] sector data bigger than 256 bytes\n");
+/*
+ * Start a list of register writes, reads and delays and return while it
+ * runs; wlc_xfer_wait() collects the result. The list and the buffers it
+ * points to must stay valid until then. Writes longer than
+ * WLC_XFER_MAX_WRITE_LEN are sent from their buffer without a copy.
+ */
+int wlc_xfer_start(const struct wlc_xfer *seq, int count)
+{
+	int i;
+
+	if (seq == NULL || count <= 0 || xfer_seq.state != XFER_SEQ_IDLE)
 		return E_INVALID_INPUT;
+
+	for (i = 0; i < count; i++) {
+		if (seq[i].type == WLC_XFER_DELAY ||
+			seq[i].type == WLC_XFER_WAIT_READY)
+			continue;
+		if (seq[i].data == NULL || seq[i].len == 0) {
+			pr_err("[WLC] invalid transaction %d in list\n", i);
+			return E_INVALID_INPUT;
+		}
+		if (seq[i].type == WLC_XFER_FW_WRITE)
+			wlc_reg_cache_write_notify(0, seq[i].addr, seq[i].len);
+		else if (seq[i].type == WLC_XFER_HW_WRITE)
+			wlc_reg_cache_write_notify(1, seq[i].addr, seq[i].len);
 	}
 
-	memset(write_buff, 0, NVM_SECTOR_SIZE_BYTES);
-	memcpy(write_buff, data, data_length);
+	xfer_seq.seq = seq;
+	xfer_seq.count = count;
+	xfer_seq.index = 0;
+	wlc_xfer_step_start();
+	return OK;
+}
 
-	err = fw_i2c_write(FWREG_NVM_SECTOR_INDEX_ADDR, &reg_value, 1);
-	if (err != OK)
-		return err;
+/*
+ * Wait for the list started by wlc_xfer_start(), sleeping through its
+ * delay steps. Stops on the first failing step.
+ */
+int wlc_xfer_wait(void)
+{
+	const struct wlc_xfer *seq = xfer_seq.seq;
+	int index = xfer_seq.index;
+	int err = OK;
+	u32 step_tick = HAL_GetTick();
+
+	while (xfer_seq.state == XFER_SEQ_RUNNING ||
+		   xfer_seq.state == XFER_SEQ_DELAY) {
+		if (xfer_seq.index != index) {
+			index = xfer_seq.index;
+			step_tick = HAL_GetTick();
+		}
 
-	reg_value = 0x10;
-	err = fw_i2c_write(FWREG_SYS_CMD_ADDR, &reg_value, 1);
-	if (err != OK)
-		return err;
+		if (xfer_seq.state == XFER_SEQ_DELAY) {
+			if (seq[index].type == WLC_XFER_WAIT_READY)
+				wlc_wait_ready(seq[index].addr, WLC_READY_FW, "xfer wait");
+			else
+				msleep(seq[index].addr);
+			wlc_xfer_step_done();
+			continue;
+		}
 
+		if ((HAL_GetTick() - step_tick) > IO_DELAY_MS) {
+			xfer_seq.state = XFER_SEQ_ERROR;
+			I2C_reset();
+			err = E_TIMEOUT;
+		}
+	}
+
+	if (xfer_seq.state == XFER_SEQ_ERROR) {
+		index = xfer_seq.index;
+#ifdef WLC_TRACE
+		wlc_trace_xfer(&seq[index], err == E_TIMEOUT ? HAL_TIMEOUT : HAL_ERROR);
+#endif
+		if (err == OK)
+			err = (seq[index].type == WLC_XFER_FW_READ ||
+				   seq[index].type == WLC_XFER_HW_READ) ? E_BUS_WR : E_BUS_W;
+		pr_err("[WLC] transaction %d of %d failed\n", index + 1,
+			   xfer_seq.count);
+	}
+
+	xfer_seq.state = XFER_SEQ_IDLE;
+	return err;
+}
+
+/*
+ * Run a list of register writes, reads and delays back to back, stopping
+ * on the first failing step. Transactions are chained from the I2C
+ * interrupt; the caller only sleeps through delay steps.
+ */
+int wlc_xfer_run(const struct wlc_xfer *seq, int count)
+{
+	int err = wlc_xfer_start(seq, count);
+
+	if (err != OK)
+		return err;
+	return wlc_xfer_wait();
+}
+
+/*** Segmented transfers **/
+
+/* Wait for a list started by wlc_xfer_start(), restarting it on failure */
+static int wlc_seg_wait(const struct wlc_xfer *steps, int count)
+{
+	int attempt;
+	int err = wlc_xfer_wait();
+
+	for (attempt = 1; err != OK && attempt < retry_policy.attempts;
+		 attempt++) {
+		wlc_i2c_recover(attempt);
+		err = wlc_xfer_start(steps, count);
+		if (err == OK)
+			err = wlc_xfer_wait();
+	}
+	if (err != OK)
+		retry_stats.failures++;
+	return err;
+}
+
+/*
+ * Read len bytes from addr in segments of up to seg_len bytes (0 means
+ * I2C_CHUNK_SIZE) with the address advanced per segment. While cb handles
+ * one segment the next one is already being read into the other buffer,
+ * so the bus stays busy during the processing. cb gets the offset of the
+ * segment from addr; an error from it stops the read and is returned.
+ */
+int wlc_seg_read(int hw, u32 addr, u32 len, u16 seg_len, wlc_seg_cb_t cb,
+				 void *ctx)
+{
+	struct wlc_xfer step[2];
+	u32 offset = 0;
+	u32 next;
+	int cur = 0;
+	int err;
+
+	if (seg_len == 0)
+		seg_len = I2C_CHUNK_SIZE;
+	if (cb == NULL || len == 0 || seg_len > I2C_CHUNK_SIZE)
+		return E_INVALID_INPUT;
+
+	step[0].type = step[1].type = hw ? WLC_XFER_HW_READ : WLC_XFER_FW_READ;
+	step[0].addr = addr;
+	step[0].data = seg_buf[0];
+	step[0].len = len > seg_len ? seg_len : len;
+	err = wlc_xfer_start(&step[0], 1);
+	if (err != OK)
+		return err;
+
+	while (1) {
+		err = wlc_seg_wait(&step[cur], 1);
+		if (err != OK)
+			return err;
+
+		next = offset + step[cur].len;
+		if (next < len) {
+			step[cur ^ 1].addr = addr + next;
+			step[cur ^ 1].data = seg_buf[cur ^ 1];
+			step[cur ^ 1].len = len - next > seg_len ? seg_len : len - next;
+			err = wlc_xfer_start(&step[cur ^ 1], 1);
+			if (err != OK)
+				return err;
+		}
+
+		err = cb(ctx, offset, seg_buf[cur], step[cur].len);
+		if (err != OK) {
+			if (next < len)
+				wlc_xfer_wait();
+			return err;
+		}
+
+		if (next >= len)
+			return OK;
+		offset = next;
+		cur ^= 1;
+	}
+}
+
+/*
+ * Write len bytes from data to addr in I2C_CHUNK_SIZE segments with the
+ * address advanced per segment. Up to WLC_SEG_WRITE_BATCH segments are
+ * chained from the I2C interrupt and sent straight from data.
+ */
+int wlc_seg_write(int hw, u32 addr, const u8 *data, u32 len)
+{
+	struct wlc_xfer step[WLC_SEG_WRITE_BATCH];
+	u32 offset = 0;
+	int count;
+	int err;
+
+	if (data == NULL || len == 0)
+		return E_INVALID_INPUT;
+
+	while (offset < len) {
+		for (count = 0; count < WLC_SEG_WRITE_BATCH && offset < len;
+			 count++) {
+			step[count].type = hw ? WLC_XFER_HW_WRITE : WLC_XFER_FW_WRITE;
+			step[count].addr = addr + offset;
+			step[count].data = (u8 *)(data + offset);
+			step[count].len = len - offset > I2C_CHUNK_SIZE
+							  ? I2C_CHUNK_SIZE : len - offset;
+			offset += step[count].len;
+		}
+
+		err = wlc_xfer_start(step, count);
+		if (err == OK)
+			err = wlc_seg_wait(step, count);
+		if (err != OK)
+			return err;
+	}
+
+	return OK;
+}
+
+/*** Memory usage **/
+
+static u8 *wlc_alloc_mem(u32 size)
+{
+	if (size > mem_rw_peak)
+		mem_rw_peak = size;
+#if USE_STATIC_ALLOC_RW
+	if (size > WLC_RW_BUF_SIZE)
+		return NULL;
+	return rw_buf;
+#else
+	return (u8 *)malloc(size);
+#endif
+}
+
+static void wlc_free_mem(u8 *ptr)
+{
+#if !USE_STATIC_ALLOC_RW
+	free(ptr);
+#endif
+}
+
+#ifdef WLC_HOST_LINUX
+/* The stack of a host process is not ours to measure */
+void wlc_mem_paint_stack(void)
+{
+}
+#else
+/* Lowest address the stack can reach without running into the heap */
+static u32 *wlc_mem_stack_floor(void)
+{
+	struct mallinfo mi = mallinfo();
+
+	return (u32 *)(((u32)end + mi.arena + 3) & ~3U);
+}
+
+/*
+ * Fill the free stack with WLC_STACK_PAINT so wlc_mem_get_stats() can find
+ * the deepest point the stack reached. Call early in main().
+ */
+void wlc_mem_paint_stack(void)
+{
+	u32 *p = wlc_mem_stack_floor();
+	u32 *sp = (u32 *)(__get_MSP() - 64);	/* keep clear of our own frame */
+
+	while (p < sp)
+		*p++ = WLC_STACK_PAINT;
+}
+#endif
+
+void wlc_mem_get_stats(struct wlc_mem_stats *stats)
+{
+	struct mallinfo mi = mallinfo();
+#ifdef WLC_HOST_LINUX
+	stats->stack_reserved = 0;
+	stats->stack_peak = 0;
+	stats->heap_reserved = 0;
+#else
+	u32 *p = wlc_mem_stack_floor();
+
+	while (p < (u32 *)_estack && *p == WLC_STACK_PAINT)
+		p++;
+
+	stats->stack_reserved = (u32)_Min_Stack_Size;
+	stats->stack_peak = (u32)_estack - (u32)p;
+	stats->heap_reserved = (u32)_Min_Heap_Size;
+#endif
+	stats->heap_peak = mi.arena;
+	stats->heap_in_use = mi.uordblks;
+#if USE_STATIC_ALLOC_RW
+	stats->static_pool = WLC_RW_BUF_SIZE;
+#else
+	stats->static_pool = 0;
+#endif
+	stats->heap_demand = mem_rw_peak + mem_image_bytes;
+}
+
+void wlc_mem_report(void)
+{
+	struct wlc_mem_stats stats;
+
+	wlc_mem_get_stats(&stats);
+	pr_info("[WLC] Stack peak %lu of %lu bytes reserved%s\n",
+			(unsigned long)stats.stack_peak,
+			(unsigned long)stats.stack_reserved,
+			stats.stack_peak > stats.stack_reserved ? " (OVERFLOW)" : "");
+	pr_info("[WLC] Heap peak %lu of %lu bytes reserved, %lu in use\n",
+			(unsigned long)stats.heap_peak,
+			(unsigned long)stats.heap_reserved,
+			(unsigned long)stats.heap_in_use);
+#if USE_STATIC_ALLOC_RW
+	pr_info("[WLC] Static alloc: %lu bytes of heap allocations replaced by "
+			"a %lu byte static buffer, %lu bytes saved\n",
+			(unsigned long)stats.heap_demand,
+			(unsigned long)stats.static_pool,
+			(unsigned long)(stats.heap_demand > stats.static_pool ?
+					stats.heap_demand - stats.static_pool : 0));
+#else
+	pr_info("[WLC] Driver heap demand %lu bytes, USE_STATIC_ALLOC_RW would "
+			"need %lu bytes of static buffer\n",
+			(unsigned long)stats.heap_demand,
+			(unsigned long)WLC_RW_BUF_SIZE);
+#endif
+}
+
+/*** Low Level API for I2C/UART communication**/
+
+static int fw_i2c_write(u16 addr, u8 *data, u32 data_length)
+{
+	u8 *cmd = wlc_alloc_mem(2 + data_length);
+
+	if (cmd == NULL)
+		return E_MEMORY_ALLOC;
+
+	cmd[0] = (u8)((addr >>  8) & 0xFF);
+	cmd[1] = (u8)((addr >>  0) & 0xFF);
+	memcpy(&cmd[2], data, data_length);
+
+	wlc_reg_cache_write_notify(0, addr, data_length);
+	if ((wlc_i2c_write(cmd, (2 + data_length))) != OK) {
+		pr_err("[WLC] ERROR: in writing Hardware I2c!\n");
+		wlc_free_mem(cmd);
+		return E_BUS_W;
+	}
+
+	wlc_free_mem(cmd);
+	return OK;
+}
+
+/* fw_i2c_write() for const payloads, sent from where they are */
+static int fw_i2c_write_nocopy(u16 addr, const u8 *data, u32 data_length)
+{
+	u8 hdr[2];
+
+	hdr[0] = (u8)((addr >>  8) & 0xFF);
+	hdr[1] = (u8)((addr >>  0) & 0xFF);
+
+	wlc_reg_cache_write_notify(0, addr, data_length);
+	if ((wlc_i2c_write_frames(hdr, 2, data, data_length)) != OK) {
+		pr_err("[WLC] ERROR: in writing Hardware I2c!\n");
+		return E_BUS_W;
+	}
+
+	return OK;
+}
+
+static int hw_i2c_read(u32 addr, u8 *read_buff, int read_count)
+{
+	u8 cmd[5];
+
+	cmd[0] = OPCODE_WRITE;
+	cmd[1] = (u8)((addr >> 24) & 0xFF);
+	cmd[2] = (u8)((addr >> 16) & 0xFF);
+	cmd[3] = (u8)((addr >>  8) & 0xFF);
+	cmd[4] = (u8)((addr >>  0) & 0xFF);
+
+	if ((wlc_i2c_read(cmd, 5, read_buff, read_count)) != OK) {
+		pr_err("[WLC] Error in writing Hardware I2c!\n");
+		return E_BUS_WR;
+	}
+
+	return OK;
+}
+
+static int fw_i2c_read(u16 addr, u8 *read_buff,
+		int read_count)
+{
+	u8 cmd[2];
+
+	cmd[0] = (u8)((addr >>  8) & 0xFF);
+	cmd[1] = (u8)((addr >>  0) & 0xFF);
+
+	if ((wlc_i2c_read(cmd, 2, read_buff, read_count)) != OK) {
+		pr_err("[WLC] Error in writing Hardware I2c!\n");
+		return E_BUS_WR;
+	}
+
+	return OK;
+}
+
+/*
+ * Read through the register shadow cache. Registers that are not cached go
+ * straight to the bus; refresh forces a bus read of a cached block.
+ */
+static int wlc_reg_cache_read(u8 hw, u32 addr, u8 *read_buff, int read_count,
+								int refresh)
+{
+	int err;
+	struct wlc_reg_cache_entry *entry;
+
+	entry = wlc_reg_cache_find(hw, addr, read_count);
+	if (entry == NULL)
+		return hw ? hw_i2c_read(addr, read_buff, read_count)
+				  : fw_i2c_read((u16)addr, read_buff, read_count);
+
+	if (entry->valid && !refresh) {
+		reg_cache_stats.hits++;
+	} else {
+		reg_cache_stats.misses++;
+		err = hw ? hw_i2c_read(entry->addr, entry->data, entry->len)
+				 : fw_i2c_read((u16)entry->addr, entry->data, entry->len);
+		if (err != OK) {
+			entry->valid = 0;
+			return err;
+		}
+		entry->valid = 1;
+	}
+
+	memcpy(read_buff, &entry->data[addr - entry->addr], read_count);
+	return OK;
+}
+
+char *print_hex(char *label, u8 *buff, int count, char *result)
+{
+	int i, offset;
+
+	offset = strlen(label);
+	strlcpy(result, label, offset + 1); /* +1 for terminator char */
+
+	for (i = 0; i < count; i++) {
+		snprintf(&result[offset], 4, "%02X ", buff[i]);
+		/* this append automatically a null terminator char */
+		offset += 3;
+	}
+	return result;
+}
+
+/*
+ * CRC32 (IEEE 802.3, reflected) running update. Start from 0xFFFFFFFF and
+ * invert the final value.
+ */
+WLC_SRAM2_FUNC u32 wlc_crc32_update(u32 crc, const u8 *data, int size)
+{
+	static const u32 crc_nibble[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+	int i;
+
+	for (i = 0; i < size; i++) {
+		crc ^= data[i];
+		crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+		crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+	}
+
+	return crc;
+}
+
+#if WLC_DIGEST_SHA256
+/* SHA-256 (FIPS 180-4), one 64 byte block at a time */
+#define SHA256_ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void wlc_sha256_block(struct wlc_sha256_ctx *ctx, const u8 *p)
+{
+	static const u32 k[64] = {
+		0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B,
+		0x59F111F1, 0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01,
+		0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7,
+		0xC19BF174, 0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+		0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA, 0x983E5152,
+		0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+		0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC,
+		0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+		0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819,
+		0xD6990624, 0xF40E3585, 0x106AA070, 0x19A4C116, 0x1E376C08,
+		0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F,
+		0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+		0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+	};
+	u32 w[16];
+	u32 v[8];
+	u32 t1;
+	u32 t2;
+	u32 s0;
+	u32 s1;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v[i] = ctx->state[i];
+
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			w[i] = ((u32)p[4 * i] << 24) | ((u32)p[4 * i + 1] << 16) |
+				   ((u32)p[4 * i + 2] << 8) | p[4 * i + 3];
+		} else {
+			s0 = w[(i + 1) & 15];
+			s1 = w[(i + 14) & 15];
+			w[i & 15] += (SHA256_ROR(s0, 7) ^ SHA256_ROR(s0, 18) ^ (s0 >> 3)) +
+						 (SHA256_ROR(s1, 17) ^ SHA256_ROR(s1, 19) ^ (s1 >> 10)) +
+						 w[(i + 9) & 15];
+		}
+		t1 = v[7] + (SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^
+					 SHA256_ROR(v[4], 25)) +
+			 ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i & 15];
+		t2 = (SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^
+			  SHA256_ROR(v[0], 22)) +
+			 ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		v[7] = v[6];
+		v[6] = v[5];
+		v[5] = v[4];
+		v[4] = v[3] + t1;
+		v[3] = v[2];
+		v[2] = v[1];
+		v[1] = v[0];
+		v[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		ctx->state[i] += v[i];
+}
+
+static void wlc_sha256_init(struct wlc_sha256_ctx *ctx)
+{
+	static const u32 h0[8] = {
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+		0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+	};
+
+	memcpy(ctx->state, h0, sizeof(h0));
+	ctx->count = 0;
+}
+
+static void wlc_sha256_update(struct wlc_sha256_ctx *ctx, const u8 *data,
+							  u32 size)
+{
+	u32 used = ctx->count & 63;
+	u32 n;
+
+	ctx->count += size;
+	while (size) {
+		/* Whole blocks are hashed in place, tails collected in block[] */
+		if (used == 0 && size >= 64) {
+			wlc_sha256_block(ctx, data);
+			n = 64;
+		} else {
+			n = 64 - used < size ? 64 - used : size;
+			memcpy(&ctx->block[used], data, n);
+			used = (used + n) & 63;
+			if (used == 0)
+				wlc_sha256_block(ctx, ctx->block);
+		}
+		data += n;
+		size -= n;
+	}
+}
+
+static void wlc_sha256_final(struct wlc_sha256_ctx *ctx, u8 *digest)
+{
+	u32 used = ctx->count & 63;
+	u32 bits = ctx->count << 3;
+	int i;
+
+	ctx->block[used++] = 0x80;
+	if (used > 56) {
+		memset(&ctx->block[used], 0, 64 - used);
+		wlc_sha256_block(ctx, ctx->block);
+		used = 0;
+	}
+	memset(&ctx->block[used], 0, 60 - used);
+	/* The image is far below 512 MB: the upper length bits are zero */
+	ctx->block[60] = (u8)(bits >> 24);
+	ctx->block[61] = (u8)(bits >> 16);
+	ctx->block[62] = (u8)(bits >> 8);
+	ctx->block[63] = (u8)bits;
+	wlc_sha256_block(ctx, ctx->block);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = (u8)(ctx->state[i >> 2] >> (24 - 8 * (i & 3)));
+}
+#endif
+
+static void system_reset()
+{
+	u8 cmd[6] = { 0x00 };
+	u32 addr = HWREG_RST_ADDR;
+
+	/* System reset */
+	cmd[0] = OPCODE_WRITE;
+	cmd[1] = (u8)((addr >> 24) & 0xFF);
+	cmd[2] = (u8)((addr >> 16) & 0xFF);
+	cmd[3] = (u8)((addr >> 8) & 0xFF);
+	cmd[4] = (u8)((addr >> 0) & 0xFF);
+	cmd[5] = 0x01;
+	/* The chip NACKs while it resets, do not retry */
+	wlc_i2c_write_once(cmd, 6);
+	wlc_reg_cache_invalidate();
+	wlc_wait_ready(AFTER_SYS_RESET_SLEEP_MS, WLC_READY_FW, "system reset");
+
+	/* I2C NACK handling after system reset*/
+	I2C_reset();
+}
+
+int wlc_read_chip_info(struct wlc_chip_info *info, int refresh)
+{
+	u8 read_buff[WLC_CHIP_INFO_LEN] = { 0x00 };
+
+	if (wlc_reg_cache_read(0, FWREG_CHIP_ID_ADDR, read_buff,
+						   WLC_CHIP_INFO_LEN, refresh) != OK) {
+		pr_err("[WLC] Error while getting wlc_chip_info\n");
+		return E_BUS_R;
+	}
+
+	info->chip_id = (u16)(read_buff[0] + (read_buff[1] << 8));
+	info->chip_revision = read_buff[2];
+	info->customer_id = read_buff[3];
+	info->project_id = (u16)(read_buff[4] + (read_buff[5] << 8));
+	info->nvm_patch_id = (u16)(read_buff[6] + (read_buff[7] << 8));
+	info->ram_patch_id = (u16)(read_buff[8] + (read_buff[9] << 8));
+	info->config_id = (u16)(read_buff[10] + (read_buff[11] << 8));
+	info->pe_id = (u16)(read_buff[12] + (read_buff[13] << 8));
+
+	if (wlc_reg_cache_read(1, HWREG_HW_VER_ADDR, read_buff, 1,
+						   refresh) != OK) {
+		pr_err("[WLC] Error while getting wlc_chip_info\n");
+		return E_BUS_R;
+	}
+
+	info->cut_id = read_buff[0];
+
+	pr_info("[WLC] ChipID: %04X Chip Revision: %02X CustomerID: %02X "
+		"RomID: %04X NVMPatchID: %04X RAMPatchID: %04X CFG: %04X "
+		"PE: %04X\n", info->chip_id, info->chip_revision,
+		info->customer_id, info->project_id, info->nvm_patch_id,
+		info->ram_patch_id, info->config_id, info->pe_id);
+
+	return OK;
+}
+
+static int get_wlc_chip_info(struct wlc_chip_info *info)
+{
+	return wlc_read_chip_info(info, 0);
+}
+
+/*** Cfg overlay **/
+
+/*
+ * Personalise the cfg image of the next updates without a new build: each
+ * patch replaces len bytes at offset of the cfg image, and config_id the
+ * id field, as the sectors are sent. The patches are not copied and must
+ * stay valid while an update runs. config_id 0 removes the overlay.
+ */
+int wlc_set_cfg_overlay(const struct wlc_cfg_patch *patches, int count,
+						u16 config_id)
+{
+	int i;
+
+	if (nvm_update_active || count < 0 || (count && patches == NULL))
+		return E_INVALID_INPUT;
+#ifdef WLC_DELTA
+	if (config_id) {
+		pr_err("[WLC] cfg overlay not supported with a delta package\n");
+		return E_INVALID_INPUT;
+	}
+#endif
+
+	cfg_overlay.crc = 0;
+	if (config_id) {
+		cfg_overlay.crc = 0xFFFFFFFF;
+		for (i = 0; i < count; i++) {
+			if (patches[i].data == NULL || patches[i].len == 0)
+				return E_INVALID_INPUT;
+			cfg_overlay.crc = wlc_crc32_update(cfg_overlay.crc,
+											   (const u8 *)&patches[i].offset,
+											   sizeof(patches[i].offset));
+			cfg_overlay.crc = wlc_crc32_update(cfg_overlay.crc,
+											   patches[i].data,
+											   patches[i].len);
+		}
+	}
+	cfg_overlay.patches = config_id ? patches : NULL;
+	cfg_overlay.count = config_id ? count : 0;
+	cfg_overlay.config_id = config_id;
+	cfg_overlay.id_bytes[0] = (u8)config_id;
+	cfg_overlay.id_bytes[1] = (u8)(config_id >> 8);
+	return OK;
+}
+
+/* Config id the NVM holds after an update */
+static u16 wlc_cfg_id(void)
+{
+	return cfg_overlay.config_id ? cfg_overlay.config_id : NVM_IMG_CFG_ID;
+}
+
+/* The patches must fall inside the cfg image, known once it is loaded */
+static int wlc_cfg_overlay_check(void)
+{
+	int i;
+
+	for (i = 0; i < cfg_overlay.count; i++) {
+		if ((u32)cfg_overlay.patches[i].offset +
+			cfg_overlay.patches[i].len > NVM_IMG_CFG_SIZE) {
+			pr_err("[WLC] cfg overlay patch %d past the cfg image\n", i);
+			return E_INVALID_INPUT;
+		}
+	}
+	return OK;
+}
+
+/*
+ * Bytes of NVM sector sector_index with the overlay applied: data itself
+ * when no patch touches the sector, else a copy in cfg_overlay.sector.
+ * The id field goes last, over any patch.
+ */
+static const u8 *wlc_cfg_overlay_apply(const u8 *data, int len,
+									   int sector_index)
+{
+	const u8 *src;
+	u32 start;
+	u32 from;
+	u32 to;
+	u32 offset;
+	u16 patch_len;
+	int touched = 0;
+	int i;
+
+	if (cfg_overlay.config_id == 0 || sector_index < NVM_CFG_START_SECTOR_INDEX)
+		return data;
+
+	start = (u32)(sector_index - NVM_CFG_START_SECTOR_INDEX) *
+			NVM_SECTOR_SIZE_BYTES;
+	for (i = 0; i <= cfg_overlay.count; i++) {
+		if (i < cfg_overlay.count) {
+			offset = cfg_overlay.patches[i].offset;
+			patch_len = cfg_overlay.patches[i].len;
+			src = cfg_overlay.patches[i].data;
+		} else {
+			offset = NVM_CFG_ID_OFFSET;
+			patch_len = sizeof(cfg_overlay.id_bytes);
+			src = cfg_overlay.id_bytes;
+		}
+		from = offset > start ? offset : start;
+		to = offset + patch_len < start + len ? offset + patch_len : start + len;
+		if (from >= to)
+			continue;
+		if (!touched) {
+			memcpy(cfg_overlay.sector, data, len);
+			touched = 1;
+		}
+		memcpy(cfg_overlay.sector + (from - start), src + (from - offset),
+			   to - from);
+	}
+
+	return touched ? cfg_overlay.sector : data;
+}
+
+/*** Programming checkpoint **/
+
+static volatile u32 *wlc_ckpt_regs(void)
+{
+	HAL_PWR_EnableBkUpAccess();
+	return &RTC->BKP0R + WLC_CKPT_BKP_BASE;
+}
+
+/*
+ * A delta update names both ends, it only holds on top of its source. A
+ * cfg overlay adds the CRC of its patches.
+ */
+static u32 wlc_ckpt_image_id(void)
+{
+#ifdef WLC_DELTA
+	return (((u32)NVM_IMG_PATCH_ID << 16) | wlc_cfg_id()) ^
+		   (((u32)NVM_DELTA_SOURCE_PATCH_ID << 16) | NVM_DELTA_SOURCE_CFG_ID) ^
+		   cfg_overlay.crc;
+#else
+	return (((u32)NVM_IMG_PATCH_ID << 16) | wlc_cfg_id()) ^ cfg_overlay.crc;
+#endif
+}
+
+static u32 wlc_ckpt_image_size(void)
+{
+	return ((u32)NVM_IMG_PATCH_SIZE << 16) | (NVM_IMG_CFG_SIZE & 0xFFFF);
+}
+
+static void wlc_ckpt_store(int next_sector)
+{
+	volatile u32 *bkp = wlc_ckpt_regs();
+
+	bkp[CKPT_REG_MAGIC] = CKPT_MAGIC;
+	bkp[CKPT_REG_IMAGE_ID] = wlc_ckpt_image_id();
+	bkp[CKPT_REG_IMAGE_SIZE] = wlc_ckpt_image_size();
+	bkp[CKPT_REG_NEXT_SECTOR] = (u32)next_sector;
+	bkp[CKPT_REG_DIGEST] = nvm_digest.crc;
+	/* Written last: a record torn by a brown-out fails the check */
+	bkp[CKPT_REG_CHECK] = ~(CKPT_MAGIC ^ wlc_ckpt_image_id() ^
+							wlc_ckpt_image_size() ^ (u32)next_sector ^
+							nvm_digest.crc);
+}
+
+/* The final CRC32 stays in CKPT_REG_DIGEST as the record of the update */
+static void wlc_ckpt_clear(void)
+{
+	volatile u32 *bkp = wlc_ckpt_regs();
+
+	bkp[CKPT_REG_MAGIC] = 0;
+	bkp[CKPT_REG_CHECK] = 0;
+	bkp[CKPT_REG_DIGEST] = ~nvm_digest.crc;
+}
+
+/*
+ * Return the first unconfirmed sector of an interrupted update of this
+ * image, or -1 if there is no usable checkpoint.
+ */
+static int wlc_ckpt_load(void)
+{
+	volatile u32 *bkp = wlc_ckpt_regs();
+	u32 next_sector = bkp[CKPT_REG_NEXT_SECTOR];
+
+	if (bkp[CKPT_REG_MAGIC] != CKPT_MAGIC ||
+		bkp[CKPT_REG_IMAGE_ID] != wlc_ckpt_image_id() ||
+		bkp[CKPT_REG_IMAGE_SIZE] != wlc_ckpt_image_size() ||
+		bkp[CKPT_REG_CHECK] != ~(CKPT_MAGIC ^ wlc_ckpt_image_id() ^
+								 wlc_ckpt_image_size() ^ next_sector ^
+								 bkp[CKPT_REG_DIGEST]) ||
+		next_sector > NVM_CFG_START_SECTOR_INDEX +
+		(NVM_IMG_CFG_SIZE + NVM_SECTOR_SIZE_BYTES - 1) / NVM_SECTOR_SIZE_BYTES)
+		return -1;
+
+	return (int)next_sector;
+}
+
+int wlc_nvm_resume_pending(void)
+{
+	return wlc_ckpt_load() > 0;
+}
+
+/* Drop the checkpoint, e.g. when another chip replaces the one it was for */
+void wlc_nvm_resume_cancel(void)
+{
+	volatile u32 *bkp = wlc_ckpt_regs();
+
+	bkp[CKPT_REG_MAGIC] = 0;
+	bkp[CKPT_REG_CHECK] = 0;
+}
+
+static int wlc_nvm_write_sector(const u8 *data, int data_length,
+									int sector_index)
+{
+	int err = 0;
+	int i = 0;
+	int timeout = 1;
+	u8 reg_value = 0;
+	u8 index_value = (u8)sector_index;
+	u8 nvm_load = 0x10;
+	u32 start = wlc_cycles();
+#if !WLC_ZERO_COPY
+	u8 write_buff[NVM_SECTOR_SIZE_BYTES];
+#endif
+	struct wlc_xfer setup_seq[] = {
+		{ WLC_XFER_FW_WRITE, FWREG_NVM_SECTOR_INDEX_ADDR, &index_value, 1 },
+		{ WLC_XFER_FW_WRITE, FWREG_SYS_CMD_ADDR, &nvm_load, 1 },
+	};
+
+	if (progress.cb == NULL)
+		pr_info("[WLC] writing sector %02X\n", sector_index);
+	if (data_length > NVM_SECTOR_SIZE_BYTES) {
+		pr_err("[WLC] sector data bigger than 256 bytes\n");
+		return E_INVALID_INPUT;
+	}
+
+#if !WLC_ZERO_COPY
+	memset(write_buff, 0, NVM_SECTOR_SIZE_BYTES);
+	memcpy(write_buff, data, data_length);
+	/* Into write_buff here, then into the command in fw_i2c_write */
+	nvm_write_stats.copied_bytes += 2 * data_length;
+#endif
+
+	err = wlc_xfer_run(setup_seq, 2);
+	if (err != OK)
+		return err;
+
+#if WLC_ZERO_COPY
+	err = fw_i2c_write_nocopy(FWREG_AUX_DATA_00_ADDR, data, data_length);
+#else
 	err = fw_i2c_write(FWREG_AUX_DATA_00_ADDR, write_buff, data_length);
+#endif
+	if (err != OK)
+		return err;
+
+	reg_value = 0x04;
+	err = fw_i2c_write(FWREG_SYS_CMD_ADDR, &reg_value, 1);
+	if (err != OK)
+		return err;
+
+	for (i = 0; i < 20; i++) {
+		msleep(1);
+		err = fw_i2c_read(FWREG_SYS_CMD_ADDR, &reg_value, 1);
+		if (err != OK)
+			return err;
+		if ((reg_value & 0x04) == 0) {
+			timeout = 0;
+			break;
+		}
+	}
+
+	reg_value = 0x20;
+	if (fw_i2c_write(FWREG_SYS_CMD_ADDR, &reg_value, 1) != OK)
+		pr_err("[WLC] Error power down the NVM\n");
+
+	nvm_write_stats.sectors++;
+	nvm_write_stats.cycles += wlc_cycles() - start;
+	return timeout == 0 ? OK : E_TIMEOUT;
+}
+
+/*
+ * Offset of NVM sector sector_index in its part of the image, patch or
+ * cfg, and the size of that part.
+ */
+static int wlc_nvm_sector_offset(int sector_index, int *size)
+{
+	if (sector_index >= NVM_CFG_START_SECTOR_INDEX) {
+		*size = NVM_IMG_CFG_SIZE;
+		return (sector_index - NVM_CFG_START_SECTOR_INDEX) *
+			   NVM_SECTOR_SIZE_BYTES;
+	}
+	*size = NVM_IMG_PATCH_SIZE;
+	return (sector_index - NVM_PATCH_START_SECTOR_INDEX) *
+		   NVM_SECTOR_SIZE_BYTES;
+}
+
+/* Image bytes in NVM sector sector_index, 0 if the image ends before it */
+static int wlc_nvm_sector_len(int sector_index)
+{
+	int size;
+	int offset = wlc_nvm_sector_offset(sector_index, &size);
+
+	if (offset < 0 || offset >= size)
+		return 0;
+
+	return size - offset > NVM_SECTOR_SIZE_BYTES
+		   ? NVM_SECTOR_SIZE_BYTES : size - offset;
+}
+
+/*** Blank sector skipping **/
+
+void wlc_set_nvm_target_erased(int erased)
+{
+	nvm_target_erased = erased;
+}
+
+#ifndef WLC_DELTA
+static int wlc_nvm_sector_blank(u8 sector_index)
+{
+	return (nvm_blank_map[sector_index >> 3] >> (sector_index & 7)) & 1;
+}
+
+/*
+ * Mark the sectors of an image that hold nothing but the erased pattern,
+ * a short tail sector included. Returns the number of blank sectors.
+ */
+static int wlc_nvm_blank_scan(const u8 *data, int data_length,
+							  u8 sector_index)
+{
+	int i;
+	int len;
+	int blank = 0;
+
+	while (data_length > 0) {
+		len = data_length > NVM_SECTOR_SIZE_BYTES
+			  ? NVM_SECTOR_SIZE_BYTES : data_length;
+		for (i = 0; i < len; i++)
+			if (data[i] != WLC_NVM_ERASED_BYTE)
+				break;
+		if (i == len) {
+			nvm_blank_map[sector_index >> 3] |= 1 << (sector_index & 7);
+			blank++;
+		} else {
+			nvm_blank_map[sector_index >> 3] &= ~(1 << (sector_index & 7));
+		}
+		data += len;
+		data_length -= len;
+		sector_index++;
+	}
+
+	return blank;
+}
+#endif
+
+/*** Progress reporting **/
+
+void wlc_set_progress_cb(wlc_progress_cb_t cb, void *ctx)
+{
+	progress.cb = cb;
+	progress.ctx = ctx;
+}
+
+static void wlc_progress_notify(void)
+{
+	if (progress.cb == NULL)
+		return;
+	progress.cur.elapsed_ms = HAL_GetTick() - progress.start_ms;
+	progress.cb(progress.ctx, &progress.cur);
+}
+
+#ifndef WLC_DELTA
+static int wlc_progress_sectors(u32 bytes)
+{
+	return (bytes + NVM_SECTOR_SIZE_BYTES - 1) / NVM_SECTOR_SIZE_BYTES;
+}
+#endif
+
+/* Enter a phase; PREPARE and VERIFY restart the counts for bytes_total */
+static void wlc_progress_phase(wlc_progress_phase_t phase, u16 sectors_total,
+							   u32 bytes_total)
+{
+	progress.cur.phase = phase;
+	if (phase == WLC_PROGRESS_PREPARE || phase == WLC_PROGRESS_VERIFY) {
+		progress.cur.sectors_done = 0;
+		progress.cur.sectors_total = sectors_total;
+		progress.cur.bytes_sent = 0;
+		progress.cur.rate = 0;
+		progress.cur.eta_ms = 0;
+		progress.bytes_total = bytes_total;
+		progress.bytes_done = 0;
+	}
+	progress.step_cycles = wlc_cycles();
+	wlc_progress_notify();
+}
+
+/*
+ * One sector of len bytes done, sent on the bus or not. The rate is an
+ * exponential average of the per-sector rates of the sectors sent.
+ */
+static void wlc_progress_sector(u32 len, int sent)
+{
+	u32 now = wlc_cycles();
+	u32 cycles = now - progress.step_cycles;
+	u32 rate;
+
+	progress.step_cycles = now;
+	progress.cur.sectors_done++;
+	progress.bytes_done += len;
+	if (sent) {
+		progress.cur.bytes_sent += len;
+		if (cycles) {
+			rate = (u32)((uint64_t)len * SystemCoreClock / cycles);
+			if (progress.cur.rate)
+				rate = (u32)((int)progress.cur.rate +
+							 ((int)rate - (int)progress.cur.rate) /
+							 WLC_PROGRESS_SMOOTHING);
+			progress.cur.rate = rate;
+		}
+	}
+	if (progress.cur.rate)
+		progress.cur.eta_ms = (u32)((uint64_t)(progress.bytes_total -
+									progress.bytes_done) * 1000 /
+									progress.cur.rate);
+	wlc_progress_notify();
+}
+
+/*** Image digest **/
+
+/*
+ * Start the digest, or pick it up from the checkpoint of an interrupted
+ * update. The SHA-256 state does not fit the backup registers: it is
+ * rebuilt from the confirmed sectors as wlc_nvm_write_bulk() passes them.
+ */
+static void wlc_nvm_digest_start(int resume)
+{
+	nvm_digest.crc = resume ? wlc_ckpt_regs()[CKPT_REG_DIGEST] : 0xFFFFFFFF;
+	nvm_digest.bytes = 0;
+#ifdef WLC_DELTA
+	nvm_digest.target = 0;
+#endif
+#if WLC_DIGEST_SHA256
+	wlc_sha256_init(&nvm_digest.sha);
+#endif
+}
+
+/* Fold in the bytes of one sector; resumed ones are already in the CRC */
+static void wlc_nvm_digest_sector(const u8 *data, int len, int resumed)
+{
+	if (!resumed)
+		nvm_digest.crc = wlc_crc32_update(nvm_digest.crc, data, len);
+	nvm_digest.bytes += len;
+#if WLC_DIGEST_SHA256
+	wlc_sha256_update(&nvm_digest.sha, data, len);
+#endif
+}
+
+/*
+ * Final digest, compared against the manifest the image header may carry:
+ * NVM_IMAGE_CRC32 and, with WLC_DIGEST_SHA256, NVM_IMAGE_SHA256 as a byte
+ * list (see tools/wlc_manifest.py). A UBIN file has no image manifest. A
+ * delta package also carries NVM_DELTA_* for its payload, checked unless
+ * the whole target was read back.
+ */
+static void wlc_nvm_digest_final(struct wlc_nvm_digest *digest)
+{
+#if defined(NVM_IMAGE_CRC32) && !defined(UBIN)
+#ifdef WLC_DELTA
+	u32 manifest_crc32 = nvm_digest.target ? NVM_IMAGE_CRC32 : NVM_DELTA_CRC32;
+#else
+	u32 manifest_crc32 = NVM_IMAGE_CRC32;
+#endif
+#endif
+#if WLC_DIGEST_SHA256 && defined(NVM_IMAGE_SHA256) && !defined(UBIN)
+	static const u8 image_sha256[32] = { NVM_IMAGE_SHA256 };
+#ifdef WLC_DELTA
+	static const u8 delta_sha256[32] = { NVM_DELTA_SHA256 };
+	const u8 *manifest_sha256 = nvm_digest.target ? image_sha256 :
+												   delta_sha256;
+#else
+	const u8 *manifest_sha256 = image_sha256;
+#endif
+#endif
+
+	digest->bytes = nvm_digest.bytes;
+	digest->crc32 = ~nvm_digest.crc;
+	digest->manifest = -1;
+#if defined(NVM_IMAGE_CRC32) && !defined(UBIN)
+	digest->manifest = digest->crc32 == manifest_crc32;
+#endif
+#if WLC_DIGEST_SHA256
+	wlc_sha256_final(&nvm_digest.sha, digest->sha256);
+#if defined(NVM_IMAGE_SHA256) && !defined(UBIN)
+	if (memcmp(digest->sha256, manifest_sha256, 32) != 0)
+		digest->manifest = 0;
+	else if (digest->manifest != 0)
+		digest->manifest = 1;
+#endif
+#endif
+	/* The manifest is of the image as built, not of a personalised one */
+	if (cfg_overlay.config_id)
+		digest->manifest = -1;
+}
+
+static int wlc_nvm_write_sector_retry(const u8 *data, int data_length,
+									  int sector_index)
+{
+	int err = OK;
+	int attempt;
+
+	for (attempt = 0; attempt < retry_policy.sector_attempts; attempt++) {
+		if (attempt) {
+			pr_info("[WLC] retrying sector %02X\n", sector_index);
+			retry_stats.sector_retries++;
+		}
+		err = wlc_nvm_write_sector(data, data_length, sector_index);
+		if (err == OK || err == E_INVALID_INPUT)
+			break;
+	}
+	return err;
+}
+
+#ifndef WLC_DELTA
+static int wlc_nvm_write_bulk(const u8 *data, int data_length,
+								u8 sector_index)
+{
+	int err = 0;
+	int remaining = data_length;
+	int to_write_now = 0;
+	int written_already = 0;
+	const u8 *sector_data;
+	while (remaining > 0) {
+		wlc_platform_poll();
+		to_write_now = remaining > NVM_SECTOR_SIZE_BYTES
+						? NVM_SECTOR_SIZE_BYTES : remaining;
+		sector_data = wlc_cfg_overlay_apply(data + written_already,
+											to_write_now, sector_index);
+		if (sector_index < nvm_resume_sector) {
+			wlc_nvm_digest_sector(sector_data, to_write_now, 1);
+			wlc_progress_sector(to_write_now, 0);
+			remaining -= to_write_now;
+			written_already += to_write_now;
+			sector_index++;
+			continue;
+		}
+		if (nvm_target_erased && sector_data == data + written_already &&
+			wlc_nvm_sector_blank(sector_index)) {
+			nvm_write_stats.skipped++;
+			/* Not sent, but the erased sector holds exactly these bytes */
+			wlc_nvm_digest_sector(sector_data, to_write_now, 0);
+			wlc_progress_sector(to_write_now, 0);
+			wlc_ckpt_store(sector_index + 1);
+			remaining -= to_write_now;
+			written_already += to_write_now;
+			sector_index++;
+			continue;
+		}
+		err = wlc_nvm_write_sector_retry(sector_data, to_write_now,
+										 sector_index);
+		if (err != OK)
+			return err;
+		wlc_nvm_digest_sector(sector_data, to_write_now, 0);
+		wlc_ckpt_store(sector_index + 1);
+		wlc_progress_sector(to_write_now, 1);
+		remaining -= to_write_now;
+		written_already += to_write_now;
+		sector_index++;
+	}
+
+	return OK;
+}
+#endif
+
+void wlc_get_nvm_write_stats(struct wlc_nvm_write_stats *stats)
+{
+	*stats = nvm_write_stats;
+}
+
+void wlc_set_verify_level(wlc_verify_level_t level)
+{
+	verify_level = level;
+}
+
+void wlc_get_verify_report(struct wlc_verify_report *report)
+{
+	*report = verify_report;
+}
+
+struct wlc_nvm_verify_ctx {
+	const u8 *data;
+	int sector_index;
+};
+
+/*
+ * Compare one read-back sector with the image, byte by byte. Runs while
+ * the next sector is already being read.
+ */
+static int wlc_nvm_verify_seg(void *arg, u32 offset, const u8 *nvm, u16 len)
+{
+	struct wlc_nvm_verify_ctx *ctx = arg;
+	int sector_index = ctx->sector_index + offset / NVM_SECTOR_SIZE_BYTES;
+	const u8 *image = wlc_cfg_overlay_apply(ctx->data + offset, len,
+											sector_index);
+	int i;
+
+	wlc_platform_poll();
+	verify_report.bytes_read += len;
+
+	for (i = 0; i < len; i++) {
+		if (nvm[i] != image[i]) {
+			pr_err("[WLC] sector %02X offset %02X image|nvm: [%02X|%02X]\n",
+				   sector_index, i, image[i], nvm[i]);
+			verify_report.bad_sector = sector_index;
+			verify_report.bad_offset = i;
+			return E_NVM_DATA_MISMATCH;
+		}
+	}
+
+	verify_report.sectors++;
+	/* Not for the checkpoint sector read back before resuming */
+	if (progress.cur.phase == WLC_PROGRESS_VERIFY)
+		wlc_progress_sector(len, 1);
+	return OK;
+}
+
+/*
+ * Nothing in the tree documents HWREG_NVM_BASE_ADDR, so check it before a
+ * read-back is trusted: the cfg area starts with the cfg id, which the FW
+ * loaded from the NVM and reports in its chip info. A blank id proves
+ * nothing and fails too. One 2 byte read after the chip info.
+ */
+static int wlc_nvm_window_check(void)
+{
+	struct wlc_chip_info info;
+	u8 id[2];
+	u16 window_id;
+	int err;
+
+	err = wlc_read_chip_info(&info, 0);
+	if (err != OK)
+		return err;
+
+	err = hw_i2c_read(HWREG_NVM_BASE_ADDR + NVM_CFG_START_SECTOR_INDEX *
+					  NVM_SECTOR_SIZE_BYTES, id, sizeof(id));
+	if (err != OK)
+		return err;
+
+	window_id = (u16)(id[0] | (id[1] << 8));
+	if (window_id != info.config_id || window_id == 0x0000 ||
+		window_id == 0xFFFF) {
+		pr_err("[WLC] RRAM window %08lX reads cfg id %04X, FW reports "
+			   "%04X: NVM read-back unavailable\n",
+			   (unsigned long)HWREG_NVM_BASE_ADDR, window_id,
+			   info.config_id);
+		return E_NVM_WINDOW;
+	}
+	return OK;
+}
+
+/*
+ * Read back data_length image bytes from sector_index on through the RRAM
+ * window, one sector per segment, and check them against the image.
+ */
+static int wlc_nvm_verify_bulk(const u8 *data, int data_length,
+							   int sector_index)
+{
+	struct wlc_nvm_verify_ctx ctx;
+
+	ctx.data = data;
+	ctx.sector_index = sector_index;
+	return wlc_seg_read(1, HWREG_NVM_BASE_ADDR +
+						(u32)sector_index * NVM_SECTOR_SIZE_BYTES,
+						data_length, NVM_SECTOR_SIZE_BYTES,
+						wlc_nvm_verify_seg, &ctx);
+}
+
+/* Sector i of count is read back: all at FULL, a sample at SAMPLE */
+static int wlc_nvm_verify_pick(int i, int count, wlc_verify_level_t level)
+{
+	return level == WLC_VERIFY_FULL || i % WLC_VERIFY_SAMPLE_STRIDE == 0 ||
+		   i == count - 1;
+}
+
+#ifndef WLC_DELTA
+/*
+ * Check the sectors of one image area the level picks; returns OK or the
+ * first mismatch. With 'bytes' set only counts what would be read.
+ */
+static int wlc_nvm_verify_area(const u8 *data, int size, int first_sector,
+							   wlc_verify_level_t level, u32 *bytes)
+{
+	int count = (size + NVM_SECTOR_SIZE_BYTES - 1) / NVM_SECTOR_SIZE_BYTES;
+	int offset;
+	int len;
+	int err;
+	int i;
+
+	if (level == WLC_VERIFY_FULL) {
+		if (bytes) {
+			*bytes += size;
+			return count;
+		}
+		return wlc_nvm_verify_bulk(data, size, first_sector);
+	}
+
+	err = 0;
+	for (i = 0; i < count; i++) {
+		if (!wlc_nvm_verify_pick(i, count, level))
+			continue;
+		offset = i * NVM_SECTOR_SIZE_BYTES;
+		len = size - offset < NVM_SECTOR_SIZE_BYTES ?
+			  size - offset : NVM_SECTOR_SIZE_BYTES;
+		if (bytes) {
+			*bytes += len;
+			err++;
+			continue;
+		}
+		err = wlc_nvm_verify_bulk(data + offset, len, first_sector + i);
+		if (err != OK)
+			return err;
+	}
+	return err;
+}
+#endif
+
+static int wlc_nvm_verify(wlc_verify_level_t level)
+{
+	int err;
+#ifdef WLC_DELTA
+	const u8 *data = nvm_delta_data;
+	u32 bytes = 0;
+	int sectors = 0;
+	int len;
+	int i;
+
+	for (i = 0; i < NVM_DELTA_SECTORS; i++) {
+		if (wlc_nvm_verify_pick(i, NVM_DELTA_SECTORS, level)) {
+			bytes += wlc_nvm_sector_len(nvm_delta_sectors[i]);
+			sectors++;
+		}
+	}
+
+	/* The rest of the NVM was checked by the delta target digest */
+	pr_info("[WLC] NVM read-back verification (level %d) of %d of %d delta "
+			"sectors\n", level, sectors, NVM_DELTA_SECTORS);
+	wlc_progress_phase(WLC_PROGRESS_VERIFY, sectors, bytes);
+	for (i = 0; i < NVM_DELTA_SECTORS; i++) {
+		len = wlc_nvm_sector_len(nvm_delta_sectors[i]);
+		if (wlc_nvm_verify_pick(i, NVM_DELTA_SECTORS, level)) {
+			err = wlc_nvm_verify_bulk(data, len, nvm_delta_sectors[i]);
+			if (err != OK)
+				return err;
+		}
+		data += len;
+	}
+	return OK;
+#else
+	u32 bytes = 0;
+	int sectors;
+
+	sectors = wlc_nvm_verify_area(NVM_IMG_PATCH_DATA, NVM_IMG_PATCH_SIZE,
+								  NVM_PATCH_START_SECTOR_INDEX, level, &bytes);
+	sectors += wlc_nvm_verify_area(NVM_IMG_CFG_DATA, NVM_IMG_CFG_SIZE,
+								   NVM_CFG_START_SECTOR_INDEX, level, &bytes);
+
+	pr_info("[WLC] NVM read-back verification (level %d), %d sectors\n",
+			level, sectors);
+	wlc_progress_phase(WLC_PROGRESS_VERIFY, sectors, bytes);
+	err = wlc_nvm_verify_area(NVM_IMG_PATCH_DATA, NVM_IMG_PATCH_SIZE,
+							  NVM_PATCH_START_SECTOR_INDEX, level, NULL);
 	if (err != OK)
 		return err;
 
-	reg_value = 0x04;
-	err = fw_i2c_write(FWREG_SYS_CMD_ADDR, &reg_value, 1);
-	if (err != OK)
-		return err;
+	return wlc_nvm_verify_area(NVM_IMG_CFG_DATA, NVM_IMG_CFG_SIZE,
+							   NVM_CFG_START_SECTOR_INDEX, level, NULL);
+#endif
+}
 
-	for (i = 0; i < 20; i++) {
-		msleep(1);
-		err = fw_i2c_read(FWREG_SYS_CMD_ADDR, &reg_value, 1);
-		if (err != OK)
-			return err;
-		if ((reg_value & 0x04) == 0) {
-			timeout = 0;
-			break;
+/*
+ * Image bytes that belong to NVM sector sector_index: returns their count
+ * (0 if the image does not cover the sector) and points data at them. A
+ * delta package only has the sectors it changes.
+ */
+static int wlc_nvm_sector_slice(int sector_index, const u8 **data)
+{
+#ifdef WLC_DELTA
+	const u8 *payload = nvm_delta_data;
+	int i;
+
+	for (i = 0; i < NVM_DELTA_SECTORS; i++) {
+		if (nvm_delta_sectors[i] == sector_index) {
+			*data = payload;
+			return wlc_nvm_sector_len(sector_index);
 		}
+		payload += wlc_nvm_sector_len(nvm_delta_sectors[i]);
 	}
+	return 0;
+#else
+	int size;
+	int offset = wlc_nvm_sector_offset(sector_index, &size);
+	int len = wlc_nvm_sector_len(sector_index);
+
+	if (len)
+		*data = (sector_index >= NVM_CFG_START_SECTOR_INDEX ?
+				 NVM_IMG_CFG_DATA : NVM_IMG_PATCH_DATA) + offset;
+	return len;
+#endif
+}
 
-	reg_value = 0x20;
-	if (fw_i2c_write(FWREG_SYS_CMD_ADDR, &reg_value, 1) != OK)
-		pr_err("[WLC] Error power down the NVM\n");
+/*
+ * Pick the sector to restart from. The last sector the checkpoint claims
+ * is read back and compared first; if that fails the whole image is
+ * written again.
+ */
+static int wlc_nvm_resume_sector(void)
+{
+	int next_sector = wlc_ckpt_load();
+	int length;
+	const u8 *data;
+
+	if (next_sector <= 0)
+		return 0;
+
+	length = wlc_nvm_sector_slice(next_sector - 1, &data);
+	if (length == 0 || wlc_nvm_window_check() != OK ||
+		wlc_nvm_verify_bulk(data, length, next_sector - 1) != OK) {
+		pr_info("[WLC] checkpoint sector %02X failed read-back, "
+				"restarting update\n", next_sector - 1);
+		return 0;
+	}
 
-	return timeout == 0 ? OK : E_TIMEOUT;
+	pr_info("[WLC] resuming interrupted update at sector %02X\n",
+			next_sector);
+	return next_sector;
 }
 
-static int wlc_nvm_write_bulk(const u8 *data, int data_length,
-								u8 sector_index)
+/*** Delta update **/
+
+#ifdef WLC_DELTA
+/*
+ * Program the sectors the delta package changes, in the ascending order it
+ * lists them. Every other sector keeps the bytes of the source image.
+ */
+static int wlc_nvm_delta_write(void)
 {
-	int err = 0;
-	int remaining = data_length;
-	int to_write_now = 0;
-	int written_already = 0;
-	while (remaining > 0) {
-		to_write_now = remaining > NVM_SECTOR_SIZE_BYTES
-						? NVM_SECTOR_SIZE_BYTES : remaining;
-		err = wlc_nvm_write_sector(data + written_already,
-									to_write_now, sector_index);
+	const u8 *data = nvm_delta_data;
+	int sector_index;
+	int len;
+	int err;
+	int i;
+
+	pr_info("[WLC] delta from patch|cfg [%04X|%04X], %d sectors\n",
+			NVM_DELTA_SOURCE_PATCH_ID, NVM_DELTA_SOURCE_CFG_ID,
+			NVM_DELTA_SECTORS);
+	wlc_progress_phase(WLC_PROGRESS_PATCH, 0, 0);
+	for (i = 0; i < NVM_DELTA_SECTORS; i++) {
+		wlc_platform_poll();
+		sector_index = nvm_delta_sectors[i];
+		len = wlc_nvm_sector_len(sector_index);
+		if (sector_index >= NVM_CFG_START_SECTOR_INDEX &&
+			progress.cur.phase == WLC_PROGRESS_PATCH)
+			wlc_progress_phase(WLC_PROGRESS_CFG, 0, 0);
+		if (sector_index < nvm_resume_sector) {
+			wlc_nvm_digest_sector(data, len, 1);
+			wlc_progress_sector(len, 0);
+			data += len;
+			continue;
+		}
+		err = wlc_nvm_write_sector_retry(data, len, sector_index);
 		if (err != OK)
 			return err;
-		remaining -= to_write_now;
-		written_already += to_write_now;
-		sector_index++;
+		wlc_nvm_digest_sector(data, len, 0);
+		wlc_ckpt_store(sector_index + 1);
+		wlc_progress_sector(len, 1);
+		data += len;
 	}
+	if (progress.cur.phase == WLC_PROGRESS_PATCH)
+		wlc_progress_phase(WLC_PROGRESS_CFG, 0, 0);
 
 	return OK;
 }
 
-static int wlc_nvm_write()
+static int wlc_nvm_delta_digest_seg(void *ctx, u32 offset, const u8 *data,
+									u16 len)
 {
-	int err = 0;
-	u8 reg_value = 0;
+	wlc_platform_poll();
+	wlc_nvm_digest_sector(data, len, 0);
+	return OK;
+}
 
-	/* Disable Tx pinging if detected Tx mode */
-	err = fw_i2c_read(FWREG_OP_MODE_ADDR, &reg_value, 1);
-	if (err != OK)
-		return err;
-	pr_info("[WLC] OP MODE %02X\n", reg_value);
-	if (reg_value == FW_OP_MODE_TX) {
-		reg_value = 0x02;
-		err = fw_i2c_write(FWREG_TX_CMD_ADDR, &reg_value, 1);
-		if (err != OK)
-			return err;
-	}
-	msleep(GENERAL_SLEEP_MS);
+/*
+ * FULL level only: read the whole patch and cfg areas back into the digest
+ * and check it against the target image manifest, which also catches a
+ * chip that did not hold the source image. It reads the entire image, as
+ * long as a full update's write, so lower levels check the digest of the
+ * payload sent against the package instead.
+ */
+static int wlc_nvm_delta_readback(void)
+{
+	int err;
 
-	reg_value = 0x0B;
-	err = hw_i2c_write(HWREG_TM_CONFIG_ADDR, &reg_value, 1);
+	err = wlc_nvm_window_check();
 	if (err != OK)
 		return err;
 
-	reg_value = 0x00;
-	err = hw_i2c_write(HWREG_TM_CONFIG_ADDR, &reg_value, 1);
+	wlc_nvm_digest_start(0);
+	nvm_digest.target = 1;
+	err = wlc_seg_read(1, HWREG_NVM_BASE_ADDR + NVM_PATCH_START_SECTOR_INDEX *
+					   NVM_SECTOR_SIZE_BYTES, NVM_IMG_PATCH_SIZE,
+					   NVM_SECTOR_SIZE_BYTES, wlc_nvm_delta_digest_seg, NULL);
 	if (err != OK)
 		return err;
 
-	/* FW system reset */
-	reg_value = 0x40;
-	err = fw_i2c_write(FWREG_SYS_CMD_ADDR, &reg_value, 1);
+	return wlc_seg_read(1, HWREG_NVM_BASE_ADDR + NVM_CFG_START_SECTOR_INDEX *
+						NVM_SECTOR_SIZE_BYTES, NVM_IMG_CFG_SIZE,
+						NVM_SECTOR_SIZE_BYTES, wlc_nvm_delta_digest_seg, NULL);
+}
+#endif
+
+static int wlc_nvm_write()
+{
+	int err = 0;
+	int first = 0;
+	u8 reg_value = 0;
+	u8 tx_disable = 0x02;
+	u8 tm_enable = 0x0B;
+	u8 tm_disable = 0x00;
+	u8 fw_reset = 0x40;
+	struct wlc_xfer prepare_seq[] = {
+		/* Disable Tx pinging, only sent if Tx mode detected */
+		{ WLC_XFER_FW_WRITE, FWREG_TX_CMD_ADDR, &tx_disable, 1 },
+		{ WLC_XFER_WAIT_READY, GENERAL_SLEEP_MS, NULL, 0 },
+		{ WLC_XFER_HW_WRITE, HWREG_TM_CONFIG_ADDR, &tm_enable, 1 },
+		{ WLC_XFER_HW_WRITE, HWREG_TM_CONFIG_ADDR, &tm_disable, 1 },
+		/* FW system reset */
+		{ WLC_XFER_FW_WRITE, FWREG_SYS_CMD_ADDR, &fw_reset, 1 },
+		{ WLC_XFER_WAIT_READY, AFTER_SYS_RESET_SLEEP_MS, NULL, 0 },
+		/* DC mode checking */
+		{ WLC_XFER_FW_READ, FWREG_OP_MODE_ADDR, &reg_value, 1 },
+	};
+
+#ifdef WLC_DELTA
+	wlc_progress_phase(WLC_PROGRESS_PREPARE, NVM_DELTA_SECTORS,
+					   NVM_DELTA_BYTES);
+#else
+	wlc_progress_phase(WLC_PROGRESS_PREPARE,
+					   wlc_progress_sectors(NVM_IMG_PATCH_SIZE) +
+					   wlc_progress_sectors(NVM_IMG_CFG_SIZE),
+					   NVM_IMG_PATCH_SIZE + NVM_IMG_CFG_SIZE);
+#endif
+	err = fw_i2c_read(FWREG_OP_MODE_ADDR, &reg_value, 1);
 	if (err != OK)
 		return err;
-	msleep(AFTER_SYS_RESET_SLEEP_MS);
+	pr_info("[WLC] OP MODE %02X\n", reg_value);
+	if (reg_value != FW_OP_MODE_TX)
+		first = 1;
 
-	/* DC mode checking */
-	err = fw_i2c_read(FWREG_OP_MODE_ADDR, &reg_value, 1);
+	err = wlc_xfer_run(&prepare_seq[first],
+					   (int)(sizeof(prepare_seq) / sizeof(prepare_seq[0])) - first);
 	if (err != OK)
 		return err;
 	pr_info("[WLC] OP MODE %02X\n", reg_value);
@@ -462,49 +2569,125 @@ static int wlc_nvm_write()
 	if (err != OK)
 		return err;
 
+	nvm_resume_sector = wlc_nvm_resume_sector();
+	wlc_nvm_digest_start(nvm_resume_sector > 0);
+	if (nvm_resume_sector == 0)
+		wlc_ckpt_store(0);
+
 	pr_info("[WLC] RRAM Programming..\n");
-	/* Patch writing */
+#ifdef WLC_DELTA
+	err = wlc_nvm_delta_write();
+	if (err != OK)
+		return err;
+#else
+	if (nvm_target_erased) {
+		memset(nvm_blank_map, 0, sizeof(nvm_blank_map));
+		pr_info("[WLC] target erased, %d blank sectors to skip\n",
+				wlc_nvm_blank_scan(NVM_IMG_PATCH_DATA, NVM_IMG_PATCH_SIZE,
+								   NVM_PATCH_START_SECTOR_INDEX) +
+				wlc_nvm_blank_scan(NVM_IMG_CFG_DATA, NVM_IMG_CFG_SIZE,
+								   NVM_CFG_START_SECTOR_INDEX));
+	}
 
-#ifdef UBIN
-	err = wlc_nvm_write_bulk(fw_data.fw_patch_data, fw_data.fw_patch_size,
-								 NVM_PATCH_START_SECTOR_INDEX);
-#else 
-	err = wlc_nvm_write_bulk(nvm_patch_data, NVM_PATCH_SIZE,
+	/* Patch writing */
+	wlc_progress_phase(WLC_PROGRESS_PATCH, 0, 0);
+	err = wlc_nvm_write_bulk(NVM_IMG_PATCH_DATA, NVM_IMG_PATCH_SIZE,
 								 NVM_PATCH_START_SECTOR_INDEX);
-#endif 
-
 	if (err != OK)
 		return err;
 
 	/* Cfg writing */
-#ifdef UBIN
-	err = wlc_nvm_write_bulk(fw_data.fw_config_data, fw_data.fw_config_size,
-								 NVM_CFG_START_SECTOR_INDEX);
-#else 
-	err = wlc_nvm_write_bulk(nvm_cfg_data, NVM_CFG_SIZE,
+	wlc_progress_phase(WLC_PROGRESS_CFG, 0, 0);
+	err = wlc_nvm_write_bulk(NVM_IMG_CFG_DATA, NVM_IMG_CFG_SIZE,
 								 NVM_CFG_START_SECTOR_INDEX);
-#endif 
-
 	if (err != OK)
 		return err;
+#endif
 
+	wlc_ckpt_clear();
 	system_reset();
 
 	return OK;
 }
 
+/*** Register snapshot **/
+
+static int wlc_snapshot_range(u8 space, u32 addr, u32 len)
+{
+	struct wlc_snap_rec rec;
+	u32 chunk;
+	int err;
+	int failed = 0;
+
+	while (len) {
+		chunk = len > I2C_CHUNK_SIZE ? I2C_CHUNK_SIZE : len;
+		if (space == WLC_SNAP_SPACE_HW)
+			err = hw_i2c_read(addr, seg_buf[0], chunk);
+		else
+			err = fw_i2c_read((u16)addr, seg_buf[0], chunk);
+
+		rec.addr = addr;
+		rec.length = (u16)chunk;
+		rec.space = space;
+		rec.status = err == OK ? HAL_OK : HAL_ERROR;
+		HAL_UART_Transmit(huart, (u8 *)&rec, sizeof(rec), IO_DELAY_MS);
+		if (err == OK)
+			HAL_UART_Transmit(huart, seg_buf[0], chunk, IO_DELAY_MS);
+		else
+			failed++;
+
+		addr += chunk;
+		len -= chunk;
+	}
+
+	return failed;
+}
+
+/*
+ * Send a binary snapshot of the FW register window and of snap_hw_ranges[]
+ * over the log UART, read in bursts of up to I2C_CHUNK_SIZE bytes.
+ * tools/wlc_snapshot_diff.py decodes and compares snapshots.
+ * Returns the number of chunks that could not be read.
+ */
+int wlc_snapshot_dump(void)
+{
+	struct wlc_snap_header header;
+	struct wlc_snap_rec end = { 0, 0, WLC_SNAP_SPACE_END, HAL_OK };
+	struct wlc_chip_info info;
+	int failed;
+	int i;
+
+	header.magic = WLC_SNAP_MAGIC;
+	header.version = WLC_SNAP_VERSION;
+	header.rec_size = sizeof(struct wlc_snap_rec);
+	header.timestamp_ms = HAL_GetTick();
+	header.chip_id = wlc_read_chip_info(&info, 0) == OK ? info.chip_id : 0;
+	header.chunk_size = I2C_CHUNK_SIZE;
+	HAL_UART_Transmit(huart, (u8 *)&header, sizeof(header), IO_DELAY_MS);
+
+	failed = wlc_snapshot_range(WLC_SNAP_SPACE_FW, WLC_SNAP_FW_START,
+								WLC_SNAP_FW_LEN);
+	for (i = 0; i < (int)(sizeof(snap_hw_ranges) / sizeof(snap_hw_ranges[0])); i++)
+		failed += wlc_snapshot_range(WLC_SNAP_SPACE_HW, snap_hw_ranges[i].addr,
+									 snap_hw_ranges[i].len);
+
+	HAL_UART_Transmit(huart, (u8 *)&end, sizeof(end), IO_DELAY_MS);
+	return failed;
+}
+
 int chip_info_show(char *buf)
 {
 	int count;
 	char temp[100];
-	u8 read_buff[14] = { 0x00 };
+	u8 read_buff[WLC_CHIP_INFO_LEN] = { 0x00 };
 	u8 cmd[2] = { 0x00 };
 
 	cmd[0] = (FWREG_CHIP_ID_ADDR & 0xFF00) >> 8;
 	cmd[1] = (FWREG_CHIP_ID_ADDR & 0xFF);
 	pr_info("[WLC] Chip Id Command: %02X %02X\n", cmd[0], cmd[1]);
 
-	if (wlc_i2c_read(cmd, 2, read_buff, 14) != OK) {
+	if (wlc_reg_cache_read(0, FWREG_CHIP_ID_ADDR, read_buff,
+						   WLC_CHIP_INFO_LEN, 0) != OK) {
 		pr_err("[WLC] could not read the register\n");
 		count = snprintf(buf, PAGE_SIZE, "CHIP INFO READ ERROR {%02X}\n",
 						 E_BUS_WR);
@@ -534,89 +2717,175 @@ int chip_info_show(char *buf)
 	return count;
 }
 
-int nvm_program_show(char *buf)
+/*
+ * Identity check shared by the check-only and programming paths. Costs one
+ * chip info read (served from the register cache when chip_info_show ran
+ * before) and never writes to the chip.
+ */
+static int wlc_nvm_check(struct wlc_chip_info *chip_info,
+						 int *config_id_mismatch, int *patch_id_mismatch)
 {
 	int err = 0;
-	int count = 0;
-	int config_id_mismatch = 0;
-	int patch_id_mismatch = 0;
-	struct wlc_chip_info chip_info;
-
 #ifdef UBIN
-	int original_size = ubin_size;
-	u8 *original_data = ubin_data;
+	static int ubin_parsed;
 
-	err = parse_ubin_file(original_data, original_size, &fw_data);
-	if (err != OK) {
-		pr_err("[WLC] Failed parsing ubin file.........ERROR %08X\n", err);
-		goto exit_0;
+	if (!ubin_parsed) {
+		err = parse_ubin_file(ubin_data, ubin_size, &fw_data);
+		if (err != OK) {
+			pr_err("[WLC] Failed parsing ubin file.........ERROR %08X\n",
+				   err);
+			return err;
+		}
+		ubin_parsed = 1;
 	}
 #endif
 
-	pr_info("[WLC] NVM Programming started\n");
-
-	if (get_wlc_chip_info(&chip_info) != OK) {
+	if (get_wlc_chip_info(chip_info) != OK) {
 		pr_err("[WLC] Error in reading wlc_chip_info\n");
-		err = E_BUS_R;
-		goto exit_0;
+		return E_BUS_R;
 	}
 
-	pr_info("[WLC] Chip Id: %02X\n", chip_info.chip_id);
+	pr_info("[WLC] Chip Id: %02X\n", chip_info->chip_id);
 
 #ifdef UBIN
-	if (chip_info.chip_id != fw_data.chip_id) {
+	if (chip_info->chip_id != fw_data.chip_id) {
 #else 
-	if (chip_info.chip_id != NVM_TARGET_CHIP_ID) {
+	if (chip_info->chip_id != NVM_TARGET_CHIP_ID) {
 #endif 
 
 		pr_info("[WLC] HW chip id mismatch with target chip id, "
 			"NVM programming aborted\n");
-		err = E_UNEXPECTED_CHIP_ID;
-		goto exit_0;
+		return E_UNEXPECTED_CHIP_ID;
 	}
 
 	/* Determine what has to be programmed depending on version ids */
-	pr_info("[WLC] Cut Id: %02X\n", chip_info.cut_id);
+	pr_info("[WLC] Cut Id: %02X\n", chip_info->cut_id);
 
 #ifdef UBIN
-	if (chip_info.cut_id != fw_data.chip_revision) {
+	if (chip_info->cut_id != fw_data.chip_revision) {
 #else 
-	if (chip_info.cut_id != NVM_TARGET_CUT_ID) {
+	if (chip_info->cut_id != NVM_TARGET_CUT_ID) {
 #endif 
 
 		pr_info("[WLC] HW cut id mismatch with Target cut id, "
 			"NVM programming aborted\n");
-		err = E_UNEXPECTED_HW_REV;
-		goto exit_0;
+		return E_UNEXPECTED_HW_REV;
 	}
 
-#ifdef UBIN
-	if (chip_info.config_id != fw_data.fw_config_version_id) {
-		pr_info("[WLC] Config ID mismatch - running|header: [%04X|%04X]\n",
-				chip_info.config_id, fw_data.fw_config_version_id);
-#else 
-	if (chip_info.config_id != NVM_CFG_VERSION_ID) {
-		pr_info("[WLC] Config ID mismatch - running|header: [%04X|%04X]\n",
-				chip_info.config_id, NVM_CFG_VERSION_ID);
-#endif 
+	err = wlc_cfg_overlay_check();
+	if (err != OK)
+		return err;
 
-		config_id_mismatch = 1;
+	if (chip_info->config_id != wlc_cfg_id()) {
+		pr_info("[WLC] Config ID mismatch - running|header: [%04X|%04X]\n",
+				chip_info->config_id, wlc_cfg_id());
+		*config_id_mismatch = 1;
 	}
 
 #ifdef UBIN
-	if (chip_info.nvm_patch_id != fw_data.fw_patch_version_id) {
+	if (chip_info->nvm_patch_id != fw_data.fw_patch_version_id) {
 		pr_info("[WLC] Patch ID mismatch - running|header: [%04X|%04X]\n",
-				chip_info.nvm_patch_id, fw_data.fw_patch_version_id);
+				chip_info->nvm_patch_id, fw_data.fw_patch_version_id);
 #else 
-	if (chip_info.nvm_patch_id != NVM_PATCH_VERSION_ID) {
+	if (chip_info->nvm_patch_id != NVM_PATCH_VERSION_ID) {
 		pr_info("[WLC] Patch ID mismatch - running|header: [%04X|%04X]\n",
-				chip_info.nvm_patch_id, NVM_PATCH_VERSION_ID);
+				chip_info->nvm_patch_id, NVM_PATCH_VERSION_ID);
 #endif 
 
-		patch_id_mismatch = 1;
+		*patch_id_mismatch = 1;
+	}
+
+#ifdef WLC_DELTA
+	/* The package only applies on top of its source image */
+	if ((*config_id_mismatch || *patch_id_mismatch) &&
+		!wlc_nvm_resume_pending() &&
+		(chip_info->nvm_patch_id != NVM_DELTA_SOURCE_PATCH_ID ||
+		 chip_info->config_id != NVM_DELTA_SOURCE_CFG_ID)) {
+		pr_info("[WLC] Delta source mismatch - running|package: "
+				"[%04X %04X|%04X %04X], NVM programming aborted\n",
+				chip_info->nvm_patch_id, chip_info->config_id,
+				NVM_DELTA_SOURCE_PATCH_ID, NVM_DELTA_SOURCE_CFG_ID);
+		return E_NVM_DELTA_SOURCE;
 	}
+#endif
+
+	return OK;
+}
+
+int nvm_check_show(char *buf)
+{
+	int err = 0;
+	int count = 0;
+	int config_id_mismatch = 0;
+	int patch_id_mismatch = 0;
+	u32 start = HAL_GetTick();
+	struct wlc_chip_info chip_info;
 
-	if (config_id_mismatch == 0 && patch_id_mismatch == 0) {
+	err = wlc_nvm_check(&chip_info, &config_id_mismatch, &patch_id_mismatch);
+	if (err == OK && (config_id_mismatch || patch_id_mismatch ||
+					  wlc_nvm_resume_pending()))
+		count = snprintf(buf, PAGE_SIZE, "{ %08X } update required\n", err);
+	else
+		count = snprintf(buf, PAGE_SIZE, "{ %08X }\n", err);
+
+	pr_info("[WLC] NVM check took %lu ms\n",
+			(unsigned long)(HAL_GetTick() - start));
+	return count;
+}
+
+/*
+ * Platform hooks around an NVM update, e.g. to raise the MCU clock for the
+ * transfer and drop it afterwards. No I2C transfer is in flight when they
+ * run; the platform must leave hi2c and huart initialised.
+ */
+__weak void wlc_platform_enter_update(void)
+{
+}
+
+__weak void wlc_platform_exit_update(void)
+{
+}
+
+/*
+ * Called between NVM sectors so the platform can serve short work (e.g. a
+ * command console) during an update. It must not start I2C transfers;
+ * wlc_update_active() tells when an update owns the bus.
+ */
+__weak void wlc_platform_poll(void)
+{
+}
+
+int wlc_update_active(void)
+{
+	return nvm_update_active;
+}
+
+int nvm_program_show(char *buf)
+{
+	int err = 0;
+	int count = 0;
+	int config_id_mismatch = 0;
+	int patch_id_mismatch = 0;
+	int nvm_touched = 0;
+	u32 start = HAL_GetTick();
+	u32 verify_start = 0;
+	u32 update_hz = SystemCoreClock;
+	struct wlc_chip_info chip_info;
+#if WLC_DIGEST_SHA256
+	char sha_hex[3 * 32 + 1];
+#endif
+
+	pr_info("[WLC] NVM Programming started\n");
+	nvm_update_active = 1;
+	progress.start_ms = start;
+	memset(&progress.cur, 0, sizeof(progress.cur));
+
+	err = wlc_nvm_check(&chip_info, &config_id_mismatch, &patch_id_mismatch);
+	if (err != OK)
+		goto exit_0;
+
+	if (config_id_mismatch == 0 && patch_id_mismatch == 0 &&
+		!wlc_nvm_resume_pending()) {
 		pr_info("[WLC] NVM programming is not required, both cfg and patch "
 			"are up to date\n");
 		err = OK;
@@ -627,6 +2896,10 @@ int nvm_program_show(char *buf)
 	 * Program both cfg and patch in case one of the two needs
 	 * to be programmed
 	 */
+	nvm_touched = 1;
+	wlc_platform_enter_update();
+	update_hz = SystemCoreClock;
+	memset(&nvm_write_stats, 0, sizeof(nvm_write_stats));
 	err = wlc_nvm_write();
 	if (err != OK) {
 		pr_err("[WLC] NVM programming failed\n");
@@ -635,37 +2908,70 @@ int nvm_program_show(char *buf)
 	}
 
 
+	memset(&verify_report, 0, sizeof(verify_report));
+	verify_report.level = verify_level;
+	verify_report.bad_sector = -1;
+	verify_start = HAL_GetTick();
+
+#ifdef WLC_DELTA
+	if (verify_level == WLC_VERIFY_FULL) {
+		err = wlc_nvm_delta_readback();
+		if (err != OK) {
+			pr_err("[WLC] NVM read-back for the delta target digest "
+				   "failed\n");
+			goto exit_1;
+		}
+	}
+#endif
+	wlc_nvm_digest_final(&verify_report.digest);
+	pr_info("[WLC] Image digest CRC32 %08lX over %lu bytes%s\n",
+			(unsigned long)verify_report.digest.crc32,
+			(unsigned long)verify_report.digest.bytes,
+			verify_report.digest.manifest < 0 ? ", no manifest" :
+			verify_report.digest.manifest ? ", manifest match" : "");
+#if WLC_DIGEST_SHA256
+	pr_info("[WLC] Image digest SHA-256 %s\n",
+			print_hex("", verify_report.digest.sha256, 32, sha_hex));
+#endif
+	if (verify_report.digest.manifest == 0) {
+		pr_err("[WLC] Image digest does not match the image manifest\n");
+		err = E_NVM_DATA_MISMATCH;
+		goto exit_1;
+	}
+
+	if (verify_level == WLC_VERIFY_NONE) {
+		pr_info("[WLC] NVM programming completed, verification disabled\n");
+		goto exit_1;
+	}
+
 	pr_info("[WLC] NVM programming completed, now checking patch "
 		"and cfg id\n");
 
 	if (get_wlc_chip_info(&chip_info) != OK) {
 		pr_err("[WLC] Error in reading wlc_chip_info\n");
 		err = E_BUS_R;
-		goto exit_0;
+		goto exit_1;
 	}
 
-#ifdef UBIN
-	if ((chip_info.config_id == fw_data.fw_config_version_id) &&
-		(chip_info.nvm_patch_id == fw_data.fw_patch_version_id)) {
-#else 
-	if ((chip_info.config_id == NVM_CFG_VERSION_ID) &&
-		(chip_info.nvm_patch_id == NVM_PATCH_VERSION_ID)) {
-#endif 
+	if ((chip_info.config_id == wlc_cfg_id()) &&
+		(chip_info.nvm_patch_id == NVM_IMG_PATCH_ID)) {
 
 		pr_info("[WLC] NVM patch and cfg id is OK\n");
-		pr_info("[WLC] NVM Programming is successful\n");
+		if (verify_level >= WLC_VERIFY_SAMPLE) {
+			err = wlc_nvm_window_check();
+			if (err == OK)
+				err = wlc_nvm_verify(verify_level);
+		}
+		if (err == OK)
+			pr_info("[WLC] NVM Programming is successful\n");
+		else
+			pr_info("[WLC] NVM Programming failed\n");
 	} else {
 		err = E_NVM_DATA_MISMATCH;
 
-#ifdef UBIN
-		if (chip_info.config_id != fw_data.fw_config_version_id) {
-#else 
-		if (chip_info.config_id != NVM_CFG_VERSION_ID) {
-#endif 
-
+		if (chip_info.config_id != wlc_cfg_id())
 			pr_err("[WLC] Config Id mismatch after NVM programming\n");
-		}
-		
+
 #ifdef UBIN
 		if (chip_info.nvm_patch_id != fw_data.fw_patch_version_id) {
 #else 
@@ -677,193 +2983,215 @@ int nvm_program_show(char *buf)
 		pr_info("[WLC] NVM Programming failed\n");
 	}
 
+exit_1:
+	verify_report.err = err;
+	verify_report.elapsed_ms = HAL_GetTick() - verify_start;
+	pr_info("[WLC] Verification level %d: %lu sectors, %lu bytes read "
+			"in %lu ms\n", verify_report.level,
+			(unsigned long)verify_report.sectors,
+			(unsigned long)verify_report.bytes_read,
+			(unsigned long)verify_report.elapsed_ms);
+
 exit_0:
-	system_reset();
+	/* Nothing was written to the chip: no reset needed, keep the fast path */
+	if (nvm_touched) {
+		system_reset();
+		wlc_platform_exit_update();
+	}
+	pr_info("[WLC] NVM programming took %lu ms at %lu MHz\n",
+			(unsigned long)(HAL_GetTick() - start),
+			(unsigned long)(update_hz / 1000000));
+	pr_info("[WLC] Register cache hits: %lu misses: %lu\n",
+			(unsigned long)reg_cache_stats.hits,
+			(unsigned long)reg_cache_stats.misses);
+	if (nvm_write_stats.sectors)
+		pr_info("[WLC] Sector writes: %lu, %lu cycles/sector, "
+				"%lu bytes copied\n",
+				(unsigned long)nvm_write_stats.sectors,
+				(unsigned long)(nvm_write_stats.cycles /
+								nvm_write_stats.sectors),
+				(unsigned long)nvm_write_stats.copied_bytes);
+	if (nvm_write_stats.skipped && nvm_write_stats.sectors)
+		pr_info("[WLC] Blank sectors skipped: %lu, about %lu ms saved\n",
+				(unsigned long)nvm_write_stats.skipped,
+				(unsigned long)((uint64_t)nvm_write_stats.cycles *
+						nvm_write_stats.skipped / nvm_write_stats.sectors /
+						(SystemCoreClock / 1000)));
+	else if (nvm_write_stats.skipped)
+		pr_info("[WLC] Blank sectors skipped: %lu\n",
+				(unsigned long)nvm_write_stats.skipped);
 	pr_info("[WLC] NVM programming exited\n");
+	nvm_update_active = 0;
+	progress.cur.err = err;
+	progress.cur.eta_ms = 0;
+	wlc_progress_phase(WLC_PROGRESS_DONE, 0, 0);
 	count = snprintf(buf, PAGE_SIZE, "{ %08X }\n", err);
 	return count;
 }
 
-#ifdef UBIN
-int u8_to_u32_be(u8 *src, u32 *dst)
+int u8_to_u32_be(const u8 *src, u32 *dst)
 {
-	*dst = (u32)(((src[0] & 0xFF) << 24) + ((src[1] & 0xFF) << 16) +
-		((src[2] & 0xFF) << 8) + (src[3] & 0xFF));
+	*dst = ((u32)src[0] << 24) + ((u32)src[1] << 16) +
+		((u32)src[2] << 8) + src[3];
 	return OK;
 }
 
-int u8_to_u16_be(u8 *src, u16 *dst)
-
+int u8_to_u16_be(const u8 *src, u16 *dst)
 {
-
 	*dst = (u16)(((src[0] & 0x00FF) << 8) + (src[1] & 0x00FF));
-
 	return OK;
 }
 
-unsigned int calculate_crc(unsigned char *message, int size)
+/*
+ * Section table of a UBIN file, built in one pass over the section headers
+ * with every read checked against size. Sections may come in any order;
+ * types the driver does not know are skipped, a known type found twice or
+ * empty makes the file malformed. The file CRC is not checked here.
+ */
+int ubin_index_build(const u8 *data, u32 size, struct ubin_index *index)
 {
-	int i, j;
-	unsigned int byte, crc, mask;
-	i = 0;
-	crc = 0xFFFFFFFF;
+	struct ubin_section *section;
+	u32 pos = BIN_HEADER_SIZE;
+	u32 signature;
+	u32 len;
+	u16 type;
+
+	memset(index, 0, sizeof(*index));
+	if (data == NULL || size < BIN_HEADER_SIZE)
+		return E_FILE_PARSE;
+
+	u8_to_u32_be(&data[BIN_HDR_SIGNATURE], &signature);
+	if (signature != BIN_HEADER) {
+		index->error_offset = BIN_HDR_SIGNATURE;
+		return E_FILE_PARSE;
+	}
+	index->chip_id = (u16)(data[BIN_HDR_CHIP_ID] +
+						   (data[BIN_HDR_CHIP_ID + 1] << 8));
+	index->chip_revision = data[BIN_HDR_CUT_ID];
+
+	while (pos < size) {
+		index->error_offset = pos;
+		if (size - pos < SECTION_HEADER_SIZE)
+			return E_FILE_PARSE;
+
+		u8_to_u32_be(&data[pos], &signature);
+		u8_to_u16_be(&data[pos + SECTION_HDR_TYPE], &type);
+		u8_to_u32_be(&data[pos + SECTION_HDR_SIZE], &len);
+		if (signature != SECTION_HEADER ||
+			len > size - pos - SECTION_HEADER_SIZE)
+			return E_FILE_PARSE;
 
-	while (i < size) {
-		byte = message[i];
-		crc = crc ^ byte;
-		for (j = 7; j >= 0; j--) {
-			mask = -(crc & 1);
-			crc = (crc >> 1) ^ (0xEDB88320 & mask);
+		if (type >= WLC_FW_SECTION_FIRST && type < WLC_FW_SECTION_END) {
+			section = &index->section[type - WLC_FW_SECTION_FIRST];
+			if (section->offset || len == 0)
+				return E_FILE_PARSE;
+			u8_to_u16_be(&data[pos + SECTION_HDR_VERSION_ID],
+						 &section->version_id);
+			section->size = len;
+			section->offset = pos + SECTION_HEADER_SIZE;
+		} else {
+			index->unknown++;
 		}
-	i = i + 1;
+		pos += SECTION_HEADER_SIZE + len;
 	}
-	return ~crc;
+
+	index->error_offset = 0;
+	return OK;
 }
 
+/* Section of the given type, NULL if the file has none */
+const struct ubin_section *ubin_section_get(const struct ubin_index *index,
+										   fw_section_t type)
+{
+	const struct ubin_section *section;
+
+	if (type < WLC_FW_SECTION_FIRST || type >= WLC_FW_SECTION_END)
+		return NULL;
+	section = &index->section[type - WLC_FW_SECTION_FIRST];
+	return section->offset ? section : NULL;
+}
+
+#ifdef UBIN
+unsigned int calculate_crc(unsigned char *message, int size)
+{
+	return ~wlc_crc32_update(0xFFFFFFFF, message, size);
+}
 
 int parse_ubin_file(u8 *ubin_data, int ubin_size, struct firmware_file *fw_data)
 {
-   	int index =0;
-  	u32 temp =0;
- 	u16 u16_temp =0;
+	const struct ubin_section *patch;
+	const struct ubin_section *cfg;
+	struct ubin_index index;
 	u32 crc = 0;
- 	int patch_data_found=0;
- 	int config_data_found =0;
- 	u8 u8_temp =0;
 
- 	crc = calculate_crc(ubin_data + 4, ubin_size-4);
-
-	if (crc == (u32)((ubin_data[0] << 24) + (ubin_data[1] << 16) + (ubin_data[2] << 8) + ubin_data[3]))
-		pr_info("[WLC] CRC successful for Ubin file ...\n");
-	else {
-		pr_info("[WLC] CRC failed for Ubin file ...\n");
+	if (ubin_data == NULL ||
+		ubin_size <= (BIN_HEADER_SIZE + SECTION_HEADER_SIZE)) {
+		pr_info("[WLC] Read only %d instead of %d... ERROR %08X\n",
+				ubin_size, BIN_HEADER_SIZE, E_FILE_PARSE);
 		return E_FILE_PARSE;
 	}
 
-   	index += 4;
-
-	if(ubin_size <= (BIN_HEADER_SIZE + SECTION_HEADER_SIZE) || (ubin_data == NULL)) {
-		pr_info("[WLC] Read only %d instead of %d... ERROR %08X\n", ubin_size, BIN_HEADER_SIZE, E_FILE_PARSE);
+	u8_to_u32_be(ubin_data, &crc);
+	if (calculate_crc(ubin_data + 4, ubin_size - 4) != crc) {
+		pr_info("[WLC] CRC failed for Ubin file ...\n");
 		return E_FILE_PARSE;
 	}
+	pr_info("[WLC] CRC successful for Ubin file ...\n");
 
-    	u8_to_u32_be(&ubin_data[index], &temp);
-
-    	if (temp != BIN_HEADER) {
-    		pr_info("[WLC] Wrong Signature 0x%08X ... ERROR %08X\n", temp, E_FILE_PARSE );
+	if (ubin_index_build(ubin_data, ubin_size, &index) != OK) {
+		pr_info("[WLC] Malformed Ubin file at offset %lu ... ERROR %08X\n",
+				(unsigned long)index.error_offset, E_FILE_PARSE);
 		return E_FILE_PARSE;
 	}
 
-	pr_info("[WLC] BIN HEADER Signature is correct and matched 0x%08X ... ", temp );
-
-	index +=5;
-
-    	u16_temp = (ubin_data[index+1] <<8) + ubin_data[index];
-
-    	if (u16_temp != CHIP_ID) {
-    		pr_info("[WLC] Wrong Chip ID %04X ... ERROR %08X\n", u16_temp, E_FILE_PARSE );
+	if (index.chip_id != CHIP_ID) {
+		pr_info("[WLC] Wrong Chip ID %04X ... ERROR %08X\n", index.chip_id,
+				E_FILE_PARSE);
 		return E_FILE_PARSE;
 	}
-
-	pr_info("[WLC] Chip ID: %04X\n", u16_temp);
-	fw_data->chip_id = u16_temp;
-
-	index +=18;
-
-	u8_temp = ubin_data[index];
-	fw_data->chip_revision = u8_temp;
-	pr_info("[WLC] CUT ID: %02X\n", u8_temp);
-
-	index +=9;
-
-    	while (index < ubin_size){
-        		u8_to_u32_be(&ubin_data[index], &temp);
-
-       		if (temp != SECTION_HEADER) {
-       			pr_info("[WLC] Wrong Section Signature %08X ... ERROR %08X\n", temp, E_FILE_PARSE);
-			return E_FILE_PARSE;
-		}
-		pr_info("[WLC]  SECTION_HEADER Signature is correct and matched 0x%08X ... ", temp );
-
-        		index +=4;
-       		u8_to_u16_be(&ubin_data[index], &u16_temp);
-
-        		if(u16_temp == WLC_FW_PATCH) {
-            		if (patch_data_found) {
-            			pr_info("[WLC] Cannot have more than one patch  ... ERROR %08X\n", E_FILE_PARSE);
-				return E_FILE_PARSE;
-        			}
-
-        			patch_data_found =1;
-
-        			index +=2;
-		u8_to_u16_be(&ubin_data[index], &u16_temp);
-		fw_data->fw_patch_version_id = u16_temp;
-
-			index +=2;
-			u8_to_u32_be(&ubin_data[index], &temp);
-
-        			fw_data->fw_patch_size = temp;
-			if (fw_data->fw_patch_size == 0) {
-				pr_info("[WLC] patch data cannot be empty ... ERROR %08X\n", E_FILE_PARSE);
-				return E_FILE_PARSE;
-			}
-
-            fw_data->fw_patch_data = (u8 *)malloc(fw_data->fw_patch_size * sizeof(u8));
-
-            if (fw_data->fw_patch_data == NULL) {
-				pr_info("[WLC] Error allocating memory... ERROR %08X\n", E_FILE_PARSE);
-				return E_FILE_PARSE;
-				}
-
-            index +=12;
-            memcpy(fw_data->fw_patch_data, &ubin_data[index], fw_data->fw_patch_size);
-            index += fw_data->fw_patch_size;
-
-    			}
-	u8_to_u32_be(&ubin_data[index], &temp);
-	if (temp != SECTION_HEADER) {
-		pr_info("[WLC] Wrong Section Signature ... ERROR %08X\n", E_FILE_PARSE);
-			return E_FILE_PARSE;
-		}
-
-        	index +=4;
-        	u8_to_u16_be(&ubin_data[index], &u16_temp);
-
-        	if(u16_temp == WLC_FW_CONFIG) {
-           	if (config_data_found) {
-            	pr_info("[WLC] Cannot have more than one config  ... ERROR %08X\n", E_FILE_PARSE);
-		return E_FILE_PARSE;
-        	}
-
-	config_data_found =1;
-
-	index +=4;
-        	u8_to_u32_be(&ubin_data[index], &temp);
-        	fw_data->fw_config_size = temp;
-		if (fw_data->fw_config_size == 0) {
-			pr_info("[WLC] Config data cannot be empty  ... ERROR %08X\n", E_FILE_PARSE);
-			return E_FILE_PARSE;
-			}
-
-           fw_data->fw_config_data = (u8 *)malloc(fw_data->fw_config_size * sizeof(u8));
-
-           if (fw_data->fw_config_data == NULL) {
-            	pr_info("[WLC] Error allocating memory  ... ERROR %08X\n", E_FILE_PARSE);
+	pr_info("[WLC] Chip ID: %04X\n", index.chip_id);
+	pr_info("[WLC] CUT ID: %02X\n", index.chip_revision);
+
+	patch = ubin_section_get(&index, WLC_FW_PATCH);
+	cfg = ubin_section_get(&index, WLC_FW_CONFIG);
+	if (patch == NULL || cfg == NULL) {
+		pr_info("[WLC] Ubin file has no %s section ... ERROR %08X\n",
+				patch == NULL ? "patch" : "config", E_FILE_PARSE);
 		return E_FILE_PARSE;
-		}
-
-	 index +=12;
-            u16_temp = (ubin_data[index+1]<<8) + ubin_data[index];
-            pr_info("[WLC] Cfg Id : %04X\n",u16_temp);
-	 fw_data->fw_config_version_id = u16_temp;
-
-            memcpy(fw_data->fw_config_data , &ubin_data[index], fw_data->fw_config_size);
-            index += fw_data->fw_config_size;
-
 	}
+	if (index.unknown)
+		pr_info("[WLC] Skipped %u unknown sections\n", index.unknown);
+
+	fw_data->chip_id = index.chip_id;
+	fw_data->chip_revision = index.chip_revision;
+	fw_data->fw_patch_version_id = patch->version_id;
+	fw_data->fw_patch_size = patch->size;
+	fw_data->fw_config_version_id = cfg->version_id;
+	fw_data->fw_config_size = cfg->size;
+	pr_info("[WLC] Patch Id : %04X, Cfg Id : %04X\n", patch->version_id,
+			cfg->version_id);
+
+	mem_image_bytes += patch->size + cfg->size;
+#if USE_STATIC_ALLOC_RW
+	fw_data->fw_patch_data = &ubin_data[patch->offset];
+	fw_data->fw_config_data = &ubin_data[cfg->offset];
+#else
+	fw_data->fw_patch_data = (u8 *)malloc(patch->size);
+	fw_data->fw_config_data = (u8 *)malloc(cfg->size);
+	if (fw_data->fw_patch_data == NULL || fw_data->fw_config_data == NULL) {
+		free(fw_data->fw_patch_data);
+		free(fw_data->fw_config_data);
+		fw_data->fw_patch_data = NULL;
+		fw_data->fw_config_data = NULL;
+		pr_info("[WLC] Error allocating memory... ERROR %08X\n",
+				E_FILE_PARSE);
+		return E_FILE_PARSE;
 	}
-    	pr_info("[WLC] Ubin file parsed successfully \n");
+	memcpy(fw_data->fw_patch_data, &ubin_data[patch->offset], patch->size);
+	memcpy(fw_data->fw_config_data, &ubin_data[cfg->offset], cfg->size);
+#endif
+
+	pr_info("[WLC] Ubin file parsed successfully \n");
 	return OK;
 }
 #endif
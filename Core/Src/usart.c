@@ -21,7 +21,21 @@
 #include "usart.h"
 
 /* USER CODE BEGIN 0 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+/* USART2 RX runs in circular DMA for the command console, polled: the
+   DMA and USART2 interrupts are left disabled in the NVIC */
+DMA_HandleTypeDef hdma_usart2_rx;
+
+/* Rates offered to the host, highest first */
+static const uint32_t uart_baud_rates[] = {
+  4000000, 2000000, 1000000, 921600, 460800, 230400,
+};
+
+/* Rate agreed with the host, used by every clock profile that can do it */
+static uint32_t uart_baud_negotiated = UART_BAUD_DEFAULT;
 /* USER CODE END 0 */
 
 UART_HandleTypeDef huart2;
@@ -94,7 +108,22 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
   /* USER CODE BEGIN USART2_MspInit 1 */
-
+    /* USART2_RX DMA: DMA1 channel 6, request 2 */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    hdma_usart2_rx.Instance = DMA1_Channel6;
+    hdma_usart2_rx.Init.Request = DMA_REQUEST_2;
+    hdma_usart2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart2_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart2_rx.Init.Priority = DMA_PRIORITY_LOW;
+    if (HAL_DMA_Init(&hdma_usart2_rx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+    __HAL_LINKDMA(uartHandle, hdmarx, hdma_usart2_rx);
   /* USER CODE END USART2_MspInit 1 */
   }
 }
@@ -105,7 +134,7 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* uartHandle)
   if(uartHandle->Instance==USART2)
   {
   /* USER CODE BEGIN USART2_MspDeInit 0 */
-
+    HAL_DMA_DeInit(uartHandle->hdmarx);
   /* USER CODE END USART2_MspDeInit 0 */
     /* Peripheral clock disable */
     __HAL_RCC_USART2_CLK_DISABLE();
@@ -123,5 +152,197 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* uartHandle)
 }
 
 /* USER CODE BEGIN 1 */
+/* Baud rate within 2% of the request with 16x oversampling on pclk */
+static int UART_Baud_Valid_At(uint32_t pclk, uint32_t baud)
+{
+  uint32_t brr;
+  uint32_t actual;
+
+  if (baud == 0U)
+    return 0;
+  brr = (pclk + baud / 2U) / baud;
+  if (brr < 16U || brr > 0xFFFFU)
+    return 0;
+  actual = pclk / brr;
+  return (actual > baud ? actual - baud : baud - actual) <= baud / 50U;
+}
+
+static int UART_Baud_Valid(uint32_t baud)
+{
+  return UART_Baud_Valid_At(HAL_RCC_GetPCLK1Freq(), baud);
+}
+
+static void UART_Errors_Clear(UART_HandleTypeDef *huart)
+{
+  __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_FEF | UART_CLEAR_NEF | UART_CLEAR_OREF);
+  __HAL_UART_SEND_REQ(huart, UART_RXDATA_FLUSH_REQUEST);
+}
+
+static int UART_Errors_Seen(UART_HandleTypeDef *huart)
+{
+  return __HAL_UART_GET_FLAG(huart, UART_FLAG_FE) ||
+         __HAL_UART_GET_FLAG(huart, UART_FLAG_NE) ||
+         __HAL_UART_GET_FLAG(huart, UART_FLAG_ORE);
+}
+
+static void UART_Puts(UART_HandleTypeDef *huart, const char *msg)
+{
+  HAL_UART_Transmit(huart, (uint8_t *)msg, strlen(msg), 100);
+}
+
+/* Read one '\n' terminated line, '\r' dropped. Returns its length or -1 */
+static int UART_Line_Read(UART_HandleTypeDef *huart, char *line, int size,
+                          uint32_t timeout)
+{
+  uint32_t start = HAL_GetTick();
+  uint32_t elapsed;
+  int len = 0;
+  uint8_t c;
+
+  while ((elapsed = HAL_GetTick() - start) < timeout)
+  {
+    if (HAL_UART_Receive(huart, &c, 1, timeout - elapsed) != HAL_OK)
+      break;
+    if (c == '\n')
+    {
+      line[len] = '\0';
+      return len;
+    }
+    if (c != '\r' && len < size - 1)
+      line[len++] = (char)c;
+  }
+
+  return -1;
+}
+
+/**
+  * @brief Reprogram the UART for a new baud rate
+  * @retval 0 on success, -1 if PCLK1 cannot generate the rate
+  */
+int UART_Baud_Apply(UART_HandleTypeDef *huart, uint32_t baud)
+{
+  if (!UART_Baud_Valid(baud))
+    return -1;
+
+  huart->Init.BaudRate = baud;
+  if (HAL_UART_Init(huart) != HAL_OK)
+    return -1;
+  UART_Errors_Clear(huart);
+  return 0;
+}
 
+/**
+  * @brief Rate for a PCLK1 about to be set: the negotiated one when that
+  *        clock can generate it, else the default
+  */
+uint32_t UART_Baud_Select(uint32_t pclk)
+{
+  if (UART_Baud_Valid_At(pclk, uart_baud_negotiated))
+    return uart_baud_negotiated;
+  return UART_BAUD_DEFAULT;
+}
+
+/**
+  * @brief Tell the host the rate is about to change, at the current rate
+  * @note  Sends "@RATE <rate>" and gives the host UART_BAUD_SWITCH_MS to
+  *        follow; nothing is sent when the rate stays the same.
+  */
+void UART_Baud_Announce(UART_HandleTypeDef *huart, uint32_t baud)
+{
+  char line[24];
+
+  if (baud == huart->Init.BaudRate)
+    return;
+  snprintf(line, sizeof(line), "@RATE %lu\r\n", (unsigned long)baud);
+  UART_Puts(huart, line);
+  HAL_Delay(UART_BAUD_SWITCH_MS);
+}
+
+/*
+ * Check the new rate: receive a known pattern from the host without
+ * framing, noise or overrun errors, echo it and wait for the host's @ACK.
+ */
+static int UART_Baud_Validate(UART_HandleTypeDef *huart)
+{
+  uint8_t pattern[UART_BAUD_TEST_LEN];
+  char line[8];
+  uint32_t i;
+
+  if (HAL_UART_Receive(huart, pattern, sizeof(pattern), UART_BAUD_TEST_MS) != HAL_OK)
+    return -1;
+  if (UART_Errors_Seen(huart))
+    return -1;
+  for (i = 0; i < sizeof(pattern); i++)
+  {
+    if (pattern[i] != (uint8_t)(i * 37U + 11U))
+      return -1;
+  }
+
+  HAL_UART_Transmit(huart, pattern, sizeof(pattern), UART_BAUD_TEST_MS);
+  if (UART_Line_Read(huart, line, sizeof(line), UART_BAUD_TEST_MS) < 0)
+    return -1;
+  return strcmp(line, "@ACK") == 0 ? 0 : -1;
+}
+
+/**
+  * @brief Agree on the fastest baud rate the host and the link support
+  * @note  Handshake, all lines '\n' terminated:
+  *          MCU  @BAUD? <rate> <rate> ...   at 115200, rates PCLK1 can do
+  *          host @BAUD <rate>               or nothing: stay at 115200
+  *          MCU  @OK <rate>                 both sides switch
+  *          host UART_BAUD_TEST_LEN pattern bytes, MCU echoes them
+  *          host @ACK                       rate kept
+  *        On a timeout, a mismatch or a framing/noise/overrun error both
+  *        sides go back to 115200 and the MCU offers again, so the host
+  *        can fall back to its next lower rate.
+  *        A later clock profile change that cannot keep the rate is
+  *        announced first, see UART_Baud_Announce().
+  * @retval The baud rate in use
+  */
+uint32_t UART_Baud_Negotiate(UART_HandleTypeDef *huart)
+{
+  char offer[96];
+  char line[32];
+  uint32_t baud;
+  int len;
+  unsigned int i;
+
+  len = snprintf(offer, sizeof(offer), "@BAUD?");
+  for (i = 0; i < sizeof(uart_baud_rates) / sizeof(uart_baud_rates[0]); i++)
+  {
+    if (UART_Baud_Valid(uart_baud_rates[i]))
+      len += snprintf(offer + len, sizeof(offer) - len, " %lu",
+                      (unsigned long)uart_baud_rates[i]);
+  }
+  snprintf(offer + len, sizeof(offer) - len, "\r\n");
+
+  for (i = 0; i < sizeof(uart_baud_rates) / sizeof(uart_baud_rates[0]); i++)
+  {
+    UART_Errors_Clear(huart);
+    UART_Puts(huart, offer);
+    if (UART_Line_Read(huart, line, sizeof(line), UART_BAUD_OFFER_MS) < 0)
+      break;
+    if (strncmp(line, "@BAUD ", 6) != 0)
+      break;
+
+    baud = strtoul(line + 6, NULL, 10);
+    if (!UART_Baud_Valid(baud))
+    {
+      UART_Puts(huart, "@NAK\r\n");
+      continue;
+    }
+
+    snprintf(line, sizeof(line), "@OK %lu\r\n", (unsigned long)baud);
+    UART_Puts(huart, line);
+    if (UART_Baud_Apply(huart, baud) == 0 && UART_Baud_Validate(huart) == 0)
+    {
+      uart_baud_negotiated = baud;
+      return baud;
+    }
+
+    UART_Baud_Apply(huart, UART_BAUD_DEFAULT);
+  }
+
+  return huart->Init.BaudRate;
+}
 /* USER CODE END 1 */
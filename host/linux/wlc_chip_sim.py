@@ -0,0 +1,306 @@
+#!/usr/bin/env python3
+"""
+STWLC38 stand-in for the Linux host build of the driver (wlc_host).
+
+Serves the I2C transactions the host shim would send to /dev/i2c-N on a
+Unix SOCK_SEQPACKET socket instead; pass the socket path to wlc_host -d.
+Models what the driver uses: chip info and op mode, the NVM sector
+programming commands, the RRAM read window and system reset. After a
+reset the patch id reads back as that of the image header when the NVM
+holds its data and the cfg id as the first field of the cfg area, so
+'update' and its read-back verification run end to end without hardware.
+A reset also clears the NVM password: a program command without it
+completes but leaves the sector as it was. A reset takes --boot-ms: the
+chip NACKs for the first half, then reads its FW registers as zero until
+the FW is up.
+--preload starts with another image in the NVM, e.g. the source of a delta
+package; its patch id is reported while the NVM holds it. SIGUSR1 takes
+the chip off the bus, the next one puts a fresh unit on, as an operator
+swapping boards on a station fixture. --nvm-window moves the RRAM read
+window, to model a chip where it is not where the driver expects.
+
+    wlc_chip_sim.py /tmp/wlc.sock [--image nvm_data.h] [--erased]
+                    [--preload source_nvm_data.h] [--boot-ms 8]
+                    [--nvm-window 0x00060000]
+"""
+
+import argparse
+import os
+import re
+import signal
+import socket
+import struct
+import sys
+import time
+
+SLAVE_ADDRESS = 0x61
+I2C_M_RD = 0x0001
+I2C_M_NOSTART = 0x4000
+OPCODE_WRITE = 0xFA
+
+FWREG_CHIP_ID = 0x0000
+FWREG_OP_MODE = 0x000E
+FWREG_SYS_CMD = 0x0020
+FWREG_NVM_PWD = 0x0022
+NVM_PWD = 0xC5
+FWREG_NVM_SECTOR_INDEX = 0x0024
+FWREG_AUX_DATA_00 = 0x0180
+HWREG_HW_VER = 0x2001C002
+HWREG_RST = 0x2001F200
+HWREG_NVM_BASE = 0x00060000
+
+SECTOR_SIZE = 256
+SECTORS = 256
+CFG_START_SECTOR = 126
+OP_MODE_SA = 1
+
+SYS_CMD_NVM_PROGRAM = 0x04
+SYS_CMD_NVM_LOAD = 0x10
+SYS_CMD_FW_RESET = 0x40
+
+DEFAULT_IMAGE = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                             "..", "..", "Core", "Inc",
+                             "STSW-WLC38RX-nvm_data.h")
+
+
+def load_image(path):
+    """Ids and data of a generated nvm_data.h."""
+    with open(path) as f:
+        text = f.read()
+
+    def define(name):
+        return int(re.search(r"#define\s+%s\s+(\w+)" % name, text).group(1), 0)
+
+    def array(name):
+        body = re.search(r"%s\[\]\s*=\s*\{(.*?)\}" % name, text, re.S).group(1)
+        return bytes(int(v, 16) for v in re.findall(r"0x[0-9A-Fa-f]+", body))
+
+    return {"chip_id": define("NVM_TARGET_CHIP_ID"),
+            "cut_id": define("NVM_TARGET_CUT_ID"),
+            "patch_id": define("NVM_PATCH_VERSION_ID"),
+            "cfg_id": define("NVM_CFG_VERSION_ID"),
+            "patch": array("nvm_patch_data"),
+            "cfg": array("nvm_cfg_data")}
+
+
+class Chip:
+    def __init__(self, image, erased, preload=None, boot_ms=0,
+                 nvm_base=HWREG_NVM_BASE):
+        self.image = image
+        self.nvm_base = nvm_base
+        self.boot_s = boot_ms / 1000.0
+        self.reset_at = 0.0
+        self.known = [image] + ([preload] if preload else [])
+        self.erased = erased
+        self.preload = preload
+        self.fw = bytearray(0x10000)
+        self.hw = {}
+        self.present = True
+        self.units = 1
+        self.sectors_written = 0
+        self.fresh()
+
+    def fresh(self):
+        """A new unit, NVM as the command line describes it."""
+        self.nvm = bytearray(SECTORS * SECTOR_SIZE)
+        if not self.erased:
+            self.nvm[:] = b"\xFF" * len(self.nvm)
+        if self.preload:
+            self.load(self.preload)
+        self.ptr = None
+        self.reset()
+
+    def swap(self, *_):
+        """SIGUSR1: take the unit off, or put a fresh one on."""
+        self.present = not self.present
+        if self.present:
+            self.units += 1
+            self.fresh()
+        print("unit %d %s" % (self.units, "on" if self.present else "off"),
+              file=sys.stderr)
+
+    def holds(self, data, sector):
+        start = sector * SECTOR_SIZE
+        return self.nvm[start:start + len(data)] == data
+
+    def load(self, image):
+        self.nvm[:len(image["patch"])] = image["patch"]
+        start = CFG_START_SECTOR * SECTOR_SIZE
+        self.nvm[start:start + len(image["cfg"])] = image["cfg"]
+
+    def reset(self):
+        """Boot: ids come from what the NVM holds."""
+        img = self.image
+        patch_id = next((known["patch_id"] for known in self.known
+                         if self.holds(known["patch"], 0)), 0)
+        # The cfg id is the first field of the cfg image itself
+        start = CFG_START_SECTOR * SECTOR_SIZE
+        cfg_id = struct.unpack_from("<H", self.nvm, start)[0]
+        if cfg_id == 0xFFFF:
+            cfg_id = 0
+        self.fw[FWREG_CHIP_ID:FWREG_CHIP_ID + 14] = struct.pack(
+            "<HBBHHHHH", img["chip_id"], 0x01, 0x00, 0x0000, patch_id,
+            0x0000, cfg_id, 0x0000)
+        self.fw[FWREG_OP_MODE] = OP_MODE_SA
+        self.fw[FWREG_SYS_CMD] = 0
+        self.fw[FWREG_NVM_PWD] = 0
+        self.hw[HWREG_HW_VER] = img["cut_id"]
+        self.reset_at = time.monotonic()
+
+    def booting(self):
+        """0 when up, 1 while the FW starts, 2 while the chip NACKs."""
+        elapsed = time.monotonic() - self.reset_at
+        if elapsed >= self.boot_s:
+            return 0
+        return 2 if elapsed < self.boot_s / 2 else 1
+
+    def sys_cmd(self, value):
+        if value & SYS_CMD_NVM_PROGRAM and self.fw[FWREG_NVM_PWD] == NVM_PWD:
+            sector = self.fw[FWREG_NVM_SECTOR_INDEX]
+            start = sector * SECTOR_SIZE
+            self.nvm[start:start + SECTOR_SIZE] = \
+                self.fw[FWREG_AUX_DATA_00:FWREG_AUX_DATA_00 + SECTOR_SIZE]
+            self.sectors_written += 1
+        if value & SYS_CMD_FW_RESET:
+            self.reset()
+        # Commands complete at once: the busy bits read back clear
+        self.fw[FWREG_SYS_CMD] = 0
+
+    def write(self, data):
+        """A write message: register address, then data to store there."""
+        if not data:
+            return True     # address only probe
+        if len(data) >= 5 and data[0] == OPCODE_WRITE:
+            self.ptr = (1, struct.unpack(">I", data[1:5])[0])
+            payload = data[5:]
+        elif len(data) >= 2:
+            self.ptr = (0, struct.unpack(">H", data[0:2])[0])
+            payload = data[2:]
+        else:
+            return False
+
+        hw, addr = self.ptr
+        if not payload:
+            return True
+        if hw:
+            if addr == HWREG_RST and payload[0] & 0x01:
+                self.reset()
+                return True
+            for i, value in enumerate(payload):
+                self.hw[addr + i] = value
+            return True
+
+        if addr + len(payload) > len(self.fw):
+            return False
+        self.fw[addr:addr + len(payload)] = payload
+        if addr <= FWREG_SYS_CMD < addr + len(payload):
+            self.sys_cmd(payload[FWREG_SYS_CMD - addr])
+        return True
+
+    def read(self, length):
+        if self.ptr is None:
+            return None
+        hw, addr = self.ptr
+        if not hw:
+            if self.booting():
+                return bytes(length)
+            return bytes(self.fw[addr:addr + length]).ljust(length, b"\0")
+        if self.nvm_base <= addr < self.nvm_base + len(self.nvm):
+            start = addr - self.nvm_base
+            return bytes(self.nvm[start:start + length]).ljust(length, b"\0")
+        return bytes(self.hw.get(addr + i, 0) for i in range(length))
+
+    def transaction(self, msgs):
+        """Run one I2C_RDWR message list, return (ack, read data)."""
+        out = b""
+        pending = None
+        for addr, flags, data in msgs:
+            if (addr != SLAVE_ADDRESS or not self.present or
+                    self.booting() == 2):
+                return False, b""
+            if flags & I2C_M_RD:
+                if pending is not None and not self.write(pending):
+                    return False, b""
+                pending = None
+                value = self.read(data)
+                if value is None:
+                    return False, b""
+                out += value
+            elif flags & I2C_M_NOSTART and pending is not None:
+                pending += data
+            else:
+                if pending is not None and not self.write(pending):
+                    return False, b""
+                pending = data
+        if pending is not None and not self.write(pending):
+            return False, b""
+        return True, out
+
+
+def parse_request(req):
+    """Messages of a request: (addr, flags, data or read length)."""
+    msgs = []
+    pos = 1
+    for _ in range(req[0]):
+        addr, flags, length = struct.unpack_from("<HHH", req, pos)
+        pos += 6
+        if flags & I2C_M_RD:
+            msgs.append((addr, flags, length))
+        else:
+            msgs.append((addr, flags, bytes(req[pos:pos + length])))
+            pos += length
+    return msgs
+
+
+def serve(conn, chip):
+    while True:
+        req = conn.recv(4096)
+        if not req:
+            return
+        ack, data = chip.transaction(parse_request(req))
+        conn.send((b"\x00" + data) if ack else b"\x01")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("socket", help="Unix socket path to listen on")
+    parser.add_argument("--image", default=DEFAULT_IMAGE,
+                        help="nvm_data.h giving the ids and the image")
+    parser.add_argument("--erased", action="store_true",
+                        help="start with an erased NVM instead of 0xFF")
+    parser.add_argument("--preload",
+                        help="nvm_data.h of an image the NVM starts with")
+    parser.add_argument("--boot-ms", type=float, default=8,
+                        help="time from a reset to a running FW")
+    parser.add_argument("--nvm-window", type=lambda s: int(s, 0),
+                        default=HWREG_NVM_BASE,
+                        help="address of the RRAM read window")
+    args = parser.parse_args()
+
+    chip = Chip(load_image(args.image), args.erased,
+                load_image(args.preload) if args.preload else None,
+                args.boot_ms, args.nvm_window)
+    signal.signal(signal.SIGUSR1, chip.swap)
+    if os.path.exists(args.socket):
+        os.unlink(args.socket)
+    server = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+    server.bind(args.socket)
+    server.listen(1)
+    print("STWLC38 stand-in on %s" % args.socket, file=sys.stderr)
+
+    try:
+        while True:
+            conn, _ = server.accept()
+            with conn:
+                serve(conn, chip)
+            print("host disconnected, %d sectors written" %
+                  chip.sectors_written, file=sys.stderr)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
+        os.unlink(args.socket)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""
+pty test of the UART console (Core/Src/console.c) of the Linux host build.
+
+Starts wlc_chip_sim.py and 'wlc_host -d <socket> console', opens the pty
+the console runs on and checks rd, wr, info and update. While an update
+owns the bus, bus commands sent with it must get "busy" and stats must
+still be served; afterwards the bus commands must run again.
+
+    wlc_console_test.py [--host ./wlc_host] [--sim ./wlc_chip_sim.py]
+"""
+
+import argparse
+import os
+import re
+import select
+import shutil
+import subprocess
+import sys
+import tempfile
+import termios
+import time
+import tty
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+PROMPT = "> "
+BUSY = "busy: NVM update in progress"
+CMD_TIMEOUT = 5
+UPDATE_TIMEOUT = 60
+SIM_BOOT_MS = 8
+
+
+class Console:
+    def __init__(self, path):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        # TCSANOW: flushing would drop the banner already waiting
+        tty.setraw(self.fd, termios.TCSANOW)
+        self.pending = ""
+
+    def close(self):
+        os.close(self.fd)
+
+    def send(self, *lines):
+        """All lines in one write, so the console gets them in one poll."""
+        os.write(self.fd, "".join(line + "\r\n" for line in lines).encode())
+
+    def expect(self, pattern, timeout=CMD_TIMEOUT):
+        """Text up to and including the first match of pattern."""
+        deadline = time.monotonic() + timeout
+        regex = re.compile(pattern)
+        while True:
+            match = regex.search(self.pending)
+            if match:
+                text = self.pending[:match.end()]
+                self.pending = self.pending[match.end():]
+                return text
+            left = deadline - time.monotonic()
+            if left <= 0:
+                raise TimeoutError("no %r in %r" % (pattern,
+                                                    self.pending[-200:]))
+            ready, _, _ = select.select([self.fd], [], [], left)
+            if ready:
+                self.pending += os.read(self.fd, 4096).decode("latin-1")
+
+    def command(self, line, timeout=CMD_TIMEOUT):
+        """Output of one command, up to its prompt."""
+        self.send(line)
+        return self.expect(re.escape(PROMPT), timeout)
+
+
+def check(results, name, ok, detail=""):
+    results.append(ok)
+    print("%s %s%s" % ("ok  " if ok else "FAIL", name,
+                       "" if ok else ": " + detail))
+
+
+def run_tests(con):
+    results = []
+    con.expect(re.escape(PROMPT))
+
+    out = con.command("info")
+    check(results, "info", "Chip Info: 26 00" in out, out)
+
+    out = con.command("rd fw 0 2")
+    check(results, "rd", re.search(r"^26 00\r$", out, re.M) is not None, out)
+
+    out = con.command("wr fw 0x180 0x5A 0xA5")
+    check(results, "wr", "error" not in out, out)
+    out = con.command("rd fw 0x180 2")
+    check(results, "wr read-back",
+          re.search(r"^5A A5\r$", out, re.M) is not None, out)
+
+    out = con.command("rd fw 0")
+    check(results, "usage", "usage: rd" in out, out)
+
+    # The lines after update arrive while it runs, from its sector polls
+    con.send("update", "info", "rd fw 0 2", "stats")
+    out = con.expect(r"\{ [0-9A-F]{8} \}[^>]*" + re.escape(PROMPT),
+                     UPDATE_TIMEOUT)
+    check(results, "update", "{ 00000000 }" in out, out[-400:])
+    check(results, "busy during update", out.count(BUSY) == 2,
+          "%d busy replies" % out.count(BUSY))
+    check(results, "stats during update", "update running" in out,
+          out[-400:])
+
+    out = con.command("rd fw 0 2")
+    check(results, "rd after update", BUSY not in out and
+          re.search(r"^26 00\r$", out, re.M) is not None, out)
+    out = con.command("stats")
+    check(results, "stats after update", "update idle" in out, out)
+
+    return all(results)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("--host", default=os.path.join(HERE, "wlc_host"),
+                        help="wlc_host binary")
+    parser.add_argument("--sim", default=os.path.join(HERE,
+                                                      "wlc_chip_sim.py"),
+                        help="chip stand-in")
+    args = parser.parse_args()
+
+    tmp = tempfile.mkdtemp(prefix="wlc_console_")
+    sock = os.path.join(tmp, "wlc.sock")
+    sim = subprocess.Popen([sys.executable, args.sim, sock,
+                            "--boot-ms", str(SIM_BOOT_MS)],
+                           stderr=subprocess.DEVNULL)
+    host = None
+    con = None
+    try:
+        deadline = time.monotonic() + CMD_TIMEOUT
+        while not os.path.exists(sock):
+            if time.monotonic() > deadline or sim.poll() is not None:
+                sys.exit("chip stand-in did not start")
+            time.sleep(0.05)
+        # Its FW reads as zeros until booted; the driver would cache those
+        time.sleep(2 * SIM_BOOT_MS / 1000.0)
+
+        host = subprocess.Popen([args.host, "-d", sock, "console"],
+                                stdout=subprocess.PIPE, text=True)
+        con = Console(host.stdout.readline().strip())
+        passed = run_tests(con)
+    except TimeoutError as e:
+        print("FAIL %s" % e)
+        passed = False
+    finally:
+        if con:
+            con.close()
+        for proc in (host, sim):
+            if proc:
+                proc.terminate()
+                proc.wait()
+        shutil.rmtree(tmp, ignore_errors=True)
+
+    print("console test %s" % ("passed" if passed else "FAILED"))
+    sys.exit(0 if passed else 1)
+
+
+if __name__ == "__main__":
+    main()
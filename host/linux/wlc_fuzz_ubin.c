@@ -0,0 +1,127 @@
+/***************************************************************************
+ * File Name:		wlc_fuzz_ubin.c
+ * Description:		libFuzzer target for the UBIN parser: the bounds-checked
+ *					section index on the raw input, then parse_ubin_file()
+ *					on a copy whose file CRC is made valid, so mutated files
+ *					get past the CRC check into the section walk. Built by
+ *					'make fuzz'; 'make fuzz-replay' runs it over the corpus
+ *					without libFuzzer (WLC_FUZZ_REPLAY).
+ ***************************************************************************/
+
+/***************************************************************************
+ * Included files
+ ***************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "stwlc38.h"
+
+/***************************************************************************
+ * Macro definitions
+ ***************************************************************************/
+#define WLC_FUZZ_MAX_LEN		(1 << 20)	/* parse_ubin_file() takes an int */
+
+/***************************************************************************
+ * Private variables
+ ***************************************************************************/
+extern UART_HandleTypeDef *huart;
+
+static UART_HandleTypeDef fuzz_uart = { -1 };
+
+/***************************************************************************
+ * Function definitions
+ ***************************************************************************/
+/* Every section the index reports must lie inside the file */
+static void fuzz_check_index(const struct ubin_index *index, size_t size)
+{
+	const struct ubin_section *section;
+	int i;
+
+	for (i = 0; i < WLC_FW_SECTION_COUNT; i++) {
+		section = ubin_section_get(index, WLC_FW_SECTION_FIRST + i);
+		if (section == NULL)
+			continue;
+		if (section->offset < BIN_HEADER_SIZE + SECTION_HEADER_SIZE ||
+			section->size == 0 || section->offset > size ||
+			section->size > size - section->offset)
+			abort();
+	}
+	if (ubin_section_get(index, WLC_FW_SECTION_END) != NULL)
+		abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct firmware_file fw;
+	struct ubin_index index;
+	u32 crc;
+	u8 *copy;
+
+	/* Driver log to /dev/null */
+	if (huart == NULL) {
+		fuzz_uart.fd = open("/dev/null", O_WRONLY);
+		huart = &fuzz_uart;
+	}
+
+	if (ubin_index_build(data, (u32)size, &index) == OK)
+		fuzz_check_index(&index, size);
+
+	if (size < 4 || size > WLC_FUZZ_MAX_LEN)
+		return 0;
+	copy = malloc(size);
+	if (copy == NULL)
+		return 0;
+	memcpy(copy, data, size);
+	crc = ~wlc_crc32_update(0xFFFFFFFF, copy + 4, size - 4);
+	copy[0] = (u8)(crc >> 24);
+	copy[1] = (u8)(crc >> 16);
+	copy[2] = (u8)(crc >> 8);
+	copy[3] = (u8)crc;
+
+	memset(&fw, 0, sizeof(fw));
+	if (parse_ubin_file(copy, (int)size, &fw) == OK) {
+		if (fw.fw_patch_size == 0 || fw.fw_config_size == 0)
+			abort();
+#if !USE_STATIC_ALLOC_RW
+		free(fw.fw_patch_data);
+		free(fw.fw_config_data);
+#endif
+	}
+	free(copy);
+	return 0;
+}
+
+#ifdef WLC_FUZZ_REPLAY
+/* Without libFuzzer: run the target once on each file given */
+int main(int argc, char **argv)
+{
+	long len;
+	u8 *data;
+	FILE *f;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		rewind(f);
+		data = malloc(len > 0 ? len : 1);
+		if (data == NULL || fread(data, 1, len, f) != (size_t)len) {
+			fclose(f);
+			free(data);
+			return 1;
+		}
+		fclose(f);
+		LLVMFuzzerTestOneInput(data, (size_t)len);
+		free(data);
+	}
+	printf("%d inputs replayed\n", argc - 1);
+	return 0;
+}
+#endif
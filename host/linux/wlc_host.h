@@ -0,0 +1,239 @@
+/****************************************************************************
+ **                            STMicroelectronics                          **
+ ****************************************************************************
+ *                                                                          *
+ * STWLC38 Wireless Charger Driver (WLC)                                    *
+ *                                                                          *
+ * This is reference driver for STWLC38 wireless charger                    *
+ *                                                                          *
+ ****************************************************************************/
+
+/***************************************************************************
+ * File Name:		wlc_host.h
+ * Description:	Linux host shim (WLC_HOST_LINUX): the subset of the STM32
+ *					HAL and CMSIS used by the driver, backed by /dev/i2c-N
+ *					or by the wlc_chip_sim.py stand-in
+ ****************************************************************************/
+
+#ifndef WLC_HOST_H
+#define WLC_HOST_H
+
+/****************************************************************************
+ * Included files
+ ****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+
+/****************************************************************************
+ * Macro definitions
+ ****************************************************************************/
+#define __weak							__attribute__((weak))
+
+#define I2C_FIRST_FRAME					0x00000000U
+#define I2C_LAST_FRAME					0x02000000U
+#define I2C_FIRST_AND_LAST_FRAME		0x02000000U
+#define I2C_MEMADD_SIZE_8BIT			0x00000001U
+#define I2C_MEMADD_SIZE_16BIT			0x00000002U
+/* Legacy names, as in stm32_hal_legacy.h */
+#define HAL_I2C_Master_Sequential_Transmit_IT	HAL_I2C_Master_Seq_Transmit_IT
+#define HAL_I2C_Master_Sequential_Receive_IT	HAL_I2C_Master_Seq_Receive_IT
+
+#define GPIO_PIN_8						((uint16_t)0x0100)
+#define GPIO_PIN_9						((uint16_t)0x0200)
+#define GPIO_MODE_OUTPUT_OD				0x00000011U
+#define GPIO_PULLUP						0x00000001U
+#define GPIO_SPEED_FREQ_LOW				0x00000000U
+#define GPIOB							(&wlc_host_gpiob)
+
+/* DWT->CYCCNT counts nanoseconds: SystemCoreClock is 1 GHz on the host */
+#define DWT								(wlc_host_dwt())
+#define DWT_CTRL_CYCCNTENA_Msk			0x00000001U
+#define CoreDebug						(&wlc_host_core_debug)
+#define CoreDebug_DEMCR_TRCENA_Msk		0x01000000U
+#define RTC								(&wlc_host_rtc)
+/* The console bench runs its CRC over our own image, as over the MCU flash */
+#define FLASH_BASE						((uintptr_t)__executable_start)
+#define __HAL_DMA_GET_COUNTER(h)		wlc_host_dma_counter(h)
+
+#define WLC_HOST_XFER_MAX				1024	/* longest I2C message */
+#define WLC_HOST_DEFAULT_BUS			"/dev/i2c-1"
+
+/****************************************************************************
+ * Enumerations
+ ****************************************************************************/
+typedef enum {
+	HAL_OK		= 0x00,
+	HAL_ERROR	= 0x01,
+	HAL_BUSY	= 0x02,
+	HAL_TIMEOUT	= 0x03
+} HAL_StatusTypeDef;
+
+typedef enum {
+	HAL_I2C_STATE_RESET	= 0x00,
+	HAL_I2C_STATE_READY	= 0x20
+} HAL_I2C_StateTypeDef;
+
+typedef enum {
+	HAL_UART_STATE_RESET	= 0x00,
+	HAL_UART_STATE_READY	= 0x20,
+	HAL_UART_STATE_BUSY_RX	= 0x22
+} HAL_UART_StateTypeDef;
+
+typedef enum {
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+/* Faults injected under the I2C shim, see wlc_host_fault_arm() */
+typedef enum {
+	WLC_HOST_FAULT_NONE = 0,
+	WLC_HOST_FAULT_NACK_ADDR,	/* address NACK, 'count' transactions */
+	WLC_HOST_FAULT_NACK_DATA,	/* write NACKed half way through its data */
+	WLC_HOST_FAULT_BUS_BUSY,	/* arbitration lost, 'count' transactions */
+	WLC_HOST_FAULT_SDA_STUCK,	/* SDA low until 9 SCL clocks are given */
+	WLC_HOST_FAULT_SHORT_READ,	/* read ends early, reported as an error */
+	WLC_HOST_FAULT_BIT_FLIP,	/* one read data bit inverted, unreported */
+	WLC_HOST_FAULT_NVM_TIMEOUT,	/* SYS_CMD 0x04 never clears, one sector */
+	WLC_HOST_FAULT_CHIP_RESET,	/* chip reset as a sector is selected */
+	WLC_HOST_FAULT_COUNT
+} wlc_host_fault_t;
+
+/****************************************************************************
+ * Structures
+ ****************************************************************************/
+typedef struct {
+	const char *Path;		/* /dev/i2c-N, or the socket of wlc_chip_sim.py */
+	int fd;
+	int socket;				/* Path is the chip stand-in */
+	int nostart;			/* adapter does I2C_M_NOSTART */
+	uint32_t SclHz;			/* bus rate the HAL timeouts are checked at */
+	HAL_I2C_StateTypeDef State;
+} I2C_HandleTypeDef;
+
+typedef struct __DMA_HandleTypeDef DMA_HandleTypeDef;
+
+typedef struct {
+	int fd;					/* log output, normally stdout */
+	uint8_t *pRxBuffPtr;	/* circular reception ring */
+	uint16_t RxXferSize;
+	DMA_HandleTypeDef *hdmarx;
+	HAL_UART_StateTypeDef RxState;
+} UART_HandleTypeDef;
+
+/* Circular reception: reading the counter moves input from fd to the ring */
+struct __DMA_HandleTypeDef {
+	UART_HandleTypeDef *Parent;
+	uint32_t Remaining;		/* CNDTR: bytes left before the ring wraps */
+};
+
+typedef struct {
+	uint32_t Pin;
+	uint32_t Mode;
+	uint32_t Pull;
+	uint32_t Speed;
+} GPIO_InitTypeDef;
+
+typedef struct {
+	uint32_t unused;
+} GPIO_TypeDef;
+
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+/* Backup registers live as long as the process */
+typedef struct {
+	volatile uint32_t BKP0R, BKP1R, BKP2R, BKP3R, BKP4R, BKP5R, BKP6R, BKP7R;
+	volatile uint32_t BKP8R, BKP9R, BKP10R, BKP11R, BKP12R, BKP13R, BKP14R;
+	volatile uint32_t BKP15R, BKP16R, BKP17R, BKP18R, BKP19R, BKP20R;
+	volatile uint32_t BKP21R, BKP22R, BKP23R, BKP24R, BKP25R, BKP26R;
+	volatile uint32_t BKP27R, BKP28R, BKP29R, BKP30R, BKP31R;
+} RTC_TypeDef;
+
+/* Cost of the bus transactions, see wlc_host_bus_stats_get() */
+struct wlc_host_bus_stats {
+	uint32_t transactions;	/* I2C_RDWR calls or stand-in exchanges */
+	uint32_t syscalls;
+	uint32_t failures;
+	uint64_t bytes;			/* payload and header bytes on the bus */
+	uint64_t syscall_ns;	/* time spent inside the syscalls */
+};
+
+/*
+ * Bus faults hit the first transaction able to show them from the 'at'th
+ * one after arming on (0: the next one); NVM faults hit the 'at'th sector
+ * programmed after arming. A fault fires once per arming.
+ */
+struct wlc_host_fault {
+	wlc_host_fault_t type;
+	uint32_t at;
+	uint32_t count;
+};
+
+/****************************************************************************
+ * Global variables
+ ****************************************************************************/
+extern uint32_t SystemCoreClock;
+extern GPIO_TypeDef wlc_host_gpiob;
+extern CoreDebug_Type wlc_host_core_debug;
+extern RTC_TypeDef wlc_host_rtc;
+extern const char __executable_start[];
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+/* HAL subset, wlc_host_hal.c */
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t Delay);
+void HAL_PWR_EnableBkUpAccess(void);
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData,
+									uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart,
+									   uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma);
+uint32_t wlc_host_dma_counter(DMA_HandleTypeDef *hdma);
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init);
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin);
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin,
+					   GPIO_PinState PinState);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+DWT_Type *wlc_host_dwt(void);
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+/* I2C on i2c-dev or the stand-in socket, wlc_host_i2c.c */
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c);
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c);
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c,
+										  uint16_t DevAddress, uint8_t *pData,
+										  uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef *hi2c,
+										uint16_t DevAddress, uint32_t Trials,
+										uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *hi2c,
+								   uint16_t DevAddress, uint16_t MemAddress,
+								   uint16_t MemAddSize, uint8_t *pData,
+								   uint16_t Size, uint32_t Timeout);
+HAL_StatusTypeDef HAL_I2C_Master_Seq_Transmit_IT(I2C_HandleTypeDef *hi2c,
+												 uint16_t DevAddress,
+												 uint8_t *pData, uint16_t Size,
+												 uint32_t XferOptions);
+HAL_StatusTypeDef HAL_I2C_Master_Seq_Receive_IT(I2C_HandleTypeDef *hi2c,
+												uint16_t DevAddress,
+												uint8_t *pData, uint16_t Size,
+												uint32_t XferOptions);
+void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c);
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c);
+void wlc_host_bus_stats_get(struct wlc_host_bus_stats *stats);
+void wlc_host_bus_stats_reset(void);
+void wlc_host_fault_arm(const struct wlc_host_fault *fault);
+int wlc_host_fault_fired(void);
+void wlc_host_fault_scl(GPIO_PinState state);
+int wlc_host_fault_sda_low(void);
+
+#endif
@@ -0,0 +1,171 @@
+/***************************************************************************
+ * File Name:		wlc_host_hal.c
+ * Description:		HAL time base, log output and the Cortex-M registers
+ *					the driver touches, for the Linux host build
+ ***************************************************************************/
+
+/***************************************************************************
+ * Included files
+ ***************************************************************************/
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wlc_host.h"
+
+/***************************************************************************
+ * Global variables
+ ***************************************************************************/
+uint32_t SystemCoreClock = 1000000000;	/* DWT cycles are nanoseconds */
+GPIO_TypeDef wlc_host_gpiob;
+CoreDebug_Type wlc_host_core_debug;
+RTC_TypeDef wlc_host_rtc;
+
+/***************************************************************************
+ * Private variables
+ ***************************************************************************/
+static DWT_Type host_dwt;
+
+/***************************************************************************
+ * Function definitions
+ ***************************************************************************/
+static uint64_t host_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	static uint64_t start;
+
+	if (start == 0)
+		start = host_now_ns();
+	return (uint32_t)((host_now_ns() - start) / 1000000);
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	struct timespec ts;
+
+	ts.tv_sec = Delay / 1000;
+	ts.tv_nsec = (long)(Delay % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) != 0)
+		;
+}
+
+void HAL_PWR_EnableBkUpAccess(void)
+{
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData,
+									uint16_t Size, uint32_t Timeout)
+{
+	int fd = huart ? huart->fd : STDOUT_FILENO;
+	ssize_t done;
+
+	while (Size) {
+		done = write(fd, pData, Size);
+		if (done <= 0)
+			return HAL_ERROR;
+		pData += done;
+		Size -= (uint16_t)done;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart,
+									   uint8_t *pData, uint16_t Size)
+{
+	if (huart->hdmarx == NULL || Size == 0)
+		return HAL_ERROR;
+
+	huart->pRxBuffPtr = pData;
+	huart->RxXferSize = Size;
+	huart->hdmarx->Parent = huart;
+	huart->hdmarx->Remaining = Size;
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_Abort(DMA_HandleTypeDef *hdma)
+{
+	if (hdma->Parent)
+		hdma->Parent->RxState = HAL_UART_STATE_READY;
+	return HAL_OK;
+}
+
+/*
+ * The DMA of the host: each counter read moves at most one waiting byte
+ * from the UART fd into the ring. The reader consumes bytes one counter
+ * read at a time, so the ring never overruns, whatever arrives at once.
+ */
+uint32_t wlc_host_dma_counter(DMA_HandleTypeDef *hdma)
+{
+	UART_HandleTypeDef *huart = hdma->Parent;
+	struct pollfd pfd;
+
+	if (huart == NULL || huart->RxState != HAL_UART_STATE_BUSY_RX)
+		return hdma->Remaining;
+
+	pfd.fd = huart->fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN) &&
+		read(huart->fd, huart->pRxBuffPtr + huart->RxXferSize -
+			 hdma->Remaining, 1) == 1) {
+		if (--hdma->Remaining == 0)
+			hdma->Remaining = huart->RxXferSize;
+	}
+	return hdma->Remaining;
+}
+
+/*
+ * The bus unstick sequence has no pins to drive on Linux: recovery is the
+ * adapter driver's job. SDA reads back high unless the fault layer holds
+ * it low; the SCL clocks go to the fault layer.
+ */
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+}
+
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin)
+{
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin,
+					   GPIO_PinState PinState)
+{
+	if (GPIO_Pin & GPIO_PIN_8)
+		wlc_host_fault_scl(PinState);
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	if (GPIO_Pin == GPIO_PIN_9 && wlc_host_fault_sda_low())
+		return GPIO_PIN_RESET;
+	return GPIO_PIN_SET;
+}
+
+/* Every DWT access samples the monotonic clock into CYCCNT */
+DWT_Type *wlc_host_dwt(void)
+{
+	host_dwt.CYCCNT = (uint32_t)host_now_ns();
+	return &host_dwt;
+}
+
+/* newlib has it, glibc only from 2.38 on */
+__weak size_t strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size) {
+		size_t n = len < size - 1 ? len : size - 1;
+
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return len;
+}
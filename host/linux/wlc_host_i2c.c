@@ -0,0 +1,567 @@
+/***************************************************************************
+ * File Name:		wlc_host_i2c.c
+ * Description:		HAL I2C master subset on Linux. Each write-then-read
+ *					is one I2C_RDWR combined transaction with a repeated
+ *					START; a socket path talks to wlc_chip_sim.py instead.
+ *					Faults can be injected into the transactions.
+ ***************************************************************************/
+
+/***************************************************************************
+ * Included files
+ ***************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "wlc_host.h"
+
+/***************************************************************************
+ * Macro definitions
+ ***************************************************************************/
+/* Chip registers the NVM faults key on */
+#define FAULT_FWREG_SYS_CMD			0x0020
+#define FAULT_FWREG_SECTOR_INDEX	0x0024
+#define FAULT_SYS_CMD_PROGRAM		0x04
+#define FAULT_OPCODE_WRITE			0xFA
+#define FAULT_HWREG_RST				0x2001F200
+#define FAULT_UNSTICK_CLOCKS		9
+
+/***************************************************************************
+ * Private variables
+ ***************************************************************************/
+/* FIRST_FRAME held back until the frame that ends the transaction */
+static struct {
+	uint8_t *data;
+	uint16_t len;
+	uint16_t addr;
+	int pending;
+} first_frame;
+
+/* Completion callbacks run one after the other, never nested */
+static void (*cb_pending)(I2C_HandleTypeDef *hi2c);
+static int cb_running;
+
+static uint8_t xfer_buf[1 + 2 * 6 + 2 * WLC_HOST_XFER_MAX];
+static struct wlc_host_bus_stats bus_stats;
+
+/* Armed fault and the state it leaves on the bus or in the chip */
+static struct {
+	struct wlc_host_fault armed;
+	uint32_t xfers;			/* transactions since arming */
+	uint32_t failing;		/* transactions left to fail */
+	int fired;
+	int sda_low;
+	int scl_level;
+	int scl_clocks;
+	int sys_cmd_busy;		/* SYS_CMD reads show the program bit */
+	int sectors;			/* NVM sectors selected since arming */
+	wlc_host_fault_t after;	/* applied once the transaction is done */
+} fault;
+
+/***************************************************************************
+ * Function definitions
+ ***************************************************************************/
+static uint64_t host_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Stand-in exchange on a SOCK_SEQPACKET socket, one datagram each way.
+ * Request: u8 count, then per message u16 addr, u16 flags, u16 len and the
+ * data of writes. Reply: u8 status (0: ACK), then the data of all reads.
+ */
+static int host_sock_xfer(I2C_HandleTypeDef *hi2c, struct i2c_msg *msgs,
+						  int count)
+{
+	size_t pos = 1;
+	ssize_t len;
+	int i;
+
+	xfer_buf[0] = (uint8_t)count;
+	for (i = 0; i < count; i++) {
+		if (pos + 6 + msgs[i].len > sizeof(xfer_buf))
+			return -EMSGSIZE;
+		memcpy(&xfer_buf[pos], &msgs[i].addr, 2);
+		memcpy(&xfer_buf[pos + 2], &msgs[i].flags, 2);
+		memcpy(&xfer_buf[pos + 4], &msgs[i].len, 2);
+		pos += 6;
+		if (!(msgs[i].flags & I2C_M_RD)) {
+			memcpy(&xfer_buf[pos], msgs[i].buf, msgs[i].len);
+			pos += msgs[i].len;
+		}
+	}
+
+	bus_stats.syscalls += 2;
+	if (send(hi2c->fd, xfer_buf, pos, 0) != (ssize_t)pos)
+		return -errno;
+	len = recv(hi2c->fd, xfer_buf, sizeof(xfer_buf), 0);
+	if (len < 1)
+		return len < 0 ? -errno : -ECONNRESET;
+	if (xfer_buf[0] != 0)
+		return -ENXIO;
+
+	pos = 1;
+	for (i = 0; i < count; i++) {
+		if (!(msgs[i].flags & I2C_M_RD))
+			continue;
+		if (pos + msgs[i].len > (size_t)len)
+			return -EPROTO;
+		memcpy(msgs[i].buf, &xfer_buf[pos], msgs[i].len);
+		pos += msgs[i].len;
+	}
+	return 0;
+}
+
+static int host_transport(I2C_HandleTypeDef *hi2c, struct i2c_msg *msgs,
+						  int count)
+{
+	struct i2c_rdwr_ioctl_data rdwr = { msgs, (uint32_t)count };
+
+	if (hi2c->socket)
+		return host_sock_xfer(hi2c, msgs, count);
+
+	bus_stats.syscalls++;
+	return ioctl(hi2c->fd, I2C_RDWR, &rdwr) < 0 ? -errno : 0;
+}
+
+/*** Fault injection **/
+
+void wlc_host_fault_arm(const struct wlc_host_fault *armed)
+{
+	memset(&fault, 0, sizeof(fault));
+	fault.armed = *armed;
+	fault.scl_level = 1;
+}
+
+int wlc_host_fault_fired(void)
+{
+	return fault.fired;
+}
+
+/* Rising SCL edges driven by the bus unstick free a stuck SDA */
+void wlc_host_fault_scl(GPIO_PinState state)
+{
+	if (state == GPIO_PIN_SET && !fault.scl_level &&
+		++fault.scl_clocks >= FAULT_UNSTICK_CLOCKS)
+		fault.sda_low = 0;
+	fault.scl_level = state == GPIO_PIN_SET;
+}
+
+int wlc_host_fault_sda_low(void)
+{
+	return fault.sda_low;
+}
+
+/* First bytes written by a transaction, header and data run together */
+static int host_fault_peek(struct i2c_msg *msgs, int count, uint8_t *out,
+						   int size)
+{
+	int n = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < count && !(msgs[i].flags & I2C_M_RD); i++) {
+		if (i && !(msgs[i].flags & I2C_M_NOSTART))
+			break;
+		for (j = 0; j < msgs[i].len && n < size; j++)
+			out[n++] = msgs[i].buf[j];
+	}
+	return n;
+}
+
+static int host_fault_has_read(struct i2c_msg *msgs, int count)
+{
+	return msgs[count - 1].flags & I2C_M_RD;
+}
+
+static int host_fault_eligible(struct i2c_msg *msgs, int count)
+{
+	switch (fault.armed.type) {
+	case WLC_HOST_FAULT_NACK_DATA:
+		return !host_fault_has_read(msgs, count);
+	case WLC_HOST_FAULT_SHORT_READ:
+	case WLC_HOST_FAULT_BIT_FLIP:
+		return host_fault_has_read(msgs, count);
+	case WLC_HOST_FAULT_NACK_ADDR:
+	case WLC_HOST_FAULT_BUS_BUSY:
+	case WLC_HOST_FAULT_SDA_STUCK:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Reset the chip through its reset register, as a brown-out would */
+static void host_fault_chip_reset(I2C_HandleTypeDef *hi2c, uint16_t addr)
+{
+	uint8_t cmd[] = {
+		FAULT_OPCODE_WRITE, (uint8_t)(FAULT_HWREG_RST >> 24),
+		(uint8_t)(FAULT_HWREG_RST >> 16), (uint8_t)(FAULT_HWREG_RST >> 8),
+		(uint8_t)FAULT_HWREG_RST, 0x01
+	};
+	struct i2c_msg msg = { addr, 0, sizeof(cmd), cmd };
+
+	host_transport(hi2c, &msg, 1);
+}
+
+/* Follow the NVM programming sequence for the faults keyed on a sector */
+static void host_fault_nvm(I2C_HandleTypeDef *hi2c, struct i2c_msg *msgs,
+						   int count)
+{
+	uint8_t wr[3];
+	int reg;
+
+	if (host_fault_has_read(msgs, count) ||
+		host_fault_peek(msgs, count, wr, sizeof(wr)) != 3 ||
+		wr[0] == FAULT_OPCODE_WRITE)
+		return;
+
+	reg = (wr[0] << 8) | wr[1];
+	if (reg == FAULT_FWREG_SECTOR_INDEX) {
+		fault.sectors++;
+		if (fault.armed.type == WLC_HOST_FAULT_CHIP_RESET && !fault.fired &&
+			fault.sectors > (int)fault.armed.at) {
+			fault.fired = 1;
+			host_fault_chip_reset(hi2c, msgs[0].addr);
+		}
+	} else if (reg == FAULT_FWREG_SYS_CMD) {
+		fault.sys_cmd_busy = 0;
+		if (fault.armed.type == WLC_HOST_FAULT_NVM_TIMEOUT && !fault.fired &&
+			(wr[2] & FAULT_SYS_CMD_PROGRAM) &&
+			fault.sectors > (int)fault.armed.at) {
+			fault.fired = 1;
+			fault.sys_cmd_busy = 1;
+		}
+	}
+}
+
+/*
+ * Apply the armed fault to a transaction about to go out. Returns a
+ * negative errno to fail it without reaching the bus, 0 to send it.
+ */
+static int host_fault_before(I2C_HandleTypeDef *hi2c, struct i2c_msg *msgs,
+							 int count)
+{
+	wlc_host_fault_t type = fault.armed.type;
+
+	if (type == WLC_HOST_FAULT_NONE)
+		return 0;
+
+	host_fault_nvm(hi2c, msgs, count);
+	fault.xfers++;
+	if (fault.sda_low)
+		return -ETIMEDOUT;
+	if (fault.failing) {
+		fault.failing--;
+		return type == WLC_HOST_FAULT_BUS_BUSY ? -EAGAIN : -ENXIO;
+	}
+	if (fault.fired || fault.xfers <= fault.armed.at ||
+		!host_fault_eligible(msgs, count))
+		return 0;
+
+	fault.fired = 1;
+	switch (type) {
+	case WLC_HOST_FAULT_NACK_ADDR:
+	case WLC_HOST_FAULT_BUS_BUSY:
+		fault.failing = fault.armed.count > 1 ? fault.armed.count - 1 : 0;
+		return type == WLC_HOST_FAULT_BUS_BUSY ? -EAGAIN : -ENXIO;
+	case WLC_HOST_FAULT_SDA_STUCK:
+		fault.sda_low = 1;
+		fault.scl_clocks = 0;
+		return -ETIMEDOUT;
+	case WLC_HOST_FAULT_NACK_DATA:
+		/* The chip takes the bytes before the NACK */
+		msgs[count - 1].len /= 2;
+		fault.after = type;
+		return 0;
+	default:
+		fault.after = type;
+		return 0;
+	}
+}
+
+/* Corrupt or fail a transaction the bus has carried out */
+static int host_fault_after(struct i2c_msg *msgs, int count, int err)
+{
+	struct i2c_msg *rd = &msgs[count - 1];
+	wlc_host_fault_t after = fault.after;
+	uint8_t wr[2];
+
+	fault.after = WLC_HOST_FAULT_NONE;
+	if (err)
+		return err;
+
+	if (fault.sys_cmd_busy && host_fault_has_read(msgs, count) &&
+		host_fault_peek(msgs, count, wr, sizeof(wr)) == 2 &&
+		((wr[0] << 8) | wr[1]) == FAULT_FWREG_SYS_CMD)
+		rd->buf[0] |= FAULT_SYS_CMD_PROGRAM;
+
+	switch (after) {
+	case WLC_HOST_FAULT_NACK_DATA:
+		return -EREMOTEIO;
+	case WLC_HOST_FAULT_SHORT_READ:
+		memset(&rd->buf[rd->len / 2], 0xFF, rd->len - rd->len / 2);
+		return -EPROTO;
+	case WLC_HOST_FAULT_BIT_FLIP:
+		rd->buf[rand() % rd->len] ^= (uint8_t)(1 << (rand() % 8));
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/*** Transactions **/
+
+static HAL_StatusTypeDef host_xfer(I2C_HandleTypeDef *hi2c,
+								   struct i2c_msg *msgs, int count)
+{
+	uint64_t start;
+	int err;
+	int i;
+
+	if (hi2c->State != HAL_I2C_STATE_READY)
+		return HAL_ERROR;
+
+	start = host_now_ns();
+	err = host_fault_before(hi2c, msgs, count);
+	if (err == 0)
+		err = host_transport(hi2c, msgs, count);
+	err = host_fault_after(msgs, count, err);
+	bus_stats.syscall_ns += host_now_ns() - start;
+	bus_stats.transactions++;
+
+	for (i = 0; i < count; i++)
+		bus_stats.bytes += msgs[i].len;
+	if (err) {
+		bus_stats.failures++;
+		return HAL_ERROR;
+	}
+	return HAL_OK;
+}
+
+static void host_complete(I2C_HandleTypeDef *hi2c,
+						  void (*cb)(I2C_HandleTypeDef *hi2c))
+{
+	/* A transfer started from a callback completes after it returns */
+	if (cb_running) {
+		cb_pending = cb;
+		return;
+	}
+
+	cb_running = 1;
+	while (cb) {
+		cb_pending = NULL;
+		cb(hi2c);
+		cb = cb_pending;
+	}
+	cb_running = 0;
+}
+
+/*
+ * Messages of a transaction: the held back FIRST_FRAME, if any, then this
+ * frame. Two writes are joined with I2C_M_NOSTART, or copied into one
+ * message if the adapter cannot do that.
+ */
+static int host_frame_msgs(I2C_HandleTypeDef *hi2c, uint16_t addr,
+						   uint8_t *data, uint16_t len, uint16_t flags,
+						   struct i2c_msg *msgs)
+{
+	static uint8_t bounce[WLC_HOST_XFER_MAX];
+	int count = 0;
+
+	if (first_frame.pending) {
+		first_frame.pending = 0;
+		if (!(flags & I2C_M_RD) && !hi2c->nostart) {
+			if (first_frame.len + len > sizeof(bounce))
+				return -1;
+			memcpy(bounce, first_frame.data, first_frame.len);
+			memcpy(&bounce[first_frame.len], data, len);
+			len += first_frame.len;
+			data = bounce;
+		} else {
+			msgs[count].addr = first_frame.addr;
+			msgs[count].flags = 0;
+			msgs[count].len = first_frame.len;
+			msgs[count].buf = first_frame.data;
+			count++;
+			if (!(flags & I2C_M_RD))
+				flags |= I2C_M_NOSTART;
+		}
+	}
+
+	msgs[count].addr = addr;
+	msgs[count].flags = flags;
+	msgs[count].len = len;
+	msgs[count].buf = data;
+	return count + 1;
+}
+
+HAL_StatusTypeDef HAL_I2C_Init(I2C_HandleTypeDef *hi2c)
+{
+	struct sockaddr_un sun = { AF_UNIX };
+	struct stat st;
+	unsigned long funcs = 0;
+
+	hi2c->State = HAL_I2C_STATE_RESET;
+	first_frame.pending = 0;
+	if (stat(hi2c->Path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		hi2c->socket = 1;
+		hi2c->nostart = 1;
+		strncpy(sun.sun_path, hi2c->Path, sizeof(sun.sun_path) - 1);
+		hi2c->fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		if (hi2c->fd < 0 ||
+			connect(hi2c->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			goto err;
+	} else {
+		hi2c->socket = 0;
+		hi2c->fd = open(hi2c->Path, O_RDWR);
+		if (hi2c->fd < 0 || ioctl(hi2c->fd, I2C_FUNCS, &funcs) < 0)
+			goto err;
+		if (!(funcs & I2C_FUNC_I2C)) {
+			fprintf(stderr, "%s: adapter has no I2C_RDWR support\n",
+					hi2c->Path);
+			goto err_close;
+		}
+		hi2c->nostart = (funcs & I2C_FUNC_NOSTART) != 0;
+	}
+
+	hi2c->State = HAL_I2C_STATE_READY;
+	return HAL_OK;
+
+err:
+	perror(hi2c->Path);
+err_close:
+	if (hi2c->fd >= 0)
+		close(hi2c->fd);
+	hi2c->fd = -1;
+	return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_I2C_DeInit(I2C_HandleTypeDef *hi2c)
+{
+	if (hi2c->fd >= 0)
+		close(hi2c->fd);
+	hi2c->fd = -1;
+	hi2c->State = HAL_I2C_STATE_RESET;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef *hi2c,
+										  uint16_t DevAddress, uint8_t *pData,
+										  uint16_t Size, uint32_t Timeout)
+{
+	struct i2c_msg msg = { DevAddress >> 1, 0, Size, pData };
+
+	return host_xfer(hi2c, &msg, 1);
+}
+
+/* Zero length write: the address alone, as SMBus quick write does */
+HAL_StatusTypeDef HAL_I2C_IsDeviceReady(I2C_HandleTypeDef *hi2c,
+										uint16_t DevAddress, uint32_t Trials,
+										uint32_t Timeout)
+{
+	struct i2c_msg msg = { DevAddress >> 1, 0, 0, NULL };
+
+	while (Trials--)
+		if (host_xfer(hi2c, &msg, 1) == HAL_OK)
+			return HAL_OK;
+	return HAL_ERROR;
+}
+
+/*
+ * The HAL timeout is one budget for the whole transfer, from a single
+ * tickstart. A transfer of 'bytes' that cannot fit in it at the bus rate
+ * times out on the target, so it fails here too.
+ */
+static int host_xfer_fits(I2C_HandleTypeDef *hi2c, uint32_t bytes,
+						  uint32_t Timeout)
+{
+	return hi2c->SclHz == 0 ||
+		   (uint64_t)bytes * 9 * 1000 <= (uint64_t)Timeout * hi2c->SclHz;
+}
+
+/* Register address, then a repeated start read, as the HAL sends them */
+HAL_StatusTypeDef HAL_I2C_Mem_Read(I2C_HandleTypeDef *hi2c,
+								   uint16_t DevAddress, uint16_t MemAddress,
+								   uint16_t MemAddSize, uint8_t *pData,
+								   uint16_t Size, uint32_t Timeout)
+{
+	uint8_t reg[2] = { (uint8_t)(MemAddress >> 8), (uint8_t)MemAddress };
+	struct i2c_msg msgs[2] = {
+		{ DevAddress >> 1, 0, MemAddSize, &reg[2 - MemAddSize] },
+		{ DevAddress >> 1, I2C_M_RD, Size, pData },
+	};
+
+	if (!host_xfer_fits(hi2c, 2 + MemAddSize + Size, Timeout))
+		return HAL_TIMEOUT;
+	return host_xfer(hi2c, msgs, 2);
+}
+
+/*
+ * The sequential calls complete before they return; a failed transfer is
+ * reported by the return value, as the HAL does for a bus it cannot claim,
+ * instead of through HAL_I2C_ErrorCallback().
+ */
+HAL_StatusTypeDef HAL_I2C_Master_Seq_Transmit_IT(I2C_HandleTypeDef *hi2c,
+												 uint16_t DevAddress,
+												 uint8_t *pData, uint16_t Size,
+												 uint32_t XferOptions)
+{
+	struct i2c_msg msgs[2];
+	int count;
+
+	if (XferOptions == I2C_FIRST_FRAME) {
+		first_frame.data = pData;
+		first_frame.len = Size;
+		first_frame.addr = DevAddress >> 1;
+		first_frame.pending = 1;
+	} else {
+		count = host_frame_msgs(hi2c, DevAddress >> 1, pData, Size, 0, msgs);
+		if (count < 0 || host_xfer(hi2c, msgs, count) != HAL_OK)
+			return HAL_ERROR;
+	}
+
+	host_complete(hi2c, HAL_I2C_MasterTxCpltCallback);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_I2C_Master_Seq_Receive_IT(I2C_HandleTypeDef *hi2c,
+												uint16_t DevAddress,
+												uint8_t *pData, uint16_t Size,
+												uint32_t XferOptions)
+{
+	struct i2c_msg msgs[2];
+	int count;
+
+	count = host_frame_msgs(hi2c, DevAddress >> 1, pData, Size, I2C_M_RD,
+							msgs);
+	if (host_xfer(hi2c, msgs, count) != HAL_OK)
+		return HAL_ERROR;
+
+	host_complete(hi2c, HAL_I2C_MasterRxCpltCallback);
+	return HAL_OK;
+}
+
+void wlc_host_bus_stats_get(struct wlc_host_bus_stats *stats)
+{
+	*stats = bus_stats;
+}
+
+void wlc_host_bus_stats_reset(void)
+{
+	memset(&bus_stats, 0, sizeof(bus_stats));
+}
@@ -0,0 +1,761 @@
+/***************************************************************************
+ * File Name:		wlc_host_main.c
+ * Description:		Command line front end of the Linux host build: chip
+ *					info, NVM check and update, register access, a
+ *					per-transaction cost benchmark, a fault recovery
+ *					benchmark, a UBIN parse benchmark, the production
+ *					station loop and the UART console on a pty
+ ***************************************************************************/
+
+/***************************************************************************
+ * Included files
+ ***************************************************************************/
+#define _GNU_SOURCE		/* posix_openpt(), ptsname() */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "stwlc38.h"
+#include "station.h"
+#include "console.h"
+
+/***************************************************************************
+ * Macro definitions
+ ***************************************************************************/
+#define HOST_BENCH_DEFAULT		100
+#define HOST_SCL_HZ_DEFAULT		100000
+#define HOST_MAX_READ_LEN		I2C_CHUNK_SIZE
+#define HOST_FAULT_RUNS			10
+#define HOST_FAULT_BASELINE		3		/* fault free runs, fastest is kept */
+#define HOST_FAULT_PATTERN_LEN	16
+#define HOST_FAULT_BUS_XFERS	3		/* transactions of the bus operation */
+#define HOST_FAULT_SEED			1
+#define HOST_UBIN_RUNS			10000
+#define HOST_OVERLAY_PATCHES	16
+#define HOST_OVERLAY_BYTES		256
+
+/***************************************************************************
+ * Global variables
+ ***************************************************************************/
+extern I2C_HandleTypeDef *hi2c;
+extern UART_HandleTypeDef *huart;
+
+/***************************************************************************
+ * Private types
+ ***************************************************************************/
+/* Outcome of one operation run under a fault */
+enum host_fault_outcome {
+	HOST_FAULT_OK,			/* completed with correct data */
+	HOST_FAULT_FAILED,		/* error reported */
+	HOST_FAULT_CORRUPT		/* completed, data wrong: fault went unseen */
+};
+
+struct host_fault_case {
+	const char *name;
+	wlc_host_fault_t type;
+	u32 count;
+	int nvm;				/* runs a full update, 'at' counts sectors */
+	u32 span;				/* 'at' is drawn below it, 0: whole operation */
+};
+
+/***************************************************************************
+ * Private variables
+ ***************************************************************************/
+static I2C_HandleTypeDef host_i2c = { WLC_HOST_DEFAULT_BUS, -1 };
+static UART_HandleTypeDef host_uart = { STDOUT_FILENO };
+static u32 scl_hz = HOST_SCL_HZ_DEFAULT;
+static char buf[PAGE_SIZE];
+static u32 fault_nvm_sectors;			/* of an update, patch and cfg */
+static u32 fault_nvm_patch_sectors;
+static struct wlc_cfg_patch overlay[HOST_OVERLAY_PATCHES];
+static u8 overlay_bytes[HOST_OVERLAY_BYTES];
+
+static const struct host_fault_case fault_cases[] = {
+	{ "nack-addr",	WLC_HOST_FAULT_NACK_ADDR,	1, 0, 0 },
+	{ "nack-data",	WLC_HOST_FAULT_NACK_DATA,	1, 0, 1 },	/* one write */
+	{ "bus-busy",	WLC_HOST_FAULT_BUS_BUSY,	2, 0, 0 },
+	{ "sda-stuck",	WLC_HOST_FAULT_SDA_STUCK,	0, 0, 0 },
+	{ "short-read",	WLC_HOST_FAULT_SHORT_READ,	0, 0, 0 },
+	{ "bit-flip",	WLC_HOST_FAULT_BIT_FLIP,	0, 0, 0 },
+	{ "nvm-timeout", WLC_HOST_FAULT_NVM_TIMEOUT, 0, 1, 0 },
+	{ "chip-reset",	WLC_HOST_FAULT_CHIP_RESET,	0, 1, 0 },
+};
+
+/***************************************************************************
+ * Function definitions
+ ***************************************************************************/
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+			"usage: %s [-d bus] [-v level] [-e] [-p] [-f scl_hz] "
+			"[-o overlay] command\n"
+			"  -d  /dev/i2c-N or wlc_chip_sim.py socket (default %s)\n"
+			"  -v  verification level 0..3 after an update\n"
+			"  -e  target NVM is erased, skip blank sectors\n"
+			"  -p  update progress lines on stderr\n"
+			"  -f  SCL rate for the wire time estimate (default %d)\n"
+			"  -o  cfg overlay: <cfg_id>,<offset>=<hex bytes>,...\n"
+			"commands:\n"
+			"  info | check | update | snap\n"
+			"  rd fw|hw <addr> <len>\n"
+			"  wr fw|hw <addr> <byte>...\n"
+			"  bench [n]\n"
+			"  faults [runs]\n"
+			"  station [units]       (0: until interrupted)\n"
+			"  console               (UART console on the pty printed)\n"
+			"  ubin <file> [runs]    (no bus needed)\n",
+			prog, WLC_HOST_DEFAULT_BUS, HOST_SCL_HZ_DEFAULT);
+}
+
+static uint64_t host_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * One line per progress report, for a station UI to parse:
+ * progress <phase> <done>/<total> <bytes> <elapsed ms> <B/s> <eta ms> <err>
+ */
+static void host_progress(void *ctx, const struct wlc_progress *progress)
+{
+	static const char *const phase_name[] = {
+		"prepare", "patch", "cfg", "verify", "done"
+	};
+
+	fprintf(stderr, "progress %s %u/%u %lu %lu %lu %lu %08X\n",
+			phase_name[progress->phase], progress->sectors_done,
+			progress->sectors_total, (unsigned long)progress->bytes_sent,
+			(unsigned long)progress->elapsed_ms, (unsigned long)progress->rate,
+			(unsigned long)progress->eta_ms, (unsigned int)progress->err);
+}
+
+/*
+ * -o 0x1F48,0x40=0012AB34,0x80=FF: cfg id, then the cfg image offsets and
+ * the bytes to put there
+ */
+static int parse_overlay(char *arg)
+{
+	char *item = strtok(arg, ",");
+	char *hex;
+	u32 used = 0;
+	u16 config_id;
+	int count = 0;
+
+	if (item == NULL)
+		return E_INVALID_INPUT;
+	config_id = (u16)strtoul(item, NULL, 0);
+	while ((item = strtok(NULL, ",")) != NULL) {
+		hex = strchr(item, '=');
+		if (hex == NULL || count == HOST_OVERLAY_PATCHES)
+			return E_INVALID_INPUT;
+		overlay[count].offset = (u16)strtoul(item, NULL, 0);
+		overlay[count].data = &overlay_bytes[used];
+		overlay[count].len = 0;
+		for (hex++; hex[0] && hex[1]; hex += 2) {
+			char byte[3] = { hex[0], hex[1], 0 };
+
+			if (used == HOST_OVERLAY_BYTES)
+				return E_INVALID_INPUT;
+			overlay_bytes[used++] = (u8)strtoul(byte, NULL, 16);
+			overlay[count].len++;
+		}
+		if (overlay[count].len == 0 || *hex)
+			return E_INVALID_INPUT;
+		count++;
+	}
+	return wlc_set_cfg_overlay(overlay, count, config_id);
+}
+
+static int parse_space(const char *arg, int *hw)
+{
+	if (strcmp(arg, "fw") == 0)
+		*hw = 0;
+	else if (strcmp(arg, "hw") == 0)
+		*hw = 1;
+	else
+		return E_INVALID_INPUT;
+	return OK;
+}
+
+/* rd fw|hw <addr> <len> */
+static int host_read(int argc, char **argv)
+{
+	u8 data[HOST_MAX_READ_LEN];
+	struct wlc_xfer step;
+	int hw;
+	int len;
+	int err;
+	int i;
+
+	if (argc != 4 || parse_space(argv[1], &hw) != OK)
+		return E_INVALID_INPUT;
+	len = (int)strtoul(argv[3], NULL, 0);
+	if (len <= 0 || len > HOST_MAX_READ_LEN)
+		return E_INVALID_INPUT;
+
+	step.type = hw ? WLC_XFER_HW_READ : WLC_XFER_FW_READ;
+	step.addr = strtoul(argv[2], NULL, 0);
+	step.data = data;
+	step.len = len;
+	err = wlc_xfer_run(&step, 1);
+	if (err != OK)
+		return err;
+
+	for (i = 0; i < len; i++)
+		printf("%02X%s", data[i], (i % 16 == 15 || i == len - 1) ? "\n" : " ");
+	return OK;
+}
+
+/* wr fw|hw <addr> <byte>... */
+static int host_write(int argc, char **argv)
+{
+	u8 data[HOST_MAX_READ_LEN];
+	struct wlc_xfer step;
+	int hw;
+	int i;
+
+	if (argc < 4 || argc - 3 > HOST_MAX_READ_LEN ||
+		parse_space(argv[1], &hw) != OK)
+		return E_INVALID_INPUT;
+
+	for (i = 3; i < argc; i++)
+		data[i - 3] = (u8)strtoul(argv[i], NULL, 0);
+
+	step.type = hw ? WLC_XFER_HW_WRITE : WLC_XFER_FW_WRITE;
+	step.addr = strtoul(argv[2], NULL, 0);
+	step.data = data;
+	step.len = argc - 3;
+	return wlc_xfer_run(&step, 1);
+}
+
+/*
+ * Split the time of the transactions since the last stats reset into the
+ * wire time at scl_hz (9 clocks per byte, address bytes ignored) and the
+ * rest, which is syscall and adapter overhead. Against the stand-in
+ * socket there is no wire.
+ */
+static void host_bench_report(const char *name, uint64_t elapsed_ns)
+{
+	struct wlc_host_bus_stats stats;
+	uint64_t wire_ns;
+	u32 n;
+
+	wlc_host_bus_stats_get(&stats);
+	n = stats.transactions ? stats.transactions : 1;
+	wire_ns = host_i2c.socket ? 0 : stats.bytes * 9 * 1000000000ULL / scl_hz;
+
+	printf("%s: %lu transactions, %lu bytes, %lu B/s\n", name,
+		   (unsigned long)stats.transactions, (unsigned long)stats.bytes,
+		   (unsigned long)(stats.bytes * 1000000000ULL / elapsed_ns));
+	printf("  per transaction: %.1f us total, %.1f syscalls taking %.1f us, "
+		   "%.1f us wire, %.1f us overhead\n",
+		   elapsed_ns / 1000.0 / n, (double)stats.syscalls / n,
+		   stats.syscall_ns / 1000.0 / n, wire_ns / 1000.0 / n,
+		   (stats.syscall_ns > wire_ns ? stats.syscall_ns - wire_ns : 0) /
+		   1000.0 / n);
+}
+
+/*
+ * Bus cost of an update: the bytes it moved and their wire time at scl_hz,
+ * which is what a delta package or a lower verify level saves.
+ */
+static void host_update_report(uint64_t elapsed_ns)
+{
+	struct wlc_host_bus_stats stats;
+
+	wlc_host_bus_stats_get(&stats);
+	fprintf(stderr, "bus: %lu transactions, %lu bytes, %lu ms wire at %lu Hz, "
+			"%lu ms elapsed\n", (unsigned long)stats.transactions,
+			(unsigned long)stats.bytes,
+			(unsigned long)(stats.bytes * 9 * 1000 / scl_hz),
+			(unsigned long)scl_hz, (unsigned long)(elapsed_ns / 1000000));
+}
+
+static int host_bench_seg(void *ctx, u32 offset, const u8 *data, u16 len)
+{
+	*(u32 *)ctx = wlc_crc32_update(*(u32 *)ctx, data, len);
+	return OK;
+}
+
+/* bench [n]: cost of short register reads and of segmented bulk reads */
+static int host_bench(int argc, char **argv)
+{
+	struct wlc_chip_info info;
+	u32 n = argc > 1 ? strtoul(argv[1], NULL, 0) : HOST_BENCH_DEFAULT;
+	u32 crc = 0xFFFFFFFF;
+	uint64_t start;
+	u32 i;
+	int err;
+
+	if (n == 0)
+		return E_INVALID_INPUT;
+
+	wlc_host_bus_stats_reset();
+	start = host_now_ns();
+	for (i = 0; i < n; i++) {
+		err = wlc_read_chip_info(&info, 1);
+		if (err != OK)
+			return err;
+	}
+	host_bench_report("chip info read", host_now_ns() - start);
+
+	wlc_host_bus_stats_reset();
+	start = host_now_ns();
+	for (i = 0; i < n; i++) {
+		err = wlc_seg_read(0, WLC_SNAP_FW_START, WLC_SNAP_FW_LEN, 0,
+						   host_bench_seg, &crc);
+		if (err != OK)
+			return err;
+	}
+	host_bench_report("segmented read", host_now_ns() - start);
+	return OK;
+}
+
+/*
+ * Bus operation of the fault runs, all through wlc_i2c_write() and
+ * wlc_i2c_read(): write a pattern to the AUX data registers, read it back,
+ * then read the chip info block and compare it with ref.
+ */
+static enum host_fault_outcome host_fault_bus_op(u32 run, const u8 *ref)
+{
+	u8 cmd[2 + HOST_FAULT_PATTERN_LEN];
+	u8 data[HOST_FAULT_PATTERN_LEN];
+	u8 id_cmd[2] = { 0, 0 };
+	int i;
+
+	cmd[0] = (u8)(FWREG_AUX_DATA_00_ADDR >> 8);
+	cmd[1] = (u8)FWREG_AUX_DATA_00_ADDR;
+	for (i = 0; i < HOST_FAULT_PATTERN_LEN; i++)
+		cmd[2 + i] = (u8)(run * 31 + i * 7);
+
+	if (wlc_i2c_write(cmd, sizeof(cmd)) != HAL_OK ||
+		wlc_i2c_read(cmd, 2, data, HOST_FAULT_PATTERN_LEN) != HAL_OK)
+		return HOST_FAULT_FAILED;
+	if (memcmp(data, &cmd[2], HOST_FAULT_PATTERN_LEN) != 0)
+		return HOST_FAULT_CORRUPT;
+
+	if (wlc_i2c_read(id_cmd, 2, data, WLC_CHIP_INFO_LEN) != HAL_OK)
+		return HOST_FAULT_FAILED;
+	return memcmp(data, ref, WLC_CHIP_INFO_LEN) == 0 ? HOST_FAULT_OK
+													: HOST_FAULT_CORRUPT;
+}
+
+/*
+ * Spoil NVM sector 0, so that the next update has the whole image to
+ * program, and the sector programmed 'nth' in an update, so that a fault
+ * keeping it from being written shows. Then reset the chip.
+ */
+static int host_fault_nvm_dirty(u32 nth)
+{
+	u8 pwd[] = { 0x00, (u8)FWREG_NVM_PWD_ADDR, 0xC5 };
+	u8 index[] = { 0x00, (u8)FWREG_NVM_SECTOR_INDEX_ADDR, 0x00 };
+	u8 load[] = { 0x00, (u8)FWREG_SYS_CMD_ADDR, 0x10 };
+	u8 aux[2 + HOST_FAULT_PATTERN_LEN] = {
+		(u8)(FWREG_AUX_DATA_00_ADDR >> 8), (u8)FWREG_AUX_DATA_00_ADDR
+	};
+	u8 program[] = { 0x00, (u8)FWREG_SYS_CMD_ADDR, 0x04 };
+	u8 power_down[] = { 0x00, (u8)FWREG_SYS_CMD_ADDR, 0x20 };
+	u8 reset[] = { 0x00, (u8)FWREG_SYS_CMD_ADDR, 0x40 };
+	int i;
+
+	if (wlc_i2c_write(pwd, sizeof(pwd)) != HAL_OK)
+		return E_BUS_W;
+	for (i = 0; i < 2; i++) {
+		/* Patch sectors are programmed first, then the cfg ones */
+		if (i == 0)
+			index[2] = NVM_PATCH_START_SECTOR_INDEX;
+		else if (nth < fault_nvm_patch_sectors)
+			index[2] = (u8)(NVM_PATCH_START_SECTOR_INDEX + nth);
+		else
+			index[2] = (u8)(NVM_CFG_START_SECTOR_INDEX + nth -
+							fault_nvm_patch_sectors);
+		if (wlc_i2c_write(index, sizeof(index)) != HAL_OK ||
+			wlc_i2c_write(load, sizeof(load)) != HAL_OK ||
+			wlc_i2c_write(aux, sizeof(aux)) != HAL_OK ||
+			wlc_i2c_write(program, sizeof(program)) != HAL_OK)
+			return E_BUS_W;
+		HAL_Delay(20);
+	}
+	wlc_i2c_write(power_down, sizeof(power_down));
+	/* The reset write is not acknowledged by a real chip, see the FAQ */
+	wlc_i2c_write(reset, sizeof(reset));
+	HAL_Delay(AFTER_SYS_RESET_SLEEP_MS);
+	wlc_reg_cache_invalidate();
+	return OK;
+}
+
+/* Learn the sector counts of an update from its progress reports */
+static void host_fault_progress(void *ctx, const struct wlc_progress *progress)
+{
+	if (progress->phase == WLC_PROGRESS_PREPARE)
+		fault_nvm_sectors = progress->sectors_total;
+	else if (progress->phase == WLC_PROGRESS_PATCH)
+		fault_nvm_patch_sectors = progress->sectors_done;
+}
+
+static enum host_fault_outcome host_fault_nvm_op(void)
+{
+	nvm_program_show(buf);
+	return strncmp(buf, "{ 00000000 }", 12) == 0 ? HOST_FAULT_OK
+												 : HOST_FAULT_FAILED;
+}
+
+/*
+ * Run one fault case 'runs' times, the fault placed at a random point,
+ * and print the outcomes and the recovery time: the time over the fastest
+ * fault free run, for the runs that ended with the right data. A failed
+ * update is programmed again, and that second update counts in its
+ * recovery time.
+ */
+static int host_fault_case(const struct host_fault_case *fc, u32 runs,
+						   const u8 *ref)
+{
+	struct wlc_host_fault fault = { WLC_HOST_FAULT_NONE, 0, fc->count };
+	struct wlc_retry_stats before;
+	struct wlc_retry_stats after;
+	enum host_fault_outcome outcome;
+	u32 tally[3] = { 0, 0, 0 };
+	u32 missed = 0;
+	u32 recovered = 0;
+	u32 span;
+	uint64_t base_ns = 0;
+	uint64_t total_ns = 0;
+	uint64_t max_ns = 0;
+	uint64_t start;
+	uint64_t ns;
+	u32 i;
+
+	for (i = 0; i < HOST_FAULT_BASELINE + runs; i++) {
+		if (fc->span)
+			span = fc->span;
+		else if (fc->nvm)
+			span = fault_nvm_sectors ? fault_nvm_sectors : 1;
+		else
+			span = HOST_FAULT_BUS_XFERS;
+		fault.at = (u32)rand() % span;
+		if (fc->nvm && host_fault_nvm_dirty(fault.at) != OK)
+			return E_BUS_W;
+
+		if (i == HOST_FAULT_BASELINE)
+			wlc_get_retry_stats(&before);
+		fault.type = i < HOST_FAULT_BASELINE ? WLC_HOST_FAULT_NONE : fc->type;
+		wlc_host_fault_arm(&fault);
+
+		start = host_now_ns();
+		outcome = fc->nvm ? host_fault_nvm_op() : host_fault_bus_op(i, ref);
+		ns = host_now_ns() - start;
+		if (i >= HOST_FAULT_BASELINE && !wlc_host_fault_fired())
+			missed++;
+		fault.type = WLC_HOST_FAULT_NONE;
+		wlc_host_fault_arm(&fault);
+
+		if (i < HOST_FAULT_BASELINE) {
+			if (outcome != HOST_FAULT_OK)
+				return E_BUS_WR;
+			if (base_ns == 0 || ns < base_ns)
+				base_ns = ns;
+			continue;
+		}
+
+		tally[outcome]++;
+		if (outcome == HOST_FAULT_FAILED && fc->nvm) {
+			/* The station programs the unit again */
+			start = host_now_ns();
+			if (host_fault_nvm_op() == HOST_FAULT_OK)
+				outcome = HOST_FAULT_OK;
+			ns += host_now_ns() - start;
+		}
+		if (outcome == HOST_FAULT_OK) {
+			ns = ns > base_ns ? ns - base_ns : 0;
+			total_ns += ns;
+			if (ns > max_ns)
+				max_ns = ns;
+			recovered++;
+		}
+	}
+	wlc_get_retry_stats(&after);
+
+	printf("%-12s %5lu %5lu %6lu %7lu %10.2f %8.2f %7.1f %6lu\n", fc->name,
+		   (unsigned long)runs, (unsigned long)tally[HOST_FAULT_OK],
+		   (unsigned long)tally[HOST_FAULT_FAILED],
+		   (unsigned long)tally[HOST_FAULT_CORRUPT],
+		   recovered ? total_ns / 1e6 / recovered : 0.0, max_ns / 1e6,
+		   (double)(after.retries + after.sector_retries - before.retries -
+					before.sector_retries) / runs,
+		   (unsigned long)missed);
+	return OK;
+}
+
+/*
+ * faults [runs]: success rate and recovery time of the wlc_i2c_* paths
+ * under each injected fault. Bus faults hit a register write and read
+ * back; NVM faults hit a random patch sector of a full update, checked by
+ * FULL read-back so no corrupt sector escapes. The driver log is silenced meanwhile.
+ */
+static int host_faults(int argc, char **argv)
+{
+	u32 runs = argc > 1 ? strtoul(argv[1], NULL, 0) : HOST_FAULT_RUNS;
+	u8 ref[WLC_CHIP_INFO_LEN];
+	u8 id_cmd[2] = { 0, 0 };
+	int log_fd = host_uart.fd;
+	int err = OK;
+	u32 i;
+
+	if (runs == 0)
+		return E_INVALID_INPUT;
+	if (wlc_i2c_read(id_cmd, 2, ref, WLC_CHIP_INFO_LEN) != HAL_OK)
+		return E_BUS_R;
+
+	srand(HOST_FAULT_SEED);
+	wlc_set_verify_level(WLC_VERIFY_FULL);
+	wlc_set_progress_cb(host_fault_progress, NULL);
+	host_uart.fd = open("/dev/null", O_WRONLY);
+	printf("fault         runs    ok failed corrupt  recover ms   max ms "
+		   "retries missed\n");
+	for (i = 0; i < sizeof(fault_cases) / sizeof(fault_cases[0]); i++) {
+		err = host_fault_case(&fault_cases[i], runs, ref);
+		if (err != OK)
+			break;
+	}
+	close(host_uart.fd);
+	host_uart.fd = log_fd;
+	wlc_set_progress_cb(NULL, NULL);
+	return err;
+}
+
+/*
+ * station [units]: the production station loop of WLC_STATION builds,
+ * until that many units are done, then the shift statistics.
+ */
+static int host_station(int argc, char **argv)
+{
+	u32 units = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+	struct station_stats stats;
+
+	station_init();
+	do {
+		station_poll();
+		HAL_Delay(1);
+		station_get_stats(&stats);
+	} while (units == 0 || stats.units < units);
+	station_report();
+	return stats.failed ? E_NVM_WRITE : OK;
+}
+
+/*
+ * console: the UART console on a pty until killed, for
+ * wlc_console_test.py. The slave path goes to stdout; the driver log goes
+ * to the pty with the console output, as both share the UART on the board.
+ */
+static int host_console(int argc, char **argv)
+{
+	static DMA_HandleTypeDef dma;
+	struct termios tio;
+	int master;
+	int slave;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		perror("pty");
+		return E_NO_FILE;
+	}
+
+	/* Kept open so that reads do not fail before a peer opens it */
+	slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (slave < 0 || tcgetattr(slave, &tio) != 0) {
+		perror(ptsname(master));
+		return E_NO_FILE;
+	}
+	/* Raw, as a UART: no echo, no line editing, no CR/LF mapping */
+	cfmakeraw(&tio);
+	tcsetattr(slave, TCSANOW, &tio);
+	printf("%s\n", ptsname(master));
+
+	host_uart.fd = master;
+	host_uart.hdmarx = &dma;
+	console_init(&host_uart);
+	for (;;) {
+		console_poll();
+		HAL_Delay(1);
+	}
+	return OK;
+}
+
+/*
+ * ubin <file> [runs]: section table of a UBIN file, then the time to
+ * build it and, apart, to check the file CRC.
+ */
+static int host_ubin(int argc, char **argv)
+{
+	const char *const section_name[WLC_FW_SECTION_COUNT] = { "patch", "cfg" };
+	const struct ubin_section *section;
+	struct ubin_index index;
+	u32 runs = argc > 2 ? strtoul(argv[2], NULL, 0) : HOST_UBIN_RUNS;
+	u32 size;
+	u32 crc;
+	uint64_t start;
+	uint64_t elapsed_ns;
+	long len;
+	u8 *data;
+	FILE *f;
+	u32 i;
+	int err;
+
+	if (argc < 2 || runs == 0)
+		return E_INVALID_INPUT;
+	f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		perror(argv[1]);
+		return E_NO_FILE;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	data = len > 0 ? malloc(len) : NULL;
+	if (data == NULL || fread(data, 1, len, f) != (size_t)len) {
+		fclose(f);
+		free(data);
+		return E_NO_FILE;
+	}
+	fclose(f);
+	size = (u32)len;
+
+	err = ubin_index_build(data, size, &index);
+	if (err != OK) {
+		printf("malformed at offset %lu\n", (unsigned long)index.error_offset);
+		free(data);
+		return err;
+	}
+	u8_to_u32_be(data, &crc);
+	printf("chip %04X cut %02X, %lu bytes, crc %s, %u unknown sections\n",
+		   index.chip_id, index.chip_revision, (unsigned long)size,
+		   ~wlc_crc32_update(0xFFFFFFFF, data + 4, size - 4) == crc ?
+		   "ok" : "BAD", index.unknown);
+	for (i = 0; i < WLC_FW_SECTION_COUNT; i++) {
+		section = ubin_section_get(&index, WLC_FW_SECTION_FIRST + i);
+		if (section)
+			printf("  %-5s id %04X, %lu bytes at %lu\n", section_name[i],
+				   section->version_id, (unsigned long)section->size,
+				   (unsigned long)section->offset);
+	}
+
+	start = host_now_ns();
+	for (i = 0; i < runs; i++)
+		ubin_index_build(data, size, &index);
+	elapsed_ns = host_now_ns() - start;
+	printf("index: %.0f ns per file\n", (double)elapsed_ns / runs);
+
+	start = host_now_ns();
+	for (i = 0; i < runs; i++)
+		crc = wlc_crc32_update(0xFFFFFFFF, data + 4, size - 4);
+	elapsed_ns = host_now_ns() - start;
+	printf("crc: %.0f ns per file, %.1f MB/s\n", (double)elapsed_ns / runs,
+		   (double)size * runs * 1000.0 / (elapsed_ns ? elapsed_ns : 1));
+
+	free(data);
+	return OK;
+}
+
+int main(int argc, char **argv)
+{
+	const char *prog = argv[0];
+	int opt;
+	uint64_t start;
+	int err = OK;
+
+	while ((opt = getopt(argc, argv, "d:v:epf:o:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			host_i2c.Path = optarg;
+			break;
+		case 'v':
+			wlc_set_verify_level((wlc_verify_level_t)atoi(optarg));
+			break;
+		case 'e':
+			wlc_set_nvm_target_erased(1);
+			break;
+		case 'p':
+			wlc_set_progress_cb(host_progress, NULL);
+			break;
+		case 'f':
+			scl_hz = strtoul(optarg, NULL, 0);
+			if (scl_hz == 0)
+				scl_hz = HOST_SCL_HZ_DEFAULT;
+			break;
+		case 'o':
+			if (parse_overlay(optarg) != OK) {
+				usage(prog);
+				return 2;
+			}
+			break;
+		default:
+			usage(prog);
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		usage(prog);
+		return 2;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (strcmp(argv[optind], "ubin") == 0) {
+		err = host_ubin(argc - optind, argv + optind);
+		if (err == E_INVALID_INPUT)
+			usage(prog);
+		return err == OK ? 0 : 1;
+	}
+	host_i2c.SclHz = scl_hz;
+	if (HAL_I2C_Init(&host_i2c) != HAL_OK)
+		return 1;
+	hi2c = &host_i2c;
+	huart = &host_uart;
+
+	argc -= optind;
+	argv += optind;
+	if (strcmp(argv[0], "info") == 0) {
+		chip_info_show(buf);
+		printf("%s", buf);
+	} else if (strcmp(argv[0], "check") == 0) {
+		nvm_check_show(buf);
+		printf("%s", buf);
+	} else if (strcmp(argv[0], "update") == 0) {
+		wlc_host_bus_stats_reset();
+		start = host_now_ns();
+		nvm_program_show(buf);
+		host_update_report(host_now_ns() - start);
+		printf("%s", buf);
+		err = strncmp(buf, "{ 00000000 }", 12) == 0 ? OK : E_NVM_WRITE;
+	} else if (strcmp(argv[0], "snap") == 0) {
+		err = wlc_snapshot_dump() ? E_BUS_R : OK;
+	} else if (strcmp(argv[0], "rd") == 0) {
+		err = host_read(argc, argv);
+	} else if (strcmp(argv[0], "wr") == 0) {
+		err = host_write(argc, argv);
+	} else if (strcmp(argv[0], "bench") == 0) {
+		err = host_bench(argc, argv);
+	} else if (strcmp(argv[0], "faults") == 0) {
+		err = host_faults(argc, argv);
+	} else if (strcmp(argv[0], "station") == 0) {
+		err = host_station(argc, argv);
+	} else if (strcmp(argv[0], "console") == 0) {
+		err = host_console(argc, argv);
+	} else {
+		err = E_INVALID_INPUT;
+	}
+
+	if (err == E_INVALID_INPUT)
+		usage(prog);
+	else if (err != OK)
+		fprintf(stderr, "error %08X\n", err);
+
+	HAL_I2C_DeInit(&host_i2c);
+	return err == OK ? 0 : 1;
+}
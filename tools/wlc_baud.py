@@ -0,0 +1,156 @@
+#!/usr/bin/env python3
+"""
+Host side of the UART baud rate negotiation (UART_Baud_Negotiate()).
+
+Open the ST-LINK virtual COM port, reset the board and let the tool answer
+the @BAUD? offer with the fastest rate both sides support. Rates that do
+not validate cleanly fall back to the next lower one. The log that follows
+is printed (and optionally saved) at the negotiated rate. When a clock
+profile change makes the board drop to 115200, or go back up, it sends
+"@RATE <rate>" first; the tool switches with it.
+
+    wlc_baud.py /dev/ttyACM0 [--max 2000000] [--log capture.bin]
+
+Requires pyserial.
+"""
+
+import argparse
+import sys
+import time
+
+import serial
+
+DEFAULT_BAUD = 115200
+TEST_LEN = 256
+OFFER_TIMEOUT = 10.0
+
+
+def pattern():
+    return bytes((i * 37 + 11) & 0xFF for i in range(TEST_LEN))
+
+
+def read_line(port, timeout):
+    """Return the next '\\n' terminated line without line ending, or None."""
+    deadline = time.monotonic() + timeout
+    line = b""
+    while time.monotonic() < deadline:
+        c = port.read(1)
+        if not c:
+            continue
+        if c == b"\n":
+            return line.rstrip(b"\r").decode("ascii", "replace")
+        line += c
+    return None
+
+
+def wait_offer(port, timeout):
+    """Skip log output until the MCU offers its rates."""
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        line = read_line(port, deadline - time.monotonic())
+        if line is None:
+            break
+        if line.startswith("@BAUD?"):
+            return [int(r) for r in line.split()[1:]]
+    return None
+
+
+def try_rate(port, baud):
+    """Run one @BAUD exchange, return the echo throughput in B/s or None."""
+    port.write(b"@BAUD %d\n" % baud)
+    reply = read_line(port, 0.5)
+    if reply != "@OK %d" % baud:
+        return None
+
+    port.flush()
+    port.baudrate = baud
+    port.reset_input_buffer()
+    data = pattern()
+    start = time.monotonic()
+    port.write(data)
+    echo = b""
+    deadline = start + 0.5
+    while len(echo) < TEST_LEN and time.monotonic() < deadline:
+        echo += port.read(TEST_LEN - len(echo))
+    elapsed = time.monotonic() - start
+    if echo != data:
+        port.baudrate = DEFAULT_BAUD
+        return None
+
+    port.write(b"@ACK\n")
+    return 2 * TEST_LEN / elapsed
+
+
+def follow_log(port, log):
+    """Print the log, switching rate on the board's @RATE lines."""
+    pending = b""
+    while True:
+        data = port.read(4096)
+        if not data:
+            continue
+        pending += data
+        lines = pending.split(b"\n")
+        pending = lines.pop()
+        out = b""
+        for line in lines:
+            text = line.rstrip(b"\r")
+            if text.startswith(b"@RATE "):
+                port.baudrate = int(text.split()[1])
+                print("[board switched to %d baud]" % port.baudrate,
+                      file=sys.stderr)
+                continue
+            out += line + b"\n"
+        # A prompt has no line end; anything but a started @ line goes out
+        if pending and not b"@RATE ".startswith(pending[:6]):
+            out += pending
+            pending = b""
+        if out:
+            sys.stdout.write(out.decode("ascii", "replace"))
+            sys.stdout.flush()
+            if log:
+                log.write(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("port", help="serial port of the ST-LINK VCP")
+    parser.add_argument("--max", type=int, default=4000000,
+                        help="highest rate this host adapter supports")
+    parser.add_argument("--log", help="also write the received log here")
+    args = parser.parse_args()
+
+    port = serial.Serial(args.port, DEFAULT_BAUD, timeout=0.05)
+    print("waiting for the board (reset it now)...", file=sys.stderr)
+    rates = wait_offer(port, OFFER_TIMEOUT)
+    if rates is None:
+        sys.exit("no @BAUD? offer received")
+
+    baud = DEFAULT_BAUD
+    candidates = [r for r in rates if r <= args.max]
+    for i, rate in enumerate(candidates):
+        rate_bps = try_rate(port, rate)
+        if rate_bps is not None:
+            baud = rate
+            print("%d baud validated, echo %.1f KB/s (line limit %.1f KB/s)"
+                  % (rate, rate_bps / 1000, rate / 10 / 1000), file=sys.stderr)
+            break
+        print("%d baud failed, falling back" % rate, file=sys.stderr)
+        port.baudrate = DEFAULT_BAUD
+        if i + 1 < len(candidates) and wait_offer(port, 1.0) is None:
+            break
+    else:
+        print("staying at %d baud" % DEFAULT_BAUD, file=sys.stderr)
+
+    log = open(args.log, "wb") if args.log else None
+    try:
+        follow_log(port, log)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        if log:
+            log.close()
+        print("\nlog rate %d baud" % port.baudrate, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
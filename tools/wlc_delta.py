@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+"""
+Delta update package between two generated STWLC38 nvm_data.h images.
+
+Lists the NVM sectors whose target bytes differ from the source image and
+writes nvm_delta.h: the source and target ids, the target sizes, those
+sectors and their target bytes, the digest of the whole target image and
+the digest of the bytes sent. A driver built with WLC_DELTA programs only
+these sectors, after checking that the chip runs the source patch and cfg
+ids, and checks the digest of what it sent. At the FULL verify level it
+also reads the patch and cfg areas back and checks the target digest.
+
+    wlc_delta.py source_nvm_data.h target_nvm_data.h nvm_delta.h
+"""
+
+import argparse
+import re
+import sys
+
+from wlc_manifest import manifest
+
+SECTOR_SIZE = 256
+PATCH_START_SECTOR = 0
+CFG_START_SECTOR = 126
+
+
+def load_image(path):
+    with open(path) as f:
+        text = f.read()
+
+    def define(name):
+        value = re.search(r"#define\s+%s\s+(\w+)" % name, text)
+        if value is None:
+            raise ValueError("%s: no %s define" % (path, name))
+        return int(value.group(1), 0)
+
+    def array(name):
+        body = re.search(r"%s\[\]\s*=\s*\{(.*?)\}" % name, text, re.S)
+        if body is None:
+            raise ValueError("%s: no %s[] in the header" % (path, name))
+        return bytes(int(v, 16)
+                     for v in re.findall(r"0x[0-9A-Fa-f]+", body.group(1)))
+
+    return {"chip_id": define("NVM_TARGET_CHIP_ID"),
+            "cut_id": define("NVM_TARGET_CUT_ID"),
+            "patch_id": define("NVM_PATCH_VERSION_ID"),
+            "cfg_id": define("NVM_CFG_VERSION_ID"),
+            "patch": array("nvm_patch_data"),
+            "cfg": array("nvm_cfg_data")}
+
+
+def changed_sectors(source, target):
+    """(sector index, target bytes) of every sector the update must write."""
+    sectors = []
+    for part, start in (("patch", PATCH_START_SECTOR),
+                        ("cfg", CFG_START_SECTOR)):
+        new = target[part]
+        old = source[part]
+        for offset in range(0, len(new), SECTOR_SIZE):
+            chunk = new[offset:offset + SECTOR_SIZE]
+            if old[offset:offset + len(chunk)] != chunk:
+                sectors.append((start + offset // SECTOR_SIZE, chunk))
+    return sectors
+
+
+def byte_rows(data):
+    return "\n".join("\t" + ",".join("0x%02X" % b for b in data[i:i + 16]) +
+                     "," for i in range(0, len(data), 16))
+
+
+def delta_header(source, target, sectors):
+    payload = b"".join(chunk for _, chunk in sectors)
+    return ("/* Generated by wlc_delta.py */\n"
+            "#ifndef NVM_DELTA_H\n"
+            "#define NVM_DELTA_H\n"
+            "#define NVM_TARGET_CHIP_ID %d\n" % target["chip_id"] +
+            "#define NVM_TARGET_CUT_ID %d\n" % target["cut_id"] +
+            "#define NVM_CFG_SIZE %d\n" % len(target["cfg"]) +
+            "#define NVM_CFG_VERSION_ID 0x%04X\n" % target["cfg_id"] +
+            "#define NVM_PATCH_SIZE %d\n" % len(target["patch"]) +
+            "#define NVM_PATCH_VERSION_ID 0x%04X\n" % target["patch_id"] +
+            manifest(target["patch"] + target["cfg"]) +
+            "#define NVM_DELTA_SOURCE_PATCH_ID 0x%04X\n" % source["patch_id"] +
+            "#define NVM_DELTA_SOURCE_CFG_ID 0x%04X\n" % source["cfg_id"] +
+            "#define NVM_DELTA_SECTORS %d\n" % len(sectors) +
+            "#define NVM_DELTA_BYTES %d\n" % len(payload) +
+            manifest(payload, "NVM_DELTA") +
+            "const uint8_t nvm_delta_sectors[] = {\n" +
+            byte_rows(bytes(index for index, _ in sectors) or b"\0") +
+            "\n};\n"
+            "const uint8_t nvm_delta_data[] = {\n" +
+            byte_rows(payload or b"\0") + "\n};\n"
+            "#endif\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("source", help="nvm_data.h the chips run now")
+    parser.add_argument("target", help="nvm_data.h to move them to")
+    parser.add_argument("output", help="nvm_delta.h to write")
+    args = parser.parse_args()
+
+    try:
+        source = load_image(args.source)
+        target = load_image(args.target)
+    except ValueError as e:
+        sys.exit(str(e))
+    if (source["chip_id"], source["cut_id"]) != (target["chip_id"],
+                                                 target["cut_id"]):
+        sys.exit("source and target are built for different chips")
+    if (source["patch_id"], source["cfg_id"]) == (target["patch_id"],
+                                                  target["cfg_id"]):
+        sys.exit("source and target have the same patch and cfg ids")
+
+    sectors = changed_sectors(source, target)
+    with open(args.output, "w") as f:
+        f.write(delta_header(source, target, sectors))
+
+    total = len(target["patch"]) + len(target["cfg"])
+    sent = sum(len(chunk) for _, chunk in sectors)
+    print("%04X/%04X -> %04X/%04X: %d sectors, %d of %d bytes (%.1f%%)" %
+          (source["patch_id"], source["cfg_id"], target["patch_id"],
+           target["cfg_id"], len(sectors), sent, total, 100.0 * sent / total),
+          file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""
+Image manifest of a generated STWLC38 nvm_data.h.
+
+The driver digests the patch then the cfg bytes while it programs them and
+compares the result against NVM_IMAGE_CRC32 (and NVM_IMAGE_SHA256 when
+built with WLC_DIGEST_SHA256) if the header defines them. This prints the
+two defines, or with --write adds them to the header, replacing any
+earlier manifest.
+
+    wlc_manifest.py STSW-WLC38RX-nvm_data.h [--write]
+"""
+
+import argparse
+import hashlib
+import re
+import sys
+import zlib
+
+MANIFEST_RE = re.compile(r"^#define\s+NVM_IMAGE_(CRC32|SHA256)\b.*\n", re.M)
+ANCHOR_RE = re.compile(r"^#define\s+NVM_PATCH_VERSION_ID\b.*\n", re.M)
+
+
+def image_bytes(text):
+    """Patch then cfg data, in programming order."""
+    def array(name):
+        body = re.search(r"%s\[\]\s*=\s*\{(.*?)\}" % name, text, re.S)
+        if body is None:
+            raise ValueError("no %s[] in the header" % name)
+        return bytes(int(v, 16)
+                     for v in re.findall(r"0x[0-9A-Fa-f]+", body.group(1)))
+
+    return array("nvm_patch_data") + array("nvm_cfg_data")
+
+
+def manifest(image, prefix="NVM_IMAGE"):
+    sha = hashlib.sha256(image).digest()
+    return ("#define %s_CRC32 0x%08X\n" % (prefix, zlib.crc32(image)) +
+            "#define %s_SHA256 " % prefix +
+            ",".join("0x%02X" % b for b in sha) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("header", help="generated nvm_data.h")
+    parser.add_argument("--write", action="store_true",
+                        help="add the manifest to the header")
+    args = parser.parse_args()
+
+    with open(args.header) as f:
+        text = f.read()
+    try:
+        lines = manifest(image_bytes(text))
+    except ValueError as e:
+        sys.exit("%s: %s" % (args.header, e))
+
+    if not args.write:
+        sys.stdout.write(lines)
+        return
+
+    text = MANIFEST_RE.sub("", text)
+    anchor = ANCHOR_RE.search(text)
+    if anchor is None:
+        sys.exit("%s: no NVM_PATCH_VERSION_ID define" % args.header)
+    text = text[:anchor.end()] + lines + text[anchor.end():]
+    with open(args.header, "w", newline="") as f:
+        f.write(text)
+
+
+if __name__ == "__main__":
+    main()
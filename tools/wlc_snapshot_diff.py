@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""
+Decode and compare STWLC38 register snapshots (wlc_snapshot_dump()).
+
+A snapshot is the binary stream sent by the console 'snap' command on the
+log UART; capture it to a file (e.g. wlc_baud.py --log). Text around it is
+skipped.
+
+    wlc_snapshot_diff.py good.bin              hex dump of one snapshot
+    wlc_snapshot_diff.py good.bin bad.bin      registers that differ
+"""
+
+import argparse
+import struct
+import sys
+
+SNAP_MAGIC = 0x504E5357  # "WSNP"
+HEADER = struct.Struct("<IHHIHH")
+RECORD = struct.Struct("<IHBB")
+
+SPACE_FW = 0
+SPACE_HW = 1
+SPACE_END = 0xFF
+SPACE_NAME = {SPACE_FW: "FW", SPACE_HW: "HW"}
+
+
+def parse(data):
+    """Return (header dict, {(space, addr): byte}, [unreadable chunks])."""
+    pos = data.rfind(struct.pack("<I", SNAP_MAGIC))
+    if pos < 0 or pos + HEADER.size > len(data):
+        raise ValueError("no snapshot header found")
+
+    _, version, rec_size, timestamp, chip_id, chunk = \
+        HEADER.unpack_from(data, pos)
+    header = {"version": version, "timestamp_ms": timestamp,
+              "chip_id": chip_id, "chunk_size": chunk}
+    regs = {}
+    failed = []
+    pos += HEADER.size
+    while True:
+        if pos + rec_size > len(data):
+            raise ValueError("snapshot truncated")
+        addr, length, space, status = RECORD.unpack_from(data, pos)
+        pos += rec_size
+        if space == SPACE_END:
+            break
+        if status != 0:
+            failed.append((space, addr, length))
+            continue
+        if pos + length > len(data):
+            raise ValueError("snapshot truncated")
+        for i, value in enumerate(data[pos:pos + length]):
+            regs[(space, addr + i)] = value
+        pos += length
+
+    return header, regs, failed
+
+
+def load(path):
+    with open(path, "rb") as f:
+        return parse(f.read())
+
+
+def fmt_addr(space, addr):
+    return "%s 0x%08X" % (SPACE_NAME[space], addr) if space == SPACE_HW \
+        else "%s 0x%04X" % (SPACE_NAME[space], addr)
+
+
+def runs(keys):
+    """Group sorted (space, addr) keys into contiguous runs."""
+    run = []
+    for key in keys:
+        if run and (key[0] != run[-1][0] or key[1] != run[-1][1] + 1):
+            yield run
+            run = []
+        run.append(key)
+    if run:
+        yield run
+
+
+def dump(header, regs, failed):
+    print("chip 0x%04X, taken at %d ms, %d bytes" %
+          (header["chip_id"], header["timestamp_ms"], len(regs)))
+    for run in runs(sorted(regs)):
+        for i in range(0, len(run), 16):
+            line = run[i:i + 16]
+            print("%s: %s" % (fmt_addr(*line[0]),
+                              " ".join("%02X" % regs[k] for k in line)))
+    for space, addr, length in failed:
+        print("%s: %d bytes unreadable" % (fmt_addr(space, addr), length))
+
+
+def diff(a, b):
+    regs_a, regs_b = a[1], b[1]
+    keys = sorted(set(regs_a) | set(regs_b))
+    changed = [k for k in keys if regs_a.get(k) != regs_b.get(k)]
+    for run in runs(changed):
+        old = " ".join("%02X" % regs_a[k] if k in regs_a else "--"
+                       for k in run)
+        new = " ".join("%02X" % regs_b[k] if k in regs_b else "--"
+                       for k in run)
+        print("%s [%d]: %s -> %s" % (fmt_addr(*run[0]), len(run), old, new))
+    print("%d of %d bytes differ" % (len(changed), len(keys)),
+          file=sys.stderr)
+    return 1 if changed else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("snapshot", help="reference snapshot capture")
+    parser.add_argument("other", nargs="?", help="snapshot to compare")
+    args = parser.parse_args()
+
+    first = load(args.snapshot)
+    if args.other is None:
+        dump(*first)
+        return 0
+    return diff(first, load(args.other))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
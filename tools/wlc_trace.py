@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""
+Convert a STWLC38 driver I2C trace dump to CSV and VCD.
+
+The dump is the raw binary sent by wlc_trace_dump() on the log UART
+(build with WLC_TRACE defined). Capture the UART to a file with any
+terminal program, log text around the dump is skipped.
+
+    wlc_trace.py capture.bin --csv trace.csv --vcd trace.vcd
+
+The VCD opens in PulseView or GTKWave: 'busy' is high for the duration of
+each transaction, 'read' and 'sysreg' give its kind, 'addr', 'len',
+'status' and 'retries' its fields.
+"""
+
+import argparse
+import csv
+import struct
+import sys
+
+TRACE_MAGIC = 0x43525457  # "WTRC"
+HEADER = struct.Struct("<IHHIII")
+RECORD = struct.Struct("<IIIHBB")
+
+F_READ = 0x01
+F_SYSREG = 0x02
+F_LIST = 0x04
+RETRY_SHIFT = 4
+
+HAL_STATUS = {0: "OK", 1: "ERROR", 2: "BUSY", 3: "TIMEOUT"}
+
+
+def parse(data):
+    """Return (header dict, list of record dicts) of the last dump in data."""
+    pos = data.rfind(struct.pack("<I", TRACE_MAGIC))
+    if pos < 0 or pos + HEADER.size > len(data):
+        raise ValueError("no trace header found")
+
+    magic, version, rec_size, count, dropped, cpu_hz = \
+        HEADER.unpack_from(data, pos)
+    if rec_size < RECORD.size:
+        raise ValueError("unsupported record size %d" % rec_size)
+
+    header = {"version": version, "count": count, "dropped": dropped,
+              "cpu_hz": cpu_hz}
+    records = []
+    pos += HEADER.size
+    for _ in range(count):
+        if pos + rec_size > len(data):
+            print("warning: dump truncated after %d records" % len(records),
+                  file=sys.stderr)
+            break
+        ts, duration, addr, length, flags, status = \
+            RECORD.unpack_from(data, pos)
+        records.append({"timestamp": ts, "duration": duration, "addr": addr,
+                        "length": length, "flags": flags, "status": status})
+        pos += rec_size
+
+    # Unwrap the 32-bit cycle counter into a monotonic time base
+    base = 0
+    last = None
+    for rec in records:
+        if last is not None and rec["timestamp"] < last:
+            base += 1 << 32
+        last = rec["timestamp"]
+        rec["cycles"] = base + rec["timestamp"]
+
+    return header, records
+
+
+def write_csv(path, header, records):
+    hz = header["cpu_hz"] or 1
+    t0 = records[0]["cycles"] if records else 0
+    with open(path, "w", newline="") as f:
+        out = csv.writer(f)
+        out.writerow(["index", "time_us", "duration_us", "dir", "space",
+                      "list", "addr", "length", "status", "retries"])
+        for i, rec in enumerate(records):
+            out.writerow([
+                i,
+                "%.3f" % ((rec["cycles"] - t0) * 1e6 / hz),
+                "%.3f" % (rec["duration"] * 1e6 / hz),
+                "R" if rec["flags"] & F_READ else "W",
+                "SYSREG" if rec["flags"] & F_SYSREG else "FW",
+                1 if rec["flags"] & F_LIST else 0,
+                "0x%08X" % rec["addr"] if rec["flags"] & F_SYSREG
+                else "0x%04X" % rec["addr"],
+                rec["length"],
+                HAL_STATUS.get(rec["status"], rec["status"]),
+                rec["flags"] >> RETRY_SHIFT,
+            ])
+
+
+def write_vcd(path, header, records):
+    hz = header["cpu_hz"] or 1
+    t0 = records[0]["cycles"] if records else 0
+    signals = [("busy", 1, "!"), ("read", 1, '"'), ("sysreg", 1, "#"),
+               ("addr", 32, "$"), ("len", 16, "%"), ("status", 8, "&"),
+               ("retries", 4, "'")]
+
+    def ns(cycles):
+        return int((cycles - t0) * 1e9 / hz)
+
+    def value(width, ident, val):
+        if width == 1:
+            return "%d%s" % (val, ident)
+        return "b%s %s" % (format(val, "b"), ident)
+
+    events = []
+    for rec in records:
+        start = ns(rec["cycles"])
+        end = max(ns(rec["cycles"] + rec["duration"]), start + 1)
+        events.append((start, [
+            ("busy", 1),
+            ("read", 1 if rec["flags"] & F_READ else 0),
+            ("sysreg", 1 if rec["flags"] & F_SYSREG else 0),
+            ("addr", rec["addr"]),
+            ("len", rec["length"]),
+            ("status", rec["status"]),
+            ("retries", rec["flags"] >> RETRY_SHIFT),
+        ]))
+        events.append((end, [("busy", 0)]))
+    events.sort(key=lambda e: e[0])
+
+    ids = {name: (width, ident) for name, width, ident in signals}
+    with open(path, "w") as f:
+        f.write("$timescale 1ns $end\n")
+        f.write("$scope module stwlc38_i2c $end\n")
+        for name, width, ident in signals:
+            f.write("$var wire %d %s %s $end\n" % (width, ident, name))
+        f.write("$upscope $end\n$enddefinitions $end\n")
+        f.write("#0\n$dumpvars\n")
+        for name, width, ident in signals:
+            f.write(value(width, ident, 0) + "\n")
+        f.write("$end\n")
+        last = None
+        for time, changes in events:
+            if time != last:
+                f.write("#%d\n" % time)
+                last = time
+            for name, val in changes:
+                width, ident = ids[name]
+                f.write(value(width, ident, val) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("dump", help="binary capture of wlc_trace_dump()")
+    parser.add_argument("--csv", help="write CSV to this file")
+    parser.add_argument("--vcd", help="write VCD timeline to this file")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        header, records = parse(f.read())
+
+    print("%d records, %d dropped, %d Hz" %
+          (len(records), header["dropped"], header["cpu_hz"]))
+    if args.csv:
+        write_csv(args.csv, header, records)
+    if args.vcd:
+        write_vcd(args.vcd, header, records)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""
+Build a STWLC38 UBIN file from a generated nvm_data.h.
+
+Writes the main header (CRC, signature, chip and cut ids) and one section
+per image part, in the order given by --order, so the driver can be tried
+against files whose sections do not come patch first. With --c-header it
+also writes the ubin_data.h the UBIN build of the driver includes.
+
+    wlc_ubin.py STSW-WLC38RX-nvm_data.h out.ubin [--order cfg,patch]
+                [--c-header ubin_data.h]
+"""
+
+import argparse
+import re
+import struct
+import sys
+import zlib
+
+BIN_HEADER = 0xBABEFACE
+SECTION_HEADER = 0xB16B00B5
+BIN_HEADER_SIZE = 36
+SECTION_HEADER_SIZE = 20
+BIN_HDR_CHIP_ID = 9
+BIN_HDR_CUT_ID = 27
+
+SECTION_TYPES = {"patch": 0x0010, "cfg": 0x0011}
+
+
+def load_image(text):
+    def define(name):
+        value = re.search(r"#define\s+%s\s+(\w+)" % name, text)
+        if value is None:
+            raise ValueError("no %s define" % name)
+        return int(value.group(1), 0)
+
+    def array(name):
+        body = re.search(r"%s\[\]\s*=\s*\{(.*?)\}" % name, text, re.S)
+        if body is None:
+            raise ValueError("no %s[] in the header" % name)
+        return bytes(int(v, 16)
+                     for v in re.findall(r"0x[0-9A-Fa-f]+", body.group(1)))
+
+    return {"chip_id": define("NVM_TARGET_CHIP_ID"),
+            "cut_id": define("NVM_TARGET_CUT_ID"),
+            "patch": (define("NVM_PATCH_VERSION_ID"),
+                      array("nvm_patch_data")),
+            "cfg": (define("NVM_CFG_VERSION_ID"), array("nvm_cfg_data"))}
+
+
+def build(image, order):
+    header = bytearray(BIN_HEADER_SIZE - 4)
+    struct.pack_into(">I", header, 0, BIN_HEADER)
+    struct.pack_into("<H", header, BIN_HDR_CHIP_ID - 4, image["chip_id"])
+    header[BIN_HDR_CUT_ID - 4] = image["cut_id"]
+
+    body = bytes(header)
+    for name in order:
+        version_id, data = image[name]
+        body += struct.pack(">IHHI8x", SECTION_HEADER, SECTION_TYPES[name],
+                            version_id, len(data)) + data
+    return struct.pack(">I", zlib.crc32(body)) + body
+
+
+def c_header(ubin):
+    rows = ["\t" + ",".join("0x%02X" % b for b in ubin[i:i + 16]) + ","
+            for i in range(0, len(ubin), 16)]
+    return ("/* Generated by wlc_ubin.py */\n"
+            "static u8 ubin_data[] = {\n" + "\n".join(rows) + "\n};\n"
+            "static int ubin_size = %d;\n" % len(ubin))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument("header", help="generated nvm_data.h")
+    parser.add_argument("output", help="UBIN file to write")
+    parser.add_argument("--order", default="patch,cfg",
+                        help="section order, comma separated")
+    parser.add_argument("--c-header", help="also write ubin_data.h here")
+    args = parser.parse_args()
+
+    order = args.order.split(",")
+    if sorted(order) != sorted(SECTION_TYPES):
+        sys.exit("--order takes patch and cfg once each")
+
+    with open(args.header) as f:
+        text = f.read()
+    try:
+        ubin = build(load_image(text), order)
+    except ValueError as e:
+        sys.exit("%s: %s" % (args.header, e))
+
+    with open(args.output, "wb") as f:
+        f.write(ubin)
+    if args.c_header:
+        with open(args.c_header, "w") as f:
+            f.write(c_header(ubin))
+
+
+if __name__ == "__main__":
+    main()